@@ -0,0 +1,659 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#define LENGTH 2082
+#define SENDER_NAME "bench-sender"
+#define BENCH_PASSWORD "benchpw"
+
+/* One receiving client */
+typedef struct {
+    int sock;
+    int id;
+    int expected;
+    _Atomic int received;
+    _Atomic int saw_sender;
+    double *latency_us;
+    pthread_t tid;
+} receiver_t;
+
+/* Result of one latency run */
+typedef struct {
+    int samples;
+    double p50;
+    double p99;
+    double max;
+} latency_result_t;
+
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Connect and send the 32-byte username and password blocks */
+int bench_connect(const char *ip, int port, const char *user, const char *passwd) {
+    struct sockaddr_in serv_addr;
+    char block[32];
+    int sock, option = 1;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = inet_addr(ip);
+    serv_addr.sin_port = htons(port);
+    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+
+    memset(block, 0, sizeof(block));
+    snprintf(block, sizeof(block), "%s", user);
+    send(sock, block, sizeof(block), 0);
+    memset(block, 0, sizeof(block));
+    snprintf(block, sizeof(block), "%s", passwd);
+    send(sock, block, sizeof(block), 0);
+    return sock;
+}
+
+/* Parse complete lines, recording latency of "bench-sender: <seq> <ns>" */
+void *receiver_main(void *arg) {
+    receiver_t *r = arg;
+    char buffer[LENGTH * 4];
+    int used = 0;
+
+    while (1) {
+        int l = recv(r->sock, buffer + used, sizeof(buffer) - used - 1, 0);
+        char *line, *nl;
+
+        if (l <= 0)
+            break;
+        used += l;
+        buffer[used] = '\0';
+
+        line = buffer;
+        while ((nl = memchr(line, '\n', buffer + used - line)) != NULL) {
+            char *p;
+            int seq;
+            long long sent;
+
+            *nl = '\0';
+            if ((p = strstr(line, SENDER_NAME ": ")) != NULL
+                && sscanf(p + strlen(SENDER_NAME) + 2, "%d %lld", &seq, &sent) == 2) {
+                if (seq >= 0 && seq < r->expected && r->latency_us[seq] == 0) {
+                    r->latency_us[seq] = (now_ns() - sent) / 1000.0;
+                    r->received++;
+                }
+            }
+            else if (strncmp(line, "PRESENCE ", 9) == 0 && strstr(line, " +" SENDER_NAME) != NULL) {
+                r->saw_sender = 1;
+            }
+            else if (strcmp(line, "PING") == 0) {
+                send(r->sock, "PONG\n", 5, 0);
+            }
+            line = nl + 1;
+        }
+        used = buffer + used - line;
+        memmove(buffer, line, used);
+        if (used >= (int)sizeof(buffer) - 1)
+            used = 0;
+    }
+    return NULL;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Broadcast <messages> timestamped lines to <nrecv> receivers, one every <gap_us> */
+int run_latency(const char *ip, int port, const char *passwd, int nrecv, int messages,
+                int gap_us, latency_result_t *res) {
+    receiver_t *recvs = calloc(nrecv, sizeof(receiver_t));
+    double *all;
+    char name[32], buffer[LENGTH];
+    int sender, total = 0;
+    long long deadline;
+
+    for (int i = 0; i < nrecv; i++) {
+        snprintf(name, sizeof(name), "bench%d", i);
+        recvs[i].id = i;
+        recvs[i].expected = messages;
+        recvs[i].latency_us = calloc(messages, sizeof(double));
+        if ((recvs[i].sock = bench_connect(ip, port, name, passwd)) < 0) {
+            printf("ERROR: connect failed for receiver %d\n", i);
+            return -1;
+        }
+        pthread_create(&recvs[i].tid, NULL, receiver_main, &recvs[i]);
+    }
+
+    /* The sender joins last; once receiver 0 sees it, everyone is in */
+    if ((sender = bench_connect(ip, port, SENDER_NAME, passwd)) < 0) {
+        printf("ERROR: connect failed for sender\n");
+        return -1;
+    }
+    deadline = now_ns() + (long long)(nrecv + 30) * 1000000000LL;
+    while (!recvs[0].saw_sender && now_ns() < deadline)
+        usleep(10000);
+    usleep(200000);
+
+    for (int seq = 0; seq < messages; seq++) {
+        int len = snprintf(buffer, sizeof(buffer), "%s: %d %lld \n", SENDER_NAME, seq, now_ns());
+        send(sender, buffer, len, 0);
+        usleep(gap_us);
+    }
+
+    deadline = now_ns() + 5000000000LL;
+    for (int i = 0; i < nrecv; i++) {
+        while (recvs[i].received < messages && now_ns() < deadline)
+            usleep(10000);
+    }
+
+    all = malloc(sizeof(double) * nrecv * messages);
+    for (int i = 0; i < nrecv; i++) {
+        shutdown(recvs[i].sock, SHUT_RDWR);
+        pthread_join(recvs[i].tid, NULL);
+        close(recvs[i].sock);
+        for (int seq = 0; seq < messages; seq++) {
+            if (recvs[i].latency_us[seq] > 0)
+                all[total++] = recvs[i].latency_us[seq];
+        }
+        free(recvs[i].latency_us);
+    }
+    close(sender);
+    free(recvs);
+
+    qsort(all, total, sizeof(double), compare_double);
+    res->samples = total;
+    res->p50 = total ? all[total / 2] : 0;
+    res->p99 = total ? all[(int)(total * 0.99)] : 0;
+    res->max = total ? all[total - 1] : 0;
+    free(all);
+    return 0;
+}
+
+void print_latency(const char *label, latency_result_t *res) {
+    printf("%-12s samples %-8d p50 %9.1f us  p99 %9.1f us  max %9.1f us\n",
+        label, res->samples, res->p50, res->p99, res->max);
+}
+
+/* Start <server> on <port> with extra options and wait until it accepts */
+pid_t spawn_server(const char *server, int port, char **options) {
+    char port_str[16];
+    char *args[32];
+    int n = 0;
+    pid_t pid;
+
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    args[n++] = (char *)server;
+    args[n++] = port_str;
+    args[n++] = BENCH_PASSWORD;
+    for (int i = 0; options && options[i] && n < 31; i++)
+        args[n++] = options[i];
+    args[n] = NULL;
+
+    if ((pid = fork()) == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        execv(server, args);
+        perror("ERROR: exec server");
+        _exit(1);
+    }
+
+    for (int i = 0; i < 100; i++) {
+        struct sockaddr_in addr;
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+        addr.sin_port = htons(port);
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            close(sock);
+            return pid;
+        }
+        close(sock);
+        usleep(50000);
+    }
+    kill(pid, SIGTERM);
+    return -1;
+}
+
+void stop_server(pid_t pid) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+/* Compare p99 broadcast latency with and without thread pinning */
+int bench_pinning(const char *server, int nrecv, int messages) {
+    char cpus[32], pin_io[48], pin_accept[32];
+    char *unpinned[] = { "client_msgs_per_sec=0", "room_msgs_per_sec=0", NULL };
+    char *pinned[] = { "client_msgs_per_sec=0", "room_msgs_per_sec=0", pin_accept, pin_io, NULL };
+    latency_result_t unpinned_res, pinned_res;
+    int port = 20000 + getpid() % 20000;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    pid_t pid;
+
+    snprintf(cpus, sizeof(cpus), ncpu > 1 ? "0-%ld" : "0", ncpu - 1);
+    snprintf(pin_accept, sizeof(pin_accept), "pin_accept=0");
+    snprintf(pin_io, sizeof(pin_io), "pin_io=%s", cpus);
+
+    if ((pid = spawn_server(server, port, unpinned)) < 0)
+        return -1;
+    run_latency("127.0.0.1", port, BENCH_PASSWORD, nrecv, messages, 2000, &unpinned_res);
+    stop_server(pid);
+
+    if ((pid = spawn_server(server, port + 1, pinned)) < 0)
+        return -1;
+    run_latency("127.0.0.1", port + 1, BENCH_PASSWORD, nrecv, messages, 2000, &pinned_res);
+    stop_server(pid);
+
+    print_latency("unpinned", &unpinned_res);
+    print_latency("pinned", &pinned_res);
+    return 0;
+}
+
+/* One member of the rooms benchmark */
+typedef struct {
+    int sock;
+    int room;
+    int joined;
+    int used;
+    char name[32];
+    char buf[1024];
+} member_t;
+
+typedef struct {
+    member_t *members;
+    int count;
+    int epfd;
+    _Atomic int joined;
+    _Atomic long received;
+    _Atomic int stop;
+    double *latency_us;
+    long max_samples;
+    double *last_us;            /* per message seq: latency of the last recipient */
+    int messages;
+} rooms_state_t;
+
+/* Drain every member socket; counts joins (the reply to the PART after the
+   JOIN) and timestamped room messages */
+void *rooms_receiver(void *arg) {
+    rooms_state_t *st = arg;
+    struct epoll_event events[256];
+
+    while (!st->stop) {
+        int n = epoll_wait(st->epfd, events, 256, 100);
+        for (int i = 0; i < n; i++) {
+            member_t *m = events[i].data.ptr;
+            int l;
+
+            while ((l = recv(m->sock, m->buf + m->used, sizeof(m->buf) - m->used - 1, 0)) > 0) {
+                char *line = m->buf, *nl;
+                m->used += l;
+                m->buf[m->used] = '\0';
+                while ((nl = memchr(line, '\n', m->buf + m->used - line)) != NULL) {
+                    char *p;
+                    int seq;
+                    long long sent;
+
+                    *nl = '\0';
+                    if ((p = strstr(line, "u0: ")) != NULL && sscanf(p + 4, "%d %lld", &seq, &sent) == 2) {
+                        long k = st->received++;
+                        double us = (now_ns() - sent) / 1000.0;
+                        if (k < st->max_samples)
+                            st->latency_us[k] = us;
+                        if (seq >= 0 && seq < st->messages && us > st->last_us[seq])
+                            st->last_us[seq] = us;
+                    }
+                    else if (!m->joined && strcmp(line, "Not in that room.") == 0) {
+                        m->joined = 1;
+                        st->joined++;
+                    }
+                    else if (strcmp(line, "PING") == 0) {
+                        send(m->sock, "PONG\n", 5, 0);
+                    }
+                    line = nl + 1;
+                }
+                m->used = m->buf + m->used - line;
+                memmove(m->buf, line, m->used);
+                if (m->used >= (int)sizeof(m->buf) - 1)
+                    m->used = 0;
+            }
+        }
+    }
+    return NULL;
+}
+
+unsigned long process_cpu_ms(pid_t pid) {
+    char path[64];
+    unsigned long utime = 0, stime = 0;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if ((fp = fopen(path, "r")) == NULL)
+        return 0;
+    fscanf(fp, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+    fclose(fp);
+    return (utime + stime) * 1000 / sysconf(_SC_CLK_TCK);
+}
+
+/* <nrooms> rooms of <users> members; member 0 of each room posts <messages> lines.
+   <extra> are more server options; *last_p50 gets the median time to the
+   last recipient of a message. */
+int bench_rooms(const char *server, int nrooms, int users, int messages, char **extra, double *last_p50) {
+    char max_clients[48], *options[32] = {
+        "join_lobby=0", "client_msgs_per_sec=0", "room_msgs_per_sec=0",
+        "client_bytes_per_sec=0", "room_bytes_per_sec=0", "max_preauth=4096", max_clients, NULL
+    };
+    int port = 20000 + getpid() % 20000;
+    rooms_state_t st;
+    struct rlimit rl;
+    pthread_t tid;
+    long expected = (long)nrooms * messages * (users - 1);
+    long long start, deadline;
+    unsigned long cpu_before;
+    char buffer[LENGTH];
+    pid_t pid;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    snprintf(max_clients, sizeof(max_clients), "max_clients=%d", nrooms * users + 16);
+    for (int i = 0, n = 7; extra && extra[i] && n < 31; i++)
+        options[n++] = extra[i];
+    if ((pid = spawn_server(server, port, options)) < 0)
+        return -1;
+
+    memset(&st, 0, sizeof(st));
+    st.count = nrooms * users;
+    st.members = calloc(st.count, sizeof(member_t));
+    st.max_samples = expected;
+    st.latency_us = calloc(expected, sizeof(double));
+    st.messages = messages;
+    st.last_us = calloc(messages, sizeof(double));
+    st.epfd = epoll_create1(0);
+    pthread_create(&tid, NULL, rooms_receiver, &st);
+
+    for (int i = 0; i < st.count; i++) {
+        member_t *m = &st.members[i];
+        struct epoll_event ev;
+
+        m->room = i / users;
+        snprintf(m->name, sizeof(m->name), "r%du%d", m->room, i % users);
+        if ((m->sock = bench_connect("127.0.0.1", port, m->name, BENCH_PASSWORD)) < 0) {
+            printf("ERROR: connect failed for %s\n", m->name);
+            stop_server(pid);
+            return -1;
+        }
+        fcntl(m->sock, F_SETFL, fcntl(m->sock, F_GETFL) | O_NONBLOCK);
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = m;
+        epoll_ctl(st.epfd, EPOLL_CTL_ADD, m->sock, &ev);
+        /* Rosters and presence batches grow with the room; keep them out of
+           the way, and use the reply to a bogus PART to see the JOIN is done */
+        snprintf(buffer, sizeof(buffer), "PRESENCE OFF\nJOIN r%d\nPART -\n", m->room);
+        send(m->sock, buffer, strlen(buffer), 0);
+        if (i % 200 == 199)
+            usleep(20000);
+    }
+    deadline = now_ns() + 60000000000LL;
+    while (st.joined < st.count && now_ns() < deadline)
+        usleep(10000);
+    if (st.joined < st.count)
+        printf("WARNING: only %d of %d members joined\n", (int)st.joined, st.count);
+    usleep(200000);
+
+    cpu_before = process_cpu_ms(pid);
+    start = now_ns();
+    for (int seq = 0; seq < messages; seq++) {
+        for (int r = 0; r < nrooms; r++) {
+            int len = snprintf(buffer, sizeof(buffer), "r%du0: %d %lld \n", r, seq, now_ns());
+            send(st.members[r * users].sock, buffer, len, 0);
+        }
+        /* A single room is paced so each message fans out on its own */
+        while (nrooms == 1 && st.received < (long)(seq + 1) * (users - 1) && now_ns() - start < 60000000000LL)
+            usleep(1000);
+        usleep(10000);
+    }
+    deadline = now_ns() + 10000000000LL;
+    while (st.received < expected && now_ns() < deadline)
+        usleep(10000);
+
+    {
+        double secs = (now_ns() - start) / 1e9;
+        unsigned long cpu = process_cpu_ms(pid) - cpu_before;
+        long total = st.received < expected ? st.received : expected;
+
+        qsort(st.latency_us, total, sizeof(double), compare_double);
+        printf("rooms %d x %d members, %d messages per room\n", nrooms, users, messages);
+        printf("delivered %ld of %ld in %.2f s (%.0f/s), server cpu %lu ms (%.2f us per delivery)\n",
+            (long)st.received, expected, secs, st.received / secs, cpu,
+            st.received ? cpu * 1000.0 / st.received : 0);
+        printf("latency      p50 %9.1f us  p99 %9.1f us  max %9.1f us\n",
+            total ? st.latency_us[total / 2] : 0, total ? st.latency_us[(long)(total * 0.99)] : 0,
+            total ? st.latency_us[total - 1] : 0);
+        qsort(st.last_us, messages, sizeof(double), compare_double);
+        printf("last recipient p50 %9.1f us  max %9.1f us\n", st.last_us[messages / 2], st.last_us[messages - 1]);
+        if (last_p50)
+            *last_p50 = st.last_us[messages / 2];
+    }
+
+    st.stop = 1;
+    pthread_join(tid, NULL);
+    for (int i = 0; i < st.count; i++)
+        close(st.members[i].sock);
+    stop_server(pid);
+    free(st.members);
+    free(st.latency_us);
+    free(st.last_us);
+    return 0;
+}
+
+/* Time to the last recipient in one room of 100 .. 20000 members, fanned
+   out inline and across the server's fan-out threads */
+int bench_fanout(const char *server, int threads, int messages) {
+    static const int sizes[] = { 100, 1000, 5000, 10000, 20000 };
+    char fanout_threads[48];
+    char *inline_opts[] = { "fanout_threshold=0", NULL };
+    char *parallel_opts[] = { "fanout_threshold=1", "fanout_chunk=256", fanout_threads, NULL };
+    double inline_us[5], parallel_us[5];
+    struct rlimit rl;
+    int n = 0;
+
+    snprintf(fanout_threads, sizeof(fanout_threads), "fanout_threads=%d", threads);
+    getrlimit(RLIMIT_NOFILE, &rl);
+    for (; n < 5; n++) {
+        /* The bench and the server each hold one socket per member */
+        if ((rlim_t)sizes[n] + 64 > rl.rlim_max) {
+            printf("stopping at %d members: open file limit is %ld\n", sizes[n], (long)rl.rlim_max);
+            break;
+        }
+        if (bench_rooms(server, 1, sizes[n], messages, inline_opts, &inline_us[n]) < 0
+            || bench_rooms(server, 1, sizes[n], messages, parallel_opts, &parallel_us[n]) < 0)
+            return -1;
+    }
+    printf("\nmembers   inline last-recipient p50   %d fan-out threads p50\n", threads);
+    for (int i = 0; i < n; i++)
+        printf("%7d   %18.1f us   %18.1f us\n", sizes[i], inline_us[i], parallel_us[i]);
+    return 0;
+}
+
+/* One DURABLE ON sender of the durability benchmark */
+typedef struct {
+    int port;
+    int id;
+    int messages;
+    int done;
+    double *latency_us;
+    pthread_t tid;
+} durable_client_t;
+
+/* Closed loop: send a line, wait for its "SAVED", send the next */
+void *durable_client(void *arg) {
+    durable_client_t *d = arg;
+    struct timeval tv = { 10, 0 };
+    char name[32], line[128], buf[LENGTH * 4];
+    int sock, len, used = 0;
+
+    snprintf(name, sizeof(name), "durable%d", d->id);
+    if ((sock = bench_connect("127.0.0.1", d->port, name, BENCH_PASSWORD)) < 0)
+        return NULL;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    len = snprintf(line, sizeof(line), "PRESENCE OFF\nDURABLE ON\nJOIN d%d\n", d->id);
+    send(sock, line, len, 0);
+
+    for (int i = 0; i < d->messages; i++) {
+        long long t0 = now_ns();
+        bool saved = false;
+
+        len = snprintf(line, sizeof(line), "durable message %d\n", i);
+        send(sock, line, len, 0);
+        while (!saved) {
+            char *start = buf, *nl;
+            int n = recv(sock, buf + used, sizeof(buf) - used, 0);
+
+            if (n <= 0)
+                goto out;
+            used += n;
+            while ((nl = memchr(start, '\n', buf + used - start)) != NULL) {
+                if (strncmp(start, "SAVED", 5) == 0)
+                    saved = true;
+                start = nl + 1;
+            }
+            used -= start - buf;
+            memmove(buf, start, used);
+        }
+        d->latency_us[i] = (now_ns() - t0) / 1000.0;
+        d->done++;
+    }
+out:
+    close(sock);
+    return NULL;
+}
+
+/* Messages per second and time to "SAVED" for each log_sync mode */
+int bench_durability(const char *server, int nclients, int messages) {
+    static const char *labels[] = { "none", "periodic", "group" };
+    char sync_opt[32];
+    char *opts[] = { "client_msgs_per_sec=0", "room_msgs_per_sec=0", "log_sync_ms=100", sync_opt, NULL };
+    int port = 20000 + getpid() % 20000;
+
+    printf("%d senders, %d messages each, waiting for SAVED before the next (periodic: every 100 ms)\n",
+        nclients, messages);
+    for (int mode = 0; mode < 3; mode++) {
+        durable_client_t *clients = calloc(nclients, sizeof(durable_client_t));
+        double *all = malloc(sizeof(double) * nclients * messages);
+        latency_result_t res;
+        long long t0;
+        double secs;
+        int total = 0;
+        pid_t pid;
+
+        snprintf(sync_opt, sizeof(sync_opt), "log_sync=%d", mode);
+        if ((pid = spawn_server(server, port + mode, opts)) < 0)
+            return -1;
+        usleep(200000);
+        t0 = now_ns();
+        for (int i = 0; i < nclients; i++) {
+            clients[i].port = port + mode;
+            clients[i].id = i;
+            clients[i].messages = messages;
+            clients[i].latency_us = calloc(messages, sizeof(double));
+            pthread_create(&clients[i].tid, NULL, durable_client, &clients[i]);
+        }
+        for (int i = 0; i < nclients; i++) {
+            pthread_join(clients[i].tid, NULL);
+            for (int k = 0; k < clients[i].done; k++)
+                all[total++] = clients[i].latency_us[k];
+            free(clients[i].latency_us);
+        }
+        secs = (now_ns() - t0) / 1e9;
+        stop_server(pid);
+
+        qsort(all, total, sizeof(double), compare_double);
+        res.samples = total;
+        res.p50 = total ? all[total / 2] : 0;
+        res.p99 = total ? all[(int)(total * 0.99)] : 0;
+        res.max = total ? all[total - 1] : 0;
+        print_latency(labels[mode], &res);
+        printf("%-12s %.0f messages/s\n", "", total / secs);
+        free(all);
+        free(clients);
+    }
+    return 0;
+}
+
+void usage(const char *prog) {
+    printf("Usage:\n");
+    printf("  %s latency <IP> <port> <password> [receivers] [messages]\n", prog);
+    printf("  %s pinning <server-binary> [receivers] [messages]\n", prog);
+    printf("  %s rooms <server-binary> [rooms] [users] [messages]\n", prog);
+    printf("  %s fanout <server-binary> [fanout-threads] [messages]\n", prog);
+    printf("  %s durability <server-binary> [senders] [messages]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    latency_result_t res;
+
+    signal(SIGPIPE, SIG_IGN);
+    if (argc < 3)
+        usage(argv[0]);
+
+    if (strcmp(argv[1], "latency") == 0 && argc >= 5) {
+        int nrecv = argc > 5 ? atoi(argv[5]) : 8;
+        int messages = argc > 6 ? atoi(argv[6]) : 1000;
+        if (run_latency(argv[2], atoi(argv[3]), argv[4], nrecv, messages, 2000, &res) < 0)
+            return 1;
+        print_latency("latency", &res);
+    }
+    else if (strcmp(argv[1], "pinning") == 0) {
+        int nrecv = argc > 3 ? atoi(argv[3]) : 8;
+        int messages = argc > 4 ? atoi(argv[4]) : 1000;
+        if (bench_pinning(argv[2], nrecv, messages) < 0)
+            return 1;
+    }
+    else if (strcmp(argv[1], "rooms") == 0) {
+        int nrooms = argc > 3 ? atoi(argv[3]) : 1000;
+        int users = argc > 4 ? atoi(argv[4]) : 20;
+        int messages = argc > 5 ? atoi(argv[5]) : 20;
+        if (bench_rooms(argv[2], nrooms, users, messages, NULL, NULL) < 0)
+            return 1;
+    }
+    else if (strcmp(argv[1], "fanout") == 0) {
+        int threads = argc > 3 ? atoi(argv[3]) : 4;
+        int messages = argc > 4 ? atoi(argv[4]) : 50;
+        if (bench_fanout(argv[2], threads, messages) < 0)
+            return 1;
+    }
+    else if (strcmp(argv[1], "durability") == 0) {
+        int nclients = argc > 3 ? atoi(argv[3]) : 16;
+        int messages = argc > 4 ? atoi(argv[4]) : 200;
+        if (bench_durability(argv[2], nclients, messages) < 0)
+            return 1;
+    }
+    else {
+        usage(argv[0]);
+    }
+    return 0;
+}
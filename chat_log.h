@@ -0,0 +1,173 @@
+/*
+ * Binary chat log format, shared by the server and the log tools.
+ *
+ * A file is a sequence of blocks. Each block is a 24-byte header
+ *   u32 magic, u32 payload bytes, u32 record count, u32 CRC-32 of the payload,
+ *   u64 base time (ms since the epoch)
+ * (little endian) followed by its records:
+ *   varint ms since the previous record (the first: since the base time)
+ *   u8     type
+ *   varint sender id, varint room id (0: none)
+ *   varint payload length, payload bytes
+ * Ids are defined by CHAT_LOG_DEF_USER / CHAT_LOG_DEF_ROOM records (id in
+ * the sender field, name as payload) before their first use; a later
+ * definition of an id replaces the earlier one.
+ *
+ * Next to each segment, <segment>.idx is a sparse index: 16-byte entries
+ *   u64 base time of a block, u64 offset of the block in the segment
+ * in file order, roughly one per log_index_bytes. Every indexed block is a
+ * restart point: no id used from there on was defined before it, so a
+ * reader can start decoding at any entry.
+ */
+#ifndef CHAT_LOG_H
+#define CHAT_LOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHAT_LOG_MAGIC 0x31424c43u     /* "CLB1" */
+#define CHAT_LOG_HEADER 24
+#define CHAT_LOG_INDEX_ENTRY 16
+
+enum chat_log_type {
+    CHAT_LOG_MSG = 1,       /* room message: "#room <payload>" */
+    CHAT_LOG_DM,            /* direct message, room is the recipient: "@user <payload>" */
+    CHAT_LOG_JOIN,
+    CHAT_LOG_LEAVE,
+    CHAT_LOG_NOTICE,        /* server text in a room (vote results) */
+    CHAT_LOG_DEF_USER = 16,
+    CHAT_LOG_DEF_ROOM
+};
+
+static inline uint32_t chat_log_crc32(const unsigned char *p, size_t n) {
+    static uint32_t table[256];
+    uint32_t crc = 0xffffffffu;
+
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+    while (n--)
+        crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffffu;
+}
+
+static inline unsigned char *chat_log_put_varint(unsigned char *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+/* NULL if the varint runs past end */
+static inline const unsigned char *chat_log_get_varint(const unsigned char *p, const unsigned char *end, uint64_t *v) {
+    uint64_t x = 0;
+
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        unsigned char b = *p++;
+        x |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = x;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/* One decoded record; payload points into the block */
+struct chat_log_record {
+    uint64_t dt;
+    int type;
+    uint64_t sender;
+    uint64_t room;
+    uint64_t len;
+    const unsigned char *payload;
+};
+
+/* Decode the record at p; returns the next one, or NULL if it is malformed */
+static inline const unsigned char *chat_log_next_record(const unsigned char *p, const unsigned char *end,
+                                                        struct chat_log_record *rec) {
+    if ((p = chat_log_get_varint(p, end, &rec->dt)) == NULL || p >= end)
+        return NULL;
+    rec->type = *p++;
+    if ((p = chat_log_get_varint(p, end, &rec->sender)) == NULL ||
+        (p = chat_log_get_varint(p, end, &rec->room)) == NULL ||
+        (p = chat_log_get_varint(p, end, &rec->len)) == NULL || rec->len > (uint64_t)(end - p))
+        return NULL;
+    rec->payload = p;
+    return p + rec->len;
+}
+
+/* id -> name as set by the definition records; one table for users, one for rooms */
+struct chat_log_names {
+    char **names;
+    unsigned long cap;
+};
+
+#define CHAT_LOG_MAX_ID 1000000
+
+/* Take in the definition of id; false if it is out of range or memory ran out */
+static inline bool chat_log_names_define(struct chat_log_names *t, uint64_t id, const unsigned char *name, uint64_t len) {
+    char *copy;
+
+    if (id >= CHAT_LOG_MAX_ID)
+        return false;
+    if (id >= t->cap) {
+        unsigned long ncap = t->cap ? t->cap : 256;
+        char **n;
+        while (ncap <= id)
+            ncap *= 2;
+        if ((n = (char **)realloc(t->names, ncap * sizeof(char *))) == NULL)
+            return false;
+        memset(n + t->cap, 0, (ncap - t->cap) * sizeof(char *));
+        t->names = n;
+        t->cap = ncap;
+    }
+    if ((copy = strndup((const char *)name, len)) == NULL)
+        return false;
+    free(t->names[id]);
+    t->names[id] = copy;
+    return true;
+}
+
+/* NULL if id was never defined */
+static inline const char *chat_log_names_get(const struct chat_log_names *t, uint64_t id) {
+    return id < t->cap ? t->names[id] : NULL;
+}
+
+static inline void chat_log_names_free(struct chat_log_names *t) {
+    for (unsigned long i = 0; i < t->cap; i++)
+        free(t->names[i]);
+    free(t->names);
+    t->names = NULL;
+    t->cap = 0;
+}
+
+static inline void chat_log_put32(unsigned char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static inline uint32_t chat_log_get32(const unsigned char *p) {
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void chat_log_put64(unsigned char *p, uint64_t v) {
+    chat_log_put32(p, (uint32_t)v);
+    chat_log_put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static inline uint64_t chat_log_get64(const unsigned char *p) {
+    return chat_log_get32(p) | (uint64_t)chat_log_get32(p + 4) << 32;
+}
+
+#endif
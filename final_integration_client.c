@@ -11,11 +11,25 @@
 #include <stdbool.h>
 
 #define LENGTH 2082
+#define MAX_ROOMS 8
 
 // Global variables
 volatile sig_atomic_t flag = 0;
 int sock = 0;
 char username[32];
+char session_token[32] = {};
+char retry_token[32] = {};      /* token of the last resume, until it is answered */
+struct sockaddr_in serv_addr;
+
+/* Per-room delivery state for "MSG #room <seq>" lines; gap_to > 0 while a gap is open */
+struct room_seq {
+    char name[32];
+    unsigned long long last;
+    unsigned long long gap_from, gap_to;
+    unsigned long long acked_last;
+    int gap_age;
+} room_seqs[MAX_ROOMS];
+pthread_mutex_t seq_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void str_overwrite_stdout() {
     printf("%s", "> ");
@@ -113,6 +127,13 @@ void download_file(char* filename) {
     fclose(fp);
 }
 
+/* JOIN <room>, PART [<room>], MUTE/UNMUTE [<room>], VOTE <n>, VOTE STOP and @user DMs go to the server as typed */
+bool is_room_command(char* msg) {
+    return msg[0] == '@' || strncmp(msg, "JOIN ", 5) == 0 || strcmp(msg, "PART") == 0
+        || strncmp(msg, "PART ", 5) == 0 || strncmp(msg, "VOTE ", 5) == 0
+        || strncmp(msg, "MUTE", 4) == 0 || strncmp(msg, "UNMUTE", 6) == 0;
+}
+
 void send_msg_handler() {
     char message[LENGTH] = {};
     char buffer[LENGTH + 32] = {};
@@ -127,12 +148,18 @@ void send_msg_handler() {
 			break;
         } 
         else if (is_send_command(message, &IP, &PORT, &filename)) {
-            send(sock, message, strlen(message), 0);
+            sprintf(buffer, "%s\n", message);
+            send(sock, buffer, strlen(buffer), 0);
             send_file(filename);
         }
         else if (is_vote_command(message, &question)) {
             printf("entered else if\n");
-            send(sock, message, strlen(message), 0);
+            sprintf(buffer, "%s\n", message);
+            send(sock, buffer, strlen(buffer), 0);
+        }
+        else if (is_room_command(message)) {
+            sprintf(buffer, "%s\n", message);
+            send(sock, buffer, strlen(buffer), 0);
         }
         else {
             sprintf(buffer, "%s: %s \n", username, message);
@@ -145,27 +172,222 @@ void send_msg_handler() {
   catch_ctrl_c_and_exit(2);
 }
 
+/* Answer heartbeats and drop them from the received text */
+void handle_ping(char* message) {
+    char* p = message;
+
+    while ((p = strstr(p, "PING\n")) != NULL) {
+        if (p != message && p[-1] != '\n') {
+            p++;
+            continue;
+        }
+        send(sock, "PONG\n", 5, 0);
+        memmove(p, p + 5, strlen(p + 5) + 1);
+    }
+}
+
+/* Keep the resume token from "SESSION <token>" lines and drop them from the text */
+void handle_session(char* message) {
+    char* p = message;
+
+    while ((p = strstr(p, "SESSION ")) != NULL) {
+        char* end = strchr(p, '\n');
+        if ((p != message && p[-1] != '\n') || end == NULL) {
+            p++;
+            continue;
+        }
+        snprintf(session_token, sizeof(session_token), "%.*s", (int)(end - p - 8), p + 8);
+        memmove(p, end + 1, strlen(end + 1) + 1);
+    }
+}
+
+/* "RESUME RETRY": the old connection was still attached; resume again once this one closes */
+void handle_resume_retry(char* message) {
+    char* p = message;
+
+    while ((p = strstr(p, "RESUME RETRY\n")) != NULL) {
+        if (p != message && p[-1] != '\n') {
+            p++;
+            continue;
+        }
+        strcpy(session_token, retry_token);
+        memmove(p, p + 13, strlen(p + 13) + 1);
+    }
+}
+
+struct room_seq* room_seq_find(const char* name) {
+    struct room_seq* free_slot = NULL;
+
+    for (int i = 0; i < MAX_ROOMS; i++) {
+        if (strcmp(room_seqs[i].name, name) == 0)
+            return &room_seqs[i];
+        if (free_slot == NULL && room_seqs[i].name[0] == '\0')
+            free_slot = &room_seqs[i];
+    }
+    if (free_slot == NULL)
+        free_slot = &room_seqs[0];
+    memset(free_slot, 0, sizeof(*free_slot));
+    snprintf(free_slot->name, sizeof(free_slot->name), "%s", name);
+    return free_slot;
+}
+
+/* Everything up to here has arrived */
+unsigned long long room_seq_acked(struct room_seq* r) {
+    return r->gap_to ? r->gap_from : r->last;
+}
+
+/* Ring the bell for "MENTION " lines, which keep their text */
+void handle_mention(char* message) {
+    char* p = message;
+
+    while ((p = strstr(p, "MENTION ")) != NULL) {
+        if (p != message && p[-1] != '\n') {
+            p++;
+            continue;
+        }
+        *p = '\a';
+        memmove(p + 1, p + 8, strlen(p + 8) + 1);
+    }
+}
+
+/* Strip "MSG #room <seq> " from numbered lines, dropping ones already shown */
+void handle_numbered(char* message) {
+    char* p = message;
+
+    pthread_mutex_lock(&seq_lock);
+    while ((p = strstr(p, "MSG #")) != NULL) {
+        char name[32], *end = strchr(p, '\n');
+        unsigned long long seq;
+        int head;
+        struct room_seq* r;
+
+        if ((p != message && p[-1] != '\n' && p[-1] != '\a') || sscanf(p, "MSG #%31s %llu %n", name, &seq, &head) != 2) {
+            p++;
+            continue;
+        }
+        r = room_seq_find(name);
+        if (seq <= room_seq_acked(r) || (r->gap_to && seq <= r->last && seq != r->gap_from + 1)) {
+            /* Duplicate from a resend */
+            memmove(p, end ? end + 1 : p + strlen(p), strlen(end ? end + 1 : p + strlen(p)) + 1);
+            continue;
+        }
+        if (r->gap_to && seq == r->gap_from + 1) {
+            if (++r->gap_from >= r->gap_to)
+                r->gap_to = 0;
+        }
+        else if (r->last > 0 && seq > r->last + 1 && !r->gap_to) {
+            r->gap_from = r->last;
+            r->gap_to = seq - 1;
+            r->gap_age = 0;
+        }
+        if (seq > r->last)
+            r->last = seq;
+        memmove(p, p + head, strlen(p + head) + 1);
+    }
+    pthread_mutex_unlock(&seq_lock);
+}
+
+/* Once a second: cumulative ACK per room, and ask again for a gap that stayed open */
+void ack_handler() {
+    char buffer[96];
+
+    while (1) {
+        sleep(1);
+        pthread_mutex_lock(&seq_lock);
+        for (int i = 0; i < MAX_ROOMS; i++) {
+            struct room_seq* r = &room_seqs[i];
+            unsigned long long acked = room_seq_acked(r);
+
+            if (r->name[0] == '\0')
+                continue;
+            if (acked != r->acked_last) {
+                snprintf(buffer, sizeof(buffer), "ACK #%.31s %llu\n", r->name, acked);
+                send(sock, buffer, strlen(buffer), 0);
+                r->acked_last = acked;
+            }
+            if (r->gap_to && ++r->gap_age >= 2) {
+                snprintf(buffer, sizeof(buffer), "RESEND #%.31s %llu %llu\n", r->name, r->gap_from, r->gap_to);
+                send(sock, buffer, strlen(buffer), 0);
+                r->gap_age = 0;
+            }
+        }
+        pthread_mutex_unlock(&seq_lock);
+    }
+}
+
+/* Reconnect with the session token instead of the password */
+int reconnect() {
+    char block[32];
+
+    for (int i = 0; i < 5; i++) {
+        int s = socket(AF_INET, SOCK_STREAM, 0);
+        sleep(1);
+        if (connect(s, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == -1) {
+            close(s);
+            continue;
+        }
+        send(s, username, 32, 0);
+        memset(block, 0, sizeof(block));
+        strcpy(block, session_token);
+        send(s, block, 32, 0);
+        /* A resumed session sends the token again; otherwise do not retry with it */
+        strcpy(retry_token, session_token);
+        session_token[0] = '\0';
+        close(sock);
+        sock = s;
+        return 1;
+    }
+    return 0;
+}
+
 void recv_msg_handler() {
-	char message[LENGTH] = {};
-	char* tmp, *filename;
+	char message[LENGTH + 1] = {};
+	char rest[LENGTH];
+	char* tmp, *filename, *cut;
+	int have = 0, keep;
     while (1) {
-		int receive = recv(sock, message, LENGTH, 0);
+		int receive = recv(sock, message + have, LENGTH - have, 0);
     if (receive > 0) {
+        /* Only whole lines are handled; a partial last line waits for the rest */
+        have += receive;
+        message[have] = '\0';
+        if ((cut = strrchr(message, '\n')) == NULL && have < LENGTH)
+            continue;
+        keep = cut ? have - (int)(cut + 1 - message) : 0;
+        memcpy(rest, message + have - keep, keep);
+        message[have - keep] = '\0';
+        have = 0;
         if (is_send_command(message, &tmp, &tmp, &filename)) {
             printf("Download..\n");
             download_file("download.txt");
+            keep = 0;
+        }
+        else {
+            handle_ping(message);
+            handle_session(message);
+            handle_resume_retry(message);
+            handle_mention(message);
+            handle_numbered(message);
+            if (strlen(message) > 0)
+                printf("%s", message);
         }
-        else
-            printf("%s", message);
         str_overwrite_stdout();
+        memcpy(message, rest, keep);
+        have = keep;
+        message[have] = '\0';
+        continue;
     } 
     else if (receive == 0) {
+        have = 0;
+        if (session_token[0] && reconnect()) {
+            printf("Reconnected.\n");
+            continue;
+        }
 			break;
     } 
     else {
 			// -1
 	}
-	memset(message, 0, sizeof(message));
   }
 }
 
@@ -198,8 +420,6 @@ int main(int argc, char **argv){
 		exit(1);
 	}
 
-	struct sockaddr_in serv_addr;
-
 	/* Socket settings */
 	sock = socket(AF_INET, SOCK_STREAM, 0);
     serv_addr.sin_family = AF_INET;
@@ -222,6 +442,9 @@ int main(int argc, char **argv){
 
 	printf(":::::::::: Capstone Design 2 Chatroom ::::::::::\n");
 
+    // Numbered room messages, acknowledged by ack_handler
+    send(sock, "SEQ ON\n", 7, 0);
+
 	pthread_t send_msg_thread;
     if(pthread_create(&send_msg_thread, NULL, (void *) send_msg_handler, NULL) != 0){
 		printf("ERROR: pthread\n");
@@ -234,6 +457,12 @@ int main(int argc, char **argv){
 		exit(1);
 	}
 
+	pthread_t ack_thread;
+    if(pthread_create(&ack_thread, NULL, (void *) ack_handler, NULL) != 0){
+		printf("ERROR: pthread\n");
+		exit(1);
+	}
+
 	while (1){
 		if(flag){
 			printf("\nBye\n");
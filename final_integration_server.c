@@ -1,5 +1,7 @@
+#define _GNU_SOURCE
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,429 +12,7466 @@
 #include <sys/types.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
+#include <ctype.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <zlib.h>
+#include "chat_log.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define MAX_CLIENTS 100
 #define BUFFER_SZ 2082
 #define DATA_SIZE 100
 #define TRUE 1
 #define MAX 1000
+#define MAX_THREADS 256
+#define MAX_CPUS 1024
 
 static _Atomic unsigned int clnt_count = 0;
 static int uid = 10;
 
-void result_vote()
+/*Hash Function: Convert the password into a hash*/
+unsigned long hash(unsigned char *str)
+{
+    unsigned long hash = 5381;
+    int c;
+
+    while (c = *str++)
+        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+
+    return hash;
+}
+
+bool is_send_command(char* msg, char** IP, char** PORT, char** filename) {
+    char* option;
+    char message[BUFFER_SZ + 1] = {};
+
+    strcpy(message, msg);
+    message[5] = '\0';
+    if (strcmp(message, "SEND ") == 0) {
+        option = msg + 5;
+        option = strtok(option, " ");
+        *IP = option;
+        option = strtok(NULL, " ");
+        *PORT = option;
+        option = strtok(NULL, " ");
+        *filename = option;
+
+        return true;
+    }
+
+    return false;
+}
+
+bool is_vote_command(char* msg, char** question) {
+    char* option;
+    char message[BUFFER_SZ + 1] = {};
+
+    strcpy(message, msg);
+    message[5] = '\0';
+    if (strcmp(message, "VOTE#") == 0) {
+        option = msg + 5;
+        option = strtok(option, "#");
+        *question = option;
+        return true;
+    }
+
+    return false;
+}
+/* Vote totals and the winner line, as written to vote.txt */
+void vote_result(int *votes, char *out, size_t size) {
+    int a = votes[0], b = votes[1], c = votes[2];
+    int n = snprintf(out, size, "YES = %d\nNO = %d\nNONE = %d\n", a, b, c);
+
+    if ((a > b) && (a > c))
+        snprintf(out + n, size - n, "YES won with votes of '%d'\n", a);
+    else if ((b > a) && (b > c))
+        snprintf(out + n, size - n, "NO won with votes of '%d'\n", b);
+    else if ((c > b) && (c > a))
+        snprintf(out + n, size - n, "NONE won with votes of '%d'\n", c);
+    else if ((a == b) && (b == c))
+        snprintf(out + n, size - n, "Everything Equal with votes of '%d'\n", a);
+    else if (a == b)
+        snprintf(out + n, size - n, "YES and NO Won Equal with votes of '%d' '%d'\n", a, b);
+    else if (a == c)
+        snprintf(out + n, size - n, "YES and NONE Won Equal with votes of '%d' '%d'\n", a, c);
+    else if (b == c)
+        snprintf(out + n, size - n, "NO and NONE Won Equal with votes of '%d' '%d'\n", b, c);
+}
+
+void str_overwrite_stdout() {
+    printf("\r%s", "> ");
+    fflush(stdout);
+}
+
+void str_trim_lf (char* arr, int length) {
+    int i;
+    for (i = 0; i < length; i++) { // trim \n
+        if (arr[i] == '\n') {
+            arr[i] = '\0';
+            break;
+        }
+    }
+}
+
+void print_client_addr(struct sockaddr_in serv_addr){
+    printf("%d.%d.%d.%d",
+        serv_addr.sin_addr.s_addr & 0xff,
+        (serv_addr.sin_addr.s_addr & 0xff00) >> 8,
+        (serv_addr.sin_addr.s_addr & 0xff0000) >> 16,
+        (serv_addr.sin_addr.s_addr & 0xff000000) >> 24);
+}
+
+/* Thread roles, used for CPU pinning and per-thread stats */
+enum thread_role {
+    ROLE_ACCEPT,
+    ROLE_IO,
+    ROLE_WORKER,
+    ROLE_LOGGER,
+    ROLE_ADMIN,
+    ROLE_COMPRESS,
+    ROLE_REPL,
+    ROLE_COUNT
+};
+
+static const char *role_names[ROLE_COUNT] = {
+    "accept", "io", "worker", "logger", "admin", "compress", "repl"
+};
+
+/* CPU list for one role, parsed from "0-3,8" */
+typedef struct {
+    int cpus[MAX_CPUS];
+    int ncpu;
+    _Atomic unsigned int next;
+} cpu_list_t;
+
+/* Server configuration, set by <key>=<value> arguments after the password */
+struct server_config {
+    cpu_list_t pin[ROLE_COUNT];
+    int admin_port;
+    int io_threads;
+    int worker_threads;
+    int fanout_threads;
+    int fanout_threshold;
+    int fanout_chunk;
+    int log_ring;
+    int log_binary;
+    int log_segment_bytes;
+    int log_segment_sec;
+    int log_compress;
+    int log_sync;
+    int log_sync_ms;
+    int log_per_room;
+    int log_idle_sec;
+    int log_open_files;
+    int log_index_bytes;
+    int history_page;
+    int search_index;
+    int search_checkpoint_sec;
+    int sketch_top;
+    int repl_listen;
+    int repl_primary;
+    int repl_buffer_bytes;
+    int max_clients;
+    int max_out_bytes;
+    int max_preauth;
+    int handshake_timeout_ms;
+    int heartbeat_ms;
+    int idle_timeout_ms;
+    int write_stall_ms;
+    int client_msgs_per_sec;
+    int client_bytes_per_sec;
+    int room_msgs_per_sec;
+    int room_bytes_per_sec;
+    int join_lobby;
+    int presence_ms;
+    int history_msgs;
+    int history_bytes;
+    int history_unacked_bytes;
+    int resume_grace_ms;
+    int mailbox_segment_bytes;
+    int mailbox_max_bytes;
+    int mailbox_ttl_sec;
+};
+
+static struct server_config conf = {
+    .io_threads = 2,
+    .worker_threads = 1,
+    .fanout_threads = 2,
+    .fanout_threshold = 1000,
+    .fanout_chunk = 256,
+    .log_ring = 8192,
+    .log_binary = 1,
+    .log_segment_bytes = 16 * 1024 * 1024,
+    .log_segment_sec = 3600,
+    .log_compress = 1,
+    .log_sync = 1,
+    .log_sync_ms = 1000,
+    .log_per_room = 1,
+    .log_idle_sec = 300,
+    .log_open_files = 64,
+    .log_index_bytes = 64 * 1024,
+    .history_page = 50,
+    .search_index = 1,
+    .search_checkpoint_sec = 300,
+    .sketch_top = 10,
+    .repl_buffer_bytes = 4 * 1024 * 1024,
+    .max_clients = MAX_CLIENTS,
+    .max_out_bytes = 1024 * 1024,
+    .max_preauth = 256,
+    .handshake_timeout_ms = 5000,
+    .heartbeat_ms = 30000,
+    .idle_timeout_ms = 90000,
+    .write_stall_ms = 15000,
+    .client_msgs_per_sec = 50,
+    .client_bytes_per_sec = 256 * 1024,
+    .room_msgs_per_sec = 1000,
+    .room_bytes_per_sec = 1024 * 1024,
+    .join_lobby = 1,
+    .presence_ms = 250,
+    .history_msgs = 100,
+    .history_bytes = 64 * 1024,
+    .history_unacked_bytes = 512 * 1024,
+    .resume_grace_ms = 60000,
+    .mailbox_segment_bytes = 64 * 1024,
+    .mailbox_max_bytes = 256 * 1024,
+    .mailbox_ttl_sec = 7 * 24 * 3600,
+};
+
+/* Integer options and where they are stored */
+static struct {
+    const char *name;
+    int *value;
+} int_options[] = {
+    { "admin_port", &conf.admin_port },
+    { "io_threads", &conf.io_threads },
+    { "worker_threads", &conf.worker_threads },
+    { "fanout_threads", &conf.fanout_threads },
+    { "fanout_threshold", &conf.fanout_threshold },
+    { "fanout_chunk", &conf.fanout_chunk },
+    { "log_ring", &conf.log_ring },
+    { "log_binary", &conf.log_binary },
+    { "log_segment_bytes", &conf.log_segment_bytes },
+    { "log_segment_sec", &conf.log_segment_sec },
+    { "log_compress", &conf.log_compress },
+    { "log_sync", &conf.log_sync },
+    { "log_sync_ms", &conf.log_sync_ms },
+    { "log_per_room", &conf.log_per_room },
+    { "log_idle_sec", &conf.log_idle_sec },
+    { "log_open_files", &conf.log_open_files },
+    { "log_index_bytes", &conf.log_index_bytes },
+    { "history_page", &conf.history_page },
+    { "search_index", &conf.search_index },
+    { "search_checkpoint_sec", &conf.search_checkpoint_sec },
+    { "sketch_top", &conf.sketch_top },
+    { "repl_listen", &conf.repl_listen },
+    { "repl_primary", &conf.repl_primary },
+    { "repl_buffer_bytes", &conf.repl_buffer_bytes },
+    { "max_clients", &conf.max_clients },
+    { "max_out_bytes", &conf.max_out_bytes },
+    { "max_preauth", &conf.max_preauth },
+    { "handshake_timeout_ms", &conf.handshake_timeout_ms },
+    { "heartbeat_ms", &conf.heartbeat_ms },
+    { "idle_timeout_ms", &conf.idle_timeout_ms },
+    { "write_stall_ms", &conf.write_stall_ms },
+    { "client_msgs_per_sec", &conf.client_msgs_per_sec },
+    { "client_bytes_per_sec", &conf.client_bytes_per_sec },
+    { "room_msgs_per_sec", &conf.room_msgs_per_sec },
+    { "room_bytes_per_sec", &conf.room_bytes_per_sec },
+    { "join_lobby", &conf.join_lobby },
+    { "presence_ms", &conf.presence_ms },
+    { "history_msgs", &conf.history_msgs },
+    { "history_bytes", &conf.history_bytes },
+    { "history_unacked_bytes", &conf.history_unacked_bytes },
+    { "resume_grace_ms", &conf.resume_grace_ms },
+    { "mailbox_segment_bytes", &conf.mailbox_segment_bytes },
+    { "mailbox_max_bytes", &conf.mailbox_max_bytes },
+    { "mailbox_ttl_sec", &conf.mailbox_ttl_sec },
+};
+
+/* Per-thread placement and migration stats */
+typedef struct {
+    int in_use;
+    int role;
+    pid_t tid;
+    int pinned_cpu;
+    _Atomic int cpu;
+    _Atomic unsigned long samples;
+    _Atomic unsigned long migrations;
+    _Atomic unsigned long node_migrations;
+} thread_stats_t;
+
+static thread_stats_t thread_stats[MAX_THREADS];
+static pthread_mutex_t thread_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread thread_stats_t *self_stats = NULL;
+
+static int cpu_node_map[MAX_CPUS];
+static int numa_nodes = 1;
+
+/* Parse a CPU list such as "0-3,8,10-11" */
+int parse_cpu_list(const char *str, cpu_list_t *list) {
+    char copy[256];
+    char *tok, *save;
+
+    list->ncpu = 0;
+    snprintf(copy, sizeof(copy), "%s", str);
+    for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        int lo, hi;
+        if (sscanf(tok, "%d-%d", &lo, &hi) != 2) {
+            if (sscanf(tok, "%d", &lo) != 1)
+                return -1;
+            hi = lo;
+        }
+        if (lo < 0 || hi < lo || hi >= MAX_CPUS)
+            return -1;
+        for (int cpu = lo; cpu <= hi && list->ncpu < MAX_CPUS; cpu++)
+            list->cpus[list->ncpu++] = cpu;
+    }
+    return list->ncpu > 0 ? 0 : -1;
+}
+
+/* Apply one <key>=<value> option */
+int parse_config_arg(char *arg) {
+    char *value = strchr(arg, '=');
+
+    if (value == NULL)
+        return -1;
+    *value++ = '\0';
+
+    for (int role = 0; role < ROLE_COUNT; role++) {
+        char key[32];
+        snprintf(key, sizeof(key), "pin_%s", role_names[role]);
+        if (strcmp(arg, key) == 0)
+            return parse_cpu_list(value, &conf.pin[role]);
+    }
+    for (int i = 0; i < (int)(sizeof(int_options) / sizeof(int_options[0])); i++) {
+        if (strcmp(arg, int_options[i].name) == 0) {
+            *int_options[i].value = atoi(value);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Build the CPU -> NUMA node map from sysfs */
+void load_numa_topology() {
+    char path[64];
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        DIR *dir;
+        struct dirent *ent;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+        if ((dir = opendir(path)) == NULL)
+            continue;
+        while ((ent = readdir(dir)) != NULL) {
+            int node;
+            if (sscanf(ent->d_name, "node%d", &node) == 1) {
+                cpu_node_map[cpu] = node;
+                if (node + 1 > numa_nodes)
+                    numa_nodes = node + 1;
+            }
+        }
+        closedir(dir);
+    }
+}
+
+int cpu_node(int cpu) {
+    if (cpu < 0 || cpu >= MAX_CPUS)
+        return 0;
+    return cpu_node_map[cpu];
+}
+
+/* Register the calling thread and pin it to the next CPU of its role */
+void thread_register(int role) {
+    cpu_list_t *list = &conf.pin[role];
+    int pinned = -1;
+
+    if (list->ncpu > 0) {
+        cpu_set_t set;
+        pinned = list->cpus[list->next++ % list->ncpu];
+        CPU_ZERO(&set);
+        CPU_SET(pinned, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            printf("WARNING: could not pin %s thread to cpu %d\n", role_names[role], pinned);
+            pinned = -1;
+        }
+    }
+
+    pthread_mutex_lock(&thread_stats_mutex);
+    for (int i = 0; i < MAX_THREADS; i++) {
+        if (!thread_stats[i].in_use) {
+            self_stats = &thread_stats[i];
+            self_stats->in_use = 1;
+            self_stats->role = role;
+            self_stats->tid = syscall(SYS_gettid);
+            self_stats->pinned_cpu = pinned;
+            self_stats->cpu = sched_getcpu();
+            self_stats->samples = 0;
+            self_stats->migrations = 0;
+            self_stats->node_migrations = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&thread_stats_mutex);
+}
+
+void thread_unregister() {
+    if (self_stats == NULL)
+        return;
+    pthread_mutex_lock(&thread_stats_mutex);
+    self_stats->in_use = 0;
+    pthread_mutex_unlock(&thread_stats_mutex);
+    self_stats = NULL;
+}
+
+/* Record the CPU the thread is running on; called once per event */
+void thread_sample() {
+    thread_stats_t *ts = self_stats;
+    int cpu, prev;
+
+    if (ts == NULL)
+        return;
+    cpu = sched_getcpu();
+    prev = atomic_load_explicit(&ts->cpu, memory_order_relaxed);
+    atomic_store_explicit(&ts->samples,
+        atomic_load_explicit(&ts->samples, memory_order_relaxed) + 1, memory_order_relaxed);
+    if (cpu != prev) {
+        atomic_store_explicit(&ts->migrations,
+            atomic_load_explicit(&ts->migrations, memory_order_relaxed) + 1, memory_order_relaxed);
+        if (cpu_node(cpu) != cpu_node(prev))
+            atomic_store_explicit(&ts->node_migrations,
+                atomic_load_explicit(&ts->node_migrations, memory_order_relaxed) + 1, memory_order_relaxed);
+        atomic_store_explicit(&ts->cpu, cpu, memory_order_relaxed);
+    }
+}
+
+/* Allocate zeroed memory on the calling thread's NUMA node */
+void *node_local_alloc(size_t size) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (p == MAP_FAILED)
+        return NULL;
+    if (numa_nodes > 1) {
+        unsigned long mask = 1UL << cpu_node(sched_getcpu());
+        syscall(SYS_mbind, p, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+    }
+    memset(p, 0, size); /* first touch from the owning thread */
+    return p;
+}
+
+void node_local_free(void *p, size_t size) {
+    if (p)
+        munmap(p, size);
+}
+
+
+/* Shared buffer pool: power-of-two blocks from 64 bytes to 16 KB */
+#define POOL_MIN_SHIFT 6
+#define POOL_CLASSES 9
+#define POOL_SLAB_SZ (256 * 1024)
+#define POOL_CACHE_MAX 64
+
+struct pool_block {
+    struct pool_block *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct pool_block *free;
+} pool_classes[POOL_CLASSES];
+
+/* Per-thread cache in front of the shared free lists */
+static __thread struct pool_block *pool_cache[POOL_CLASSES];
+static __thread int pool_cache_count[POOL_CLASSES];
+
+static _Atomic long pool_in_use = 0;
+static _Atomic long pool_reserved = 0;
+
+void pool_init() {
+    for (int c = 0; c < POOL_CLASSES; c++)
+        pthread_mutex_init(&pool_classes[c].lock, NULL);
+}
+
+/* Borrow a block of at least <size> bytes; its real size is stored in *cap */
+void *pool_alloc(size_t size, unsigned int *cap) {
+    struct pool_block *b;
+    size_t bsize;
+    int c = 0;
+
+    while (c < POOL_CLASSES && ((size_t)1 << (c + POOL_MIN_SHIFT)) < size)
+        c++;
+    if (c == POOL_CLASSES) {
+        if ((b = malloc(size)) != NULL) {
+            *cap = size;
+            pool_in_use += size;
+        }
+        return b;
+    }
+    bsize = (size_t)1 << (c + POOL_MIN_SHIFT);
+
+    if (pool_cache[c] == NULL) {
+        pthread_mutex_lock(&pool_classes[c].lock);
+        while (pool_classes[c].free && pool_cache_count[c] < POOL_CACHE_MAX / 2) {
+            b = pool_classes[c].free;
+            pool_classes[c].free = b->next;
+            b->next = pool_cache[c];
+            pool_cache[c] = b;
+            pool_cache_count[c]++;
+        }
+        pthread_mutex_unlock(&pool_classes[c].lock);
+    }
+    if (pool_cache[c] == NULL) {
+        /* Carve a new slab on this thread's node */
+        char *slab = node_local_alloc(POOL_SLAB_SZ);
+        if (slab == NULL)
+            return NULL;
+        pool_reserved += POOL_SLAB_SZ;
+        for (size_t off = 0; off + bsize <= POOL_SLAB_SZ; off += bsize) {
+            b = (struct pool_block *)(slab + off);
+            b->next = pool_cache[c];
+            pool_cache[c] = b;
+            pool_cache_count[c]++;
+        }
+    }
+
+    b = pool_cache[c];
+    pool_cache[c] = b->next;
+    pool_cache_count[c]--;
+    pool_in_use += bsize;
+    *cap = bsize;
+    return b;
+}
+
+/* Return a block borrowed with pool_alloc */
+void pool_free(void *p, unsigned int cap) {
+    struct pool_block *b = p;
+    int c = 0;
+
+    if (p == NULL)
+        return;
+    pool_in_use -= cap;
+    while (c < POOL_CLASSES && ((unsigned int)1 << (c + POOL_MIN_SHIFT)) < cap)
+        c++;
+    if (c == POOL_CLASSES) {
+        free(p);
+        return;
+    }
+
+    b->next = pool_cache[c];
+    pool_cache[c] = b;
+    if (++pool_cache_count[c] > POOL_CACHE_MAX) {
+        pthread_mutex_lock(&pool_classes[c].lock);
+        while (pool_cache_count[c] > POOL_CACHE_MAX / 2) {
+            b = pool_cache[c];
+            pool_cache[c] = b->next;
+            b->next = pool_classes[c].free;
+            pool_classes[c].free = b;
+            pool_cache_count[c]--;
+        }
+        pthread_mutex_unlock(&pool_classes[c].lock);
+    }
+}
+
+/* Reference-counted message shared by every recipient queue */
+typedef struct {
+    _Atomic int refs;
+    unsigned int cap;
+    unsigned int len;
+    unsigned long long seq;     /* position in its room's history, 0 otherwise */
+    char data[];
+} msg_t;
+
+msg_t *msg_new(const char *s, unsigned int len) {
+    unsigned int cap;
+    msg_t *m = pool_alloc(sizeof(msg_t) + len + 1, &cap);
+
+    if (m == NULL)
+        return NULL;
+    m->refs = 1;
+    m->cap = cap;
+    m->len = len;
+    m->seq = 0;
+    memcpy(m->data, s, len);
+    m->data[len] = '\0';
+    return m;
+}
+
+void msg_hold(msg_t *m) {
+    atomic_fetch_add_explicit(&m->refs, 1, memory_order_relaxed);
+}
+
+void msg_release(msg_t *m) {
+    if (atomic_fetch_sub_explicit(&m->refs, 1, memory_order_acq_rel) == 1)
+        pool_free(m, m->cap);
+}
+
+/* Connection states */
+enum {
+    CONN_CHAT,
+    CONN_RELAY,
+    CONN_CLOSING
+};
+
+#define CLIENT_AGAIN 0x01      /* on the I/O thread's again list (flags) */
+#define CLIENT_DROPPED 0x01    /* output overflowed, waiting to be closed (out_flags) */
+#define CLIENT_WRITE_LISTED 0x02  /* on the owner's write list (out_flags) */
+#define CLIENT_THROTTLED 0x02  /* over its rate, socket not read until resume_at (flags) */
+
+#define HANDSHAKE_SZ 64        /* 32-byte username + 32-byte password */
+#define IN_MAX BUFFER_SZ
+#define SCRATCH_SZ (64 * 1024)
+#define READ_ROUNDS 16
+#define IO_EVENTS 256
+#define ROOMS_PER_CLIENT 8
+#define ROOM_BUCKETS 4096
+#define LOBBY_ROOM "lobby"
+#define USER_BUCKETS 4096
+#define MENTION_MAX 8          /* distinct @names acted on per message */
+#define FILTER_FILE "filter.txt"
+#define HISTORY_MAX 1024       /* history ring slots; also the gathered-write limit */
+#define ACK_NONE ULLONG_MAX    /* no ACK state for this room */
+#define TOKEN_LEN 24           /* hex digits of a session resume token */
+#define RESUME_BUCKETS 4096
+#define MAILBOX_DIR "mailbox"
+#define MAILBOX_LOCKS 64
+#define MAILBOX_SWEEP_MS 60000
+
+/* Queued part of an outgoing message */
+struct out_ref {
+    msg_t *msg;
+    unsigned int off;
+};
+
+long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Hierarchical hashed timing wheel: 4 levels of 64 slots, 10 ms ticks */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+#define WHEEL_TICK_MS 10
+#define WHEEL_MAX_TICKS ((1u << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+/* Timer embedded in the object it belongs to; owned by one I/O thread */
+typedef struct wheel_timer {
+    struct wheel_timer *next, *prev;
+    unsigned int expires;
+    unsigned char kind;
+} wheel_timer_t;
+
+enum {
+    TIMER_PREAUTH = 1,
+    TIMER_CLIENT
+};
+
+typedef struct {
+    unsigned int now;
+    long count;
+    wheel_timer_t slots[WHEEL_LEVELS][WHEEL_SIZE];
+} timing_wheel_t;
+
+void wheel_init(timing_wheel_t *w, unsigned int now) {
+    w->now = now;
+    w->count = 0;
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+        for (int i = 0; i < WHEEL_SIZE; i++)
+            w->slots[l][i].next = w->slots[l][i].prev = &w->slots[l][i];
+    }
+}
+
+void wheel_link(timing_wheel_t *w, wheel_timer_t *t) {
+    unsigned int delta = t->expires - w->now;
+    wheel_timer_t *head;
+    int level = 0;
+
+    while (level < WHEEL_LEVELS - 1 && delta >= (1u << (WHEEL_BITS * (level + 1))))
+        level++;
+    head = &w->slots[level][(t->expires >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1)];
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+void timer_cancel(timing_wheel_t *w, wheel_timer_t *t) {
+    if (t->next == NULL)
+        return;
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+    w->count--;
+}
+
+/* (Re)arm a timer <ms> from now */
+void timer_arm(timing_wheel_t *w, wheel_timer_t *t, unsigned int ms) {
+    unsigned int ticks = (ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+
+    timer_cancel(w, t);
+    if (ticks == 0)
+        ticks = 1;
+    if (ticks > WHEEL_MAX_TICKS)
+        ticks = WHEEL_MAX_TICKS;
+    t->expires = w->now + ticks;
+    wheel_link(w, t);
+    w->count++;
+}
+
+/* Arm unless the timer already fires sooner */
+void timer_arm_before(timing_wheel_t *w, wheel_timer_t *t, unsigned int ms) {
+    unsigned int ticks = (ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+
+    if (t->next != NULL && t->expires - w->now <= ticks)
+        return;
+    timer_arm(w, t, ms);
+}
+
+/* Move every timer of a slot to a private list */
+void wheel_take(wheel_timer_t *slot, wheel_timer_t *list) {
+    list->next = list->prev = list;
+    if (slot->next == slot)
+        return;
+    list->next = slot->next;
+    list->prev = slot->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+    slot->next = slot->prev = slot;
+}
+
+/* Advance to tick <now>, firing expired timers */
+void wheel_advance(timing_wheel_t *w, unsigned int now, void (*fire)(void *, wheel_timer_t *), void *ctx) {
+    while ((int)(now - w->now) > 0) {
+        wheel_timer_t list;
+
+        w->now++;
+        /* Cascade higher levels down when the lower one wraps */
+        for (int l = 1; l < WHEEL_LEVELS; l++) {
+            if ((w->now & ((1u << (WHEEL_BITS * l)) - 1)) != 0)
+                break;
+            wheel_take(&w->slots[l][(w->now >> (WHEEL_BITS * l)) & (WHEEL_SIZE - 1)], &list);
+            while (list.next != &list) {
+                wheel_timer_t *t = list.next;
+                list.next = t->next;
+                t->next->prev = &list;
+                wheel_link(w, t);
+            }
+        }
+
+        wheel_take(&w->slots[0][w->now & (WHEEL_SIZE - 1)], &list);
+        while (list.next != &list) {
+            wheel_timer_t *t = list.next;
+            t->prev->next = t->next;
+            t->next->prev = t->prev;
+            t->next = t->prev = NULL;
+            w->count--;
+            fire(ctx, t);
+        }
+    }
+}
+
+/* Token bucket; it may go negative so a large unit is never stuck */
+typedef struct {
+    double tokens;
+    unsigned int last;      /* wheel tick of the last refill */
+    unsigned char primed;
+} token_bucket_t;
+
+/* Messages/sec and bytes/sec limits of one client or room */
+typedef struct {
+    token_bucket_t msgs;
+    token_bucket_t bytes;
+} rate_limit_t;
+
+/* Refill up to one second of <rate>; returns ms until the bucket is positive again */
+unsigned int bucket_wait(token_bucket_t *b, int rate, unsigned int now) {
+    if (rate <= 0)
+        return 0;
+    if (!b->primed) {
+        b->tokens = rate;
+        b->last = now;
+        b->primed = 1;
+    }
+    else if ((int)(now - b->last) > 0) {
+        b->tokens += (double)rate * (now - b->last) * WHEEL_TICK_MS / 1000;
+        if (b->tokens > rate)
+            b->tokens = rate;
+        b->last = now;
+    }
+    if (b->tokens > 0)
+        return 0;
+    return (unsigned int)(-b->tokens * 1000 / rate) + WHEEL_TICK_MS;
+}
+
+unsigned int rate_wait(rate_limit_t *r, int msg_rate, int byte_rate, unsigned int now) {
+    unsigned int a = bucket_wait(&r->msgs, msg_rate, now);
+    unsigned int b = bucket_wait(&r->bytes, byte_rate, now);
+    return a > b ? a : b;
+}
+
+void rate_charge(rate_limit_t *r, int msg_rate, int byte_rate, unsigned int msgs, unsigned int bytes) {
+    if (msg_rate > 0)
+        r->msgs.tokens -= msgs;
+    if (byte_rate > 0)
+        r->bytes.tokens -= bytes;
+}
+
+/* What an epoll entry points at */
+enum {
+    KIND_PREAUTH = 1,
+    KIND_CLIENT
+};
+
+struct io_thread;
+struct room;
+struct resume;
+
+/* Connection that has not authenticated yet; lives in its I/O thread's table */
+typedef struct preauth {
+    unsigned char kind;
+    unsigned char got;
+    int sockfd;
+    int uid;
+    struct sockaddr_in address;
+    wheel_timer_t timer;
+    struct preauth *next_free;
+    char block[HANDSHAKE_SZ];
+} preauth_t;
+
+/* Client structure; buffers are borrowed only while data is in flight */
+typedef struct client {
+    unsigned char kind;
+	struct sockaddr_in address;
+	int sockfd;
+	int uid;
+	char username[32];
+    struct io_thread *io;
+    struct client *next_ready;
+    unsigned char state;
+    unsigned char flags;
+    unsigned char ping_sent;
+    int relay_uid;
+    unsigned int cap;
+    /* heartbeat, idle and write-stall timer; times are wheel ticks */
+    wheel_timer_t timer;
+    unsigned int last_rx;
+    unsigned int write_since;
+    unsigned int write_mark;
+    /* ingress token buckets; while throttled, input waits in in_buf */
+    rate_limit_t rate;
+    unsigned int resume_at;
+    /* joined rooms, owner thread only; plain lines go to the active room */
+    struct room *room;
+    struct room *rooms[ROOMS_PER_CLIENT];
+    unsigned char nrooms;
+    _Atomic unsigned char presence_off;   /* opted out of roster and deltas */
+    unsigned char quitting;               /* said "exit"; no resume */
+    unsigned char durable;                /* DURABLE ON: "SAVED" once logged to disk */
+    struct resume *resume;                /* resume token of this session */
+    /* SEQ ON: numbered room messages and cumulative ACKs. An entry is set
+       before the client enters a room and cleared after it leaves, so other
+       threads may read it while the client is a member. */
+    _Atomic unsigned char seq_on;
+    /* MUTE: rooms whose messages are not delivered, except mentions; same
+       lifetime rule as acks */
+    _Atomic unsigned char nmuted;
+    struct room *_Atomic muted[ROOMS_PER_CLIENT];
+    struct room_ack {
+        struct room *_Atomic room;
+        _Atomic unsigned long long acked;
+    } acks[ROOMS_PER_CLIENT];
+    /* partial input line, owner thread only */
+    char *in_buf;
+    unsigned int in_len;
+    unsigned int in_cap;
+    /* output queue, filled by any thread under out_lock */
+    pthread_mutex_t out_lock;
+    unsigned char out_flags;
+    unsigned int out_sent;
+    struct client *next_write;
+    struct out_ref *out_q;
+    unsigned int out_head;
+    unsigned int out_count;
+    unsigned int out_cap;
+    unsigned int out_bytes;
+    struct mailbox_delivery *mailbox;   /* offline messages queued, not yet written */
+    unsigned int mailbox_mark;          /* out_sent once they are */
+} client_t;
+
+/* Work handed to an I/O thread by another thread */
+struct io_msg {
+    int fd;
+    int uid;
+    struct sockaddr_in address;
+    struct io_msg *next;
+};
+
+/* Event loop thread owning a share of the connections */
+typedef struct io_thread {
+    int epfd;
+    int wakefd;
+    pthread_t tid;
+    pthread_mutex_t mbox_lock;
+    struct io_msg *mbox;
+    client_t *again;
+    client_t *closing;
+    client_t *write_list;   /* output queued by other threads, under mbox_lock */
+    char *scratch;
+    preauth_t *preauth_slots;
+    preauth_t *preauth_free;
+    timing_wheel_t wheel;
+    struct sketch *sketches[2]; /* senders, rooms */
+} io_thread_t;
+
+static io_thread_t *io_threads;
+static client_t **clients;
+static _Atomic long conn_struct_bytes = 0;
+static _Atomic long conn_buffer_bytes = 0;
+
+/* Pre-auth counters */
+static _Atomic long preauth_count = 0;
+static _Atomic unsigned long preauth_accepted = 0;
+static _Atomic unsigned long preauth_promoted = 0;
+static _Atomic unsigned long preauth_failed = 0;
+static _Atomic unsigned long preauth_timeouts = 0;
+static _Atomic unsigned long preauth_rejected = 0;
+
+/* Rate limit counters */
+static _Atomic unsigned long client_throttles = 0;
+static _Atomic unsigned long room_throttles = 0;
+
+/* Timer counters */
+static _Atomic unsigned long heartbeats_sent = 0;
+static _Atomic unsigned long idle_evictions = 0;
+static _Atomic unsigned long stall_evictions = 0;
+
+pthread_mutex_t clnt_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Job queues: background jobs that may block (mailbox files), and fan-out
+   chunks of large rooms, which never block and so get threads of their own */
+struct job {
+    void (*fn)(void *);
+    void *arg;
+    struct job *next;
+};
+
+typedef struct {
+    struct job *head, *tail;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} job_queue_t;
+
+static job_queue_t background_jobs = { NULL, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+static job_queue_t fanout_jobs = { NULL, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+bool job_push(job_queue_t *q, void (*fn)(void *), void *arg) {
+    struct job *j = malloc(sizeof(struct job));
+
+    if (j == NULL)
+        return false;
+    j->fn = fn;
+    j->arg = arg;
+    j->next = NULL;
+    pthread_mutex_lock(&q->mutex);
+    if (q->tail)
+        q->tail->next = j;
+    else
+        q->head = j;
+    q->tail = j;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+    return true;
+}
+
+void worker_submit(void (*fn)(void *), void *arg) {
+    job_push(&background_jobs, fn, arg);
+}
+
+/* Runs the jobs of one queue */
+void *worker_main(void *arg) {
+    job_queue_t *q = arg;
+
+    thread_register(ROLE_WORKER);
+    while (1) {
+        struct job *j;
+
+        pthread_mutex_lock(&q->mutex);
+        while (q->head == NULL)
+            pthread_cond_wait(&q->cond, &q->mutex);
+        j = q->head;
+        q->head = j->next;
+        if (q->head == NULL)
+            q->tail = NULL;
+        pthread_mutex_unlock(&q->mutex);
+
+        thread_sample();
+        j->fn(j->arg);
+        free(j);
+    }
+    return NULL;
+}
+
+/*
+ * Asynchronous logging: update_log() and chat_log() copy the record into a
+ * bounded multi-producer ring (per-slot sequence numbers, no locks) and
+ * return. The logger thread keeps the log files open, formats timestamps
+ * once per second and writes each batch with one writev per file; chat
+ * records become one binary block (chat_log.h) unless log_binary=0. The
+ * last LOG_AUDIT_RESERVE free slots are kept for audit lines (login.log,
+ * filter.log), so a burst of chat cannot crowd them out. When the ring is
+ * full the record is dropped and counted; nobody waits for a slot.
+ */
+#define LOG_INLINE 232         /* longer lines go to a malloc'd copy */
+#define LOG_BATCH 256
+#define LOG_IDLE_MS 2
+#define LOG_AUDIT_RESERVE 64   /* slots only audit lines may take (at most 1/4 of the ring) */
+#define CHAT_LOG_TEXT "chatting.log"
+#define CHAT_LOG_BIN "chatting.bin"
+
+typedef struct {
+    _Atomic unsigned long seq;
+    const char *file;           /* NULL for chat records */
+    long long when;             /* ms since the epoch */
+    unsigned char type;         /* enum chat_log_type for chat records */
+    char sender[32];
+    char room[32];
+    int ack_uid;                /* session waiting for "SAVED", 0 for none */
+    unsigned int len;
+    char *big;
+    char text[LOG_INLINE];
+} log_slot_t;
+
+static log_slot_t *log_ring = NULL;
+static unsigned long log_mask = 0;
+static unsigned long log_reserve = 0;
+static _Atomic unsigned long log_tail = 0;   /* next slot producers claim */
+static unsigned long log_head = 0;           /* next slot the logger reads */
+static _Atomic int log_sleeping = 0;
+static int log_wakefd = -1;
+static _Atomic unsigned long log_records = 0;
+static _Atomic unsigned long log_dropped = 0;
+static _Atomic unsigned long log_audit_dropped = 0;
+static _Atomic unsigned long log_enqueue_ns = 0;
+static _Atomic unsigned long log_enqueue_max_ns = 0;
+static _Atomic unsigned long log_batches = 0;
+static _Atomic unsigned long log_bytes = 0;
+static _Atomic unsigned long log_blocks = 0;
+
+long long wall_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* when: ms since the epoch, 0 for now */
+bool log_enqueue(const char *file, int type, const char *sender, const char *room, const char *message,
+                 int ack_uid, long long when) {
+    unsigned long pos, len = strlen(message), ns, max;
+    struct timespec t0, t1;
+    log_slot_t *slot;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pos = atomic_load_explicit(&log_tail, memory_order_relaxed);
+    for (;;) {
+        long diff;
+        slot = &log_ring[pos & log_mask];
+        diff = (long)(atomic_load_explicit(&slot->seq, memory_order_acquire) - pos);
+        if (diff == 0 && file == NULL) {
+            /* Chat records leave the reserve free: the slot log_reserve
+               ahead must be free for this lap too */
+            unsigned long ahead = pos + log_reserve;
+            if ((long)(atomic_load_explicit(&log_ring[ahead & log_mask].seq, memory_order_acquire) - ahead) < 0)
+                diff = -1;
+        }
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_tail, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0) {
+            log_dropped++;
+            if (file)
+                log_audit_dropped++;
+            return false;
+        }
+        else {
+            pos = atomic_load_explicit(&log_tail, memory_order_relaxed);
+        }
+    }
+    slot->file = file;
+    slot->when = when ? when : wall_ms();
+    slot->type = type;
+    snprintf(slot->sender, sizeof(slot->sender), "%s", sender ? sender : "");
+    snprintf(slot->room, sizeof(slot->room), "%s", room ? room : "");
+    slot->ack_uid = ack_uid;
+    slot->len = len;
+    slot->big = NULL;
+    if (len <= LOG_INLINE)
+        memcpy(slot->text, message, len);
+    else if ((slot->big = malloc(len)) != NULL)
+        memcpy(slot->big, message, len);
+    else
+        slot->len = 0;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    if (log_sleeping && atomic_exchange(&log_sleeping, 0)) {
+        /* First producer after the logger went idle wakes it */
+        uint64_t one = 1;
+        write(log_wakefd, &one, sizeof(one));
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1000000000UL + t1.tv_nsec - t0.tv_nsec;
+    log_records++;
+    log_enqueue_ns += ns;
+    max = log_enqueue_max_ns;
+    while (ns > max && !atomic_compare_exchange_weak(&log_enqueue_max_ns, &max, ns))
+        ;
+    return true;
+}
+
+void update_log(char* message, char* filename) {
+    log_enqueue(filename, 0, NULL, NULL, message, 0, 0);
+}
+
+/* A chat event for chatting.log / chatting.bin; room is the recipient for DMs */
+void chat_log(int type, const char *sender, const char *room, const char *message) {
+    log_enqueue(NULL, type, sender, room, message, 0, 0);
+}
+
+/* chat_log() for a DURABLE ON session: it gets "SAVED" once the record is
+   on disk as far as log_sync promises; false if the record was dropped */
+bool chat_log_durable(client_t *c, int type, const char *room, const char *message) {
+    return log_enqueue(NULL, type, c->username, room, message, c->uid, 0);
+}
+
+/*
+ * Log segments: every stream (chatting.bin, login.log, ...) is written to
+ * LOG_DIR/<stream>.<number><ext>, and the logger switches to a new segment
+ * past log_segment_bytes or log_segment_sec. LOG_MANIFEST lists the
+ * segments in order with their state; it is replaced with rename() so a
+ * reader always sees a complete list. Closed segments are gzipped by a
+ * background thread at idle priority. Producers never see any of this:
+ * only the logger and the compressor touch segment files.
+ */
+#define LOG_DIR "logs"
+#define LOG_MANIFEST LOG_DIR "/MANIFEST"
+
+enum log_segment_state {
+    SEGMENT_OPEN,
+    SEGMENT_CLOSED,
+    SEGMENT_COMPRESSED
+};
+
+static const char *segment_states[] = { "open", "closed", "gz" };
+
+typedef struct {
+    char file[64];          /* under LOG_DIR; ".gz" is added once compressed */
+    char stream[48];
+    unsigned int number;
+    int state;
+    bool failed;            /* compression failed, left as it is */
+    long long first_ms, last_ms;
+    unsigned long bytes;
+} log_segment_t;
+
+static log_segment_t *log_segments = NULL;
+static unsigned int log_nsegments = 0, log_segments_cap = 0;
+static unsigned int log_next_segment = 1;
+static pthread_mutex_t manifest_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compress_cond = PTHREAD_COND_INITIALIZER;
+static _Atomic unsigned long log_segments_opened = 0;
+static _Atomic unsigned long log_segments_compressed = 0;
+static _Atomic unsigned long log_compress_in = 0;
+static _Atomic unsigned long log_compress_out = 0;
+
+/* Make renames and new segments in LOG_DIR durable, unless log_sync=0 */
+void log_dir_sync() {
+    int fd;
+
+    if (conf.log_sync && (fd = open(LOG_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/* Rewrite the manifest; called with manifest_lock held */
+void manifest_write() {
+    FILE *fp = fopen(LOG_MANIFEST ".tmp", "w");
+
+    if (fp == NULL)
+        return;
+    for (unsigned int i = 0; i < log_nsegments; i++) {
+        log_segment_t *s = &log_segments[i];
+        fprintf(fp, "%s %s %s %lld %lld %lu\n", s->file, s->stream, segment_states[s->state],
+            s->first_ms, s->last_ms, s->bytes);
+    }
+    if (conf.log_sync && fflush(fp) == 0)
+        fdatasync(fileno(fp));
+    if (fclose(fp) == 0 && rename(LOG_MANIFEST ".tmp", LOG_MANIFEST) == 0)
+        log_dir_sync();
+}
+
+/* Read the manifest of the previous run; its open segments are closed now */
+bool manifest_load() {
+    FILE *fp = fopen(LOG_MANIFEST, "r");
+    char line[256], state[16];
+    log_segment_t s;
+
+    if (fp == NULL)
+        return true;
+    pthread_mutex_lock(&manifest_lock);
+    while (fgets(line, sizeof(line), fp)) {
+        char path[128], *ext;
+        unsigned int number;
+
+        memset(&s, 0, sizeof(s));
+        if (sscanf(line, "%63s %47s %15s %lld %lld %lu", s.file, s.stream, state,
+                &s.first_ms, &s.last_ms, &s.bytes) != 6)
+            continue;
+        s.state = strcmp(state, "gz") == 0 ? SEGMENT_COMPRESSED : SEGMENT_CLOSED;
+        snprintf(path, sizeof(path), LOG_DIR "/%s.gz", s.file);
+        if (s.state == SEGMENT_CLOSED && access(path, F_OK) == 0)
+            s.state = SEGMENT_COMPRESSED;
+        if (s.state == SEGMENT_CLOSED) {
+            struct stat st;
+            snprintf(path, sizeof(path), LOG_DIR "/%s", s.file);
+            if (stat(path, &st) < 0)
+                continue;
+            s.bytes = st.st_size;
+        }
+        if (log_nsegments == log_segments_cap) {
+            unsigned int cap = log_segments_cap ? log_segments_cap * 2 : 64;
+            log_segment_t *n = realloc(log_segments, cap * sizeof(log_segment_t));
+
+            if (n == NULL) {
+                /* Writing back what was read would lose the rest */
+                fclose(fp);
+                pthread_mutex_unlock(&manifest_lock);
+                return false;
+            }
+            log_segments = n;
+            log_segments_cap = cap;
+        }
+        log_segments[log_nsegments++] = s;
+        /* "<stream name>.<number><ext>" */
+        ext = strrchr(s.file, '.');
+        while (ext && ext > s.file && ext[-1] != '.')
+            ext--;
+        if (ext && sscanf(ext, "%u", &number) == 1) {
+            log_segments[log_nsegments - 1].number = number;
+            if (number >= log_next_segment)
+                log_next_segment = number + 1;
+        }
+    }
+    fclose(fp);
+    manifest_write();
+    pthread_mutex_unlock(&manifest_lock);
+    return true;
+}
+
+/* gzip LOG_DIR/file to LOG_DIR/file.gz and remove the original */
+bool log_compress_segment(const char *file) {
+    char src[128], dst[128], tmp[140];
+    static char buf[65536];
+    struct stat st;
+    gzFile gz;
+    ssize_t n;
+    int fd;
+    bool ok = true;
+
+    snprintf(src, sizeof(src), LOG_DIR "/%s", file);
+    snprintf(dst, sizeof(dst), LOG_DIR "/%s.gz", file);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", dst);
+    if ((fd = open(src, O_RDONLY | O_CLOEXEC)) < 0)
+        return false;
+    if ((gz = gzopen(tmp, "wb6")) == NULL) {
+        close(fd);
+        return false;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        if (gzwrite(gz, buf, n) != n) {
+            ok = false;
+            break;
+        }
+    }
+    if (n < 0)
+        ok = false;
+    fstat(fd, &st);
+    /* The plain copy is going away: don't leave it in the page cache */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    if (gzclose(gz) != Z_OK)
+        ok = false;
+    if (ok && conf.log_sync && (fd = open(tmp, O_RDONLY | O_CLOEXEC)) >= 0) {
+        /* The plain segment is removed next, so the copy must be on disk first */
+        ok = fsync(fd) == 0;
+        close(fd);
+    }
+    if (!ok || rename(tmp, dst) < 0) {
+        unlink(tmp);
+        return false;
+    }
+    unlink(src);
+    log_dir_sync();
+    log_compress_in += st.st_size;
+    if (stat(dst, &st) == 0)
+        log_compress_out += st.st_size;
+    log_segments_compressed++;
+    return true;
+}
+
+void *compress_main(void *arg) {
+    struct sched_param param = { 0 };
+
+    thread_register(ROLE_COMPRESS);
+    /* Only run when nothing else wants the CPU */
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+    pthread_mutex_lock(&manifest_lock);
+    while (1) {
+        char file[64];
+        unsigned int i;
+        bool ok;
+
+        for (i = 0; i < log_nsegments; i++) {
+            if (log_segments[i].state == SEGMENT_CLOSED && !log_segments[i].failed)
+                break;
+        }
+        if (i == log_nsegments || !conf.log_compress) {
+            pthread_cond_wait(&compress_cond, &manifest_lock);
+            continue;
+        }
+        memcpy(file, log_segments[i].file, sizeof(file));
+        pthread_mutex_unlock(&manifest_lock);
+
+        ok = log_compress_segment(file);
+
+        pthread_mutex_lock(&manifest_lock);
+        if (ok) {
+            log_segments[i].state = SEGMENT_COMPRESSED;
+            manifest_write();
+        }
+        else {
+            log_segments[i].failed = true;
+            fprintf(stderr, "Could not compress log segment %s\n", file);
+        }
+        thread_sample();
+    }
+    return NULL;
+}
+
+/* Name -> id dictionary of one binary log file; logger thread only */
+typedef struct {
+    struct log_name {
+        char name[32];
+        unsigned int id;
+    } *slots;
+    unsigned int cap;
+    unsigned int count;
+} log_dict_t;
+
+/* Id of a name, 0 for ""; *fresh is set when it has to be defined first */
+unsigned int log_dict_id(log_dict_t *d, const char *name, bool *fresh) {
+    unsigned long h;
+
+    *fresh = false;
+    if (name[0] == '\0')
+        return 0;
+    if (d->count * 2 >= d->cap) {
+        log_dict_t bigger = { calloc(d->cap ? d->cap * 2 : 256, sizeof(struct log_name)),
+                              d->cap ? d->cap * 2 : 256, d->count };
+        if (bigger.slots == NULL)
+            return 0;
+        for (unsigned int i = 0; i < d->cap; i++) {
+            if (d->slots[i].id == 0)
+                continue;
+            h = hash((unsigned char *)d->slots[i].name) & (bigger.cap - 1);
+            while (bigger.slots[h].id)
+                h = (h + 1) & (bigger.cap - 1);
+            bigger.slots[h] = d->slots[i];
+        }
+        free(d->slots);
+        *d = bigger;
+    }
+    h = hash((unsigned char *)name) & (d->cap - 1);
+    while (d->slots[h].id && strcmp(d->slots[h].name, name) != 0)
+        h = (h + 1) & (d->cap - 1);
+    if (d->slots[h].id == 0) {
+        snprintf(d->slots[h].name, sizeof(d->slots[h].name), "%s", name);
+        d->slots[h].id = ++d->count;
+        *fresh = true;
+    }
+    return d->slots[h].id;
+}
+
+void log_dict_reset(log_dict_t *d) {
+    if (d->slots)
+        memset(d->slots, 0, d->cap * sizeof(struct log_name));
+    d->count = 0;
+}
+
+/* Appends chat records to one binary block */
+typedef struct {
+    unsigned char *buf;
+    size_t len, cap;
+    unsigned int count;
+    long long base, last;
+    log_dict_t users, rooms;
+} log_block_t;
+
+bool log_block_reserve(log_block_t *b, size_t more) {
+    if (b->len + more > b->cap) {
+        size_t ncap = b->cap ? b->cap : 16384;
+        unsigned char *n;
+        while (ncap < b->len + more)
+            ncap *= 2;
+        if ((n = realloc(b->buf, ncap)) == NULL)
+            return false;
+        b->buf = n;
+        b->cap = ncap;
+    }
+    return true;
+}
+
+void log_block_record(log_block_t *b, long long when, int type, unsigned int sender,
+                      unsigned int room, const char *payload, size_t len) {
+    unsigned char *p;
+
+    if (!log_block_reserve(b, 40 + len))
+        return;
+    if (b->count == 0) {
+        b->len = CHAT_LOG_HEADER;
+        b->base = b->last = when;
+    }
+    if (when < b->last)
+        when = b->last;
+    p = b->buf + b->len;
+    p = chat_log_put_varint(p, when - b->last);
+    *p++ = type;
+    p = chat_log_put_varint(p, sender);
+    p = chat_log_put_varint(p, room);
+    p = chat_log_put_varint(p, len);
+    memcpy(p, payload, len);
+    b->len = p + len - b->buf;
+    b->last = when;
+    b->count++;
+}
+
+void log_block_add(log_block_t *b, log_slot_t *s) {
+    bool fresh;
+    unsigned int sender = log_dict_id(&b->users, s->sender, &fresh);
+    unsigned int room;
+
+    if (fresh)
+        log_block_record(b, s->when, CHAT_LOG_DEF_USER, sender, 0, s->sender, strlen(s->sender));
+    room = s->type == CHAT_LOG_DM ? log_dict_id(&b->users, s->room, &fresh) : log_dict_id(&b->rooms, s->room, &fresh);
+    if (fresh)
+        log_block_record(b, s->when, s->type == CHAT_LOG_DM ? CHAT_LOG_DEF_USER : CHAT_LOG_DEF_ROOM,
+            room, 0, s->room, strlen(s->room));
+    log_block_record(b, s->when, s->type, sender, room, s->big ? s->big : s->text, s->len);
+}
+
+/* Seal the block (header and checksum) and write it; returns its size */
+size_t log_block_flush(log_block_t *b, int fd) {
+    size_t len = b->len;
+
+    if (b->count == 0)
+        return 0;
+    chat_log_put32(b->buf, CHAT_LOG_MAGIC);
+    chat_log_put32(b->buf + 4, b->len - CHAT_LOG_HEADER);
+    chat_log_put32(b->buf + 8, b->count);
+    chat_log_put32(b->buf + 12, chat_log_crc32(b->buf + CHAT_LOG_HEADER, b->len - CHAT_LOG_HEADER));
+    chat_log_put64(b->buf + 16, b->base);
+    if (fd >= 0)
+        write(fd, b->buf, b->len);
+    log_bytes += b->len;
+    log_blocks++;
+    b->count = 0;
+    b->len = 0;
+    return len;
+}
+
+/*
+ * Log streams: chatting.bin (or .log), login.log, filter.log and, with
+ * log_per_room, rooms/<room>.bin for every room that has something logged.
+ * Each stream has its own block buffer, name dictionary and segments.
+ * A stream idle for log_idle_sec closes its segment and is dropped. At most
+ * log_open_files descriptors (segments and their sparse indexes) stay open;
+ * past that the least recently written stream closes both, and reopens
+ * them for appending when it is written again. Logger thread only.
+ */
+#define LOG_STREAM_BUCKETS 1024
+
+struct log_file {
+    char name[48];
+    bool binary;
+    bool open;              /* segment open; fd may have been closed for the cap */
+    bool dirty;             /* written since the last fdatasync */
+    int fd;
+    int idx_fd;             /* the segment's .idx, opened at its first entry */
+    unsigned int segment;   /* index in log_segments */
+    unsigned int number;    /* of the segment */
+    char path[128];
+    unsigned long bytes;
+    unsigned long index_at; /* offset of the last index entry, ULONG_MAX for none */
+    long long first_ms, last_ms;
+    log_block_t block;      /* binary streams */
+    struct log_file *hnext;
+    struct log_file *lru_prev, *lru_next;   /* streams with an fd, most recently written first */
+};
+
+static struct log_file *log_streams[LOG_STREAM_BUCKETS];
+static struct log_file *log_lru_head = NULL, *log_lru_tail = NULL;
+static _Atomic unsigned long log_stream_count = 0;
+static _Atomic unsigned long log_open_fds = 0;
+static _Atomic unsigned long log_fd_evictions = 0;
+static _Atomic unsigned long log_idle_closes = 0;
+
+void log_lru_unlink(struct log_file *f) {
+    if (f->lru_prev)
+        f->lru_prev->lru_next = f->lru_next;
+    else
+        log_lru_head = f->lru_next;
+    if (f->lru_next)
+        f->lru_next->lru_prev = f->lru_prev;
+    else
+        log_lru_tail = f->lru_prev;
+    f->lru_prev = f->lru_next = NULL;
+}
+
+void log_lru_push(struct log_file *f) {
+    f->lru_prev = NULL;
+    f->lru_next = log_lru_head;
+    if (log_lru_head)
+        log_lru_head->lru_prev = f;
+    else
+        log_lru_tail = f;
+    log_lru_head = f;
+}
+
+void log_fd_close(struct log_file *f) {
+    if (f->fd < 0)
+        return;
+    /* Waiting senders are answered at the next log_sync_batch(), after the fd is gone */
+    if (f->dirty && conf.log_sync)
+        fdatasync(f->fd);
+    f->dirty = false;
+    close(f->fd);
+    f->fd = -1;
+    if (f->idx_fd >= 0) {
+        close(f->idx_fd);
+        f->idx_fd = -1;
+        log_open_fds--;
+    }
+    log_lru_unlink(f);
+    log_open_fds--;
+}
+
+/* Make room for one more descriptor of f, closing the least recently
+   written stream's if at the cap */
+void log_fd_reserve(struct log_file *f) {
+    if (conf.log_open_files > 0 && log_open_fds >= (unsigned long)conf.log_open_files
+        && log_lru_tail && log_lru_tail != f) {
+        log_fd_close(log_lru_tail);
+        log_fd_evictions++;
+    }
+}
+
+/* Open f->path, closing the least recently written fd if at the cap */
+void log_fd_open(struct log_file *f, int flags) {
+    log_fd_reserve(f);
+    f->fd = open(f->path, O_WRONLY | O_CLOEXEC | flags, 0644);
+    if (f->fd >= 0) {
+        log_lru_push(f);
+        log_open_fds++;
+    }
+}
+
+void log_segment_close(struct log_file *f) {
+    if (!f->open)
+        return;
+    log_fd_close(f);
+    f->open = false;
+    pthread_mutex_lock(&manifest_lock);
+    log_segments[f->segment].state = SEGMENT_CLOSED;
+    log_segments[f->segment].first_ms = f->first_ms;
+    log_segments[f->segment].last_ms = f->last_ms;
+    log_segments[f->segment].bytes = f->bytes;
+    manifest_write();
+    pthread_cond_signal(&compress_cond);
+    pthread_mutex_unlock(&manifest_lock);
+}
+
+void log_segment_open(struct log_file *f, long long now) {
+    const char *ext = strrchr(f->name, '.');
+    log_segment_t *s;
+
+    pthread_mutex_lock(&manifest_lock);
+    if (log_nsegments == log_segments_cap) {
+        log_segment_t *n = realloc(log_segments, (log_segments_cap ? log_segments_cap * 2 : 64) * sizeof(log_segment_t));
+        if (n == NULL) {
+            pthread_mutex_unlock(&manifest_lock);
+            return;
+        }
+        log_segments = n;
+        log_segments_cap = log_segments_cap ? log_segments_cap * 2 : 64;
+    }
+    s = &log_segments[log_nsegments];
+    memset(s, 0, sizeof(*s));
+    snprintf(s->stream, sizeof(s->stream), "%s", f->name);
+    s->number = log_next_segment;
+    snprintf(s->file, sizeof(s->file), "%.*s.%06u%s", ext ? (int)(ext - f->name) : 47, f->name,
+        log_next_segment, ext ? ext : "");
+    snprintf(f->path, sizeof(f->path), LOG_DIR "/%s", s->file);
+    log_fd_open(f, O_CREAT | O_TRUNC);
+    if (f->fd >= 0) {
+        s->state = SEGMENT_OPEN;
+        s->first_ms = s->last_ms = now;
+        f->segment = log_nsegments++;
+        f->number = s->number;
+        f->open = true;
+        f->bytes = 0;
+        f->index_at = ULONG_MAX;
+        f->first_ms = f->last_ms = now;
+        /* Names are defined again in every segment */
+        log_dict_reset(&f->block.users);
+        log_dict_reset(&f->block.rooms);
+        log_next_segment++;
+        log_segments_opened++;
+        manifest_write();
+    }
+    pthread_mutex_unlock(&manifest_lock);
+}
+
+/* Add "<time> <offset>" of a restart block to the segment's sparse index */
+void log_index_append(struct log_file *f, long long when, unsigned long offset) {
+    unsigned char entry[CHAT_LOG_INDEX_ENTRY];
+
+    chat_log_put64(entry, when);
+    chat_log_put64(entry + 8, offset);
+    if (f->idx_fd < 0) {
+        char path[140];
+
+        snprintf(path, sizeof(path), "%s.idx", f->path);
+        log_fd_reserve(f);
+        f->idx_fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC | (offset == 0 ? O_TRUNC : O_APPEND), 0644);
+        if (f->idx_fd >= 0)
+            log_open_fds++;
+    }
+    if (f->idx_fd >= 0)
+        write(f->idx_fd, entry, sizeof(entry));
+    f->index_at = offset;
+}
+
+/* The stream a record goes to */
+const char *log_stream_name(log_slot_t *s, char *buf, size_t size) {
+    if (s->file)
+        return s->file;
+    if (conf.log_per_room && s->type != CHAT_LOG_DM && s->room[0]) {
+        snprintf(buf, size, "rooms/%s%s", s->room, conf.log_binary ? ".bin" : ".log");
+        return buf;
+    }
+    return conf.log_binary ? CHAT_LOG_BIN : CHAT_LOG_TEXT;
+}
+
+struct log_file *log_stream_find(const char *name, long long now) {
+    unsigned long h = hash((unsigned char *)name) % LOG_STREAM_BUCKETS;
+    struct log_file *f;
+    size_t len;
+
+    for (f = log_streams[h]; f; f = f->hnext) {
+        if (strcmp(f->name, name) == 0)
+            return f;
+    }
+    if ((f = calloc(1, sizeof(struct log_file))) == NULL)
+        return NULL;
+    snprintf(f->name, sizeof(f->name), "%s", name);
+    len = strlen(f->name);
+    f->binary = len > 4 && strcmp(f->name + len - 4, ".bin") == 0;
+    f->fd = -1;
+    f->idx_fd = -1;
+    f->last_ms = now;
+    f->hnext = log_streams[h];
+    log_streams[h] = f;
+    log_stream_count++;
+    return f;
+}
+
+/* Descriptor to write f with, after switching to a new segment if the current one is full or old */
+int log_stream_ready(struct log_file *f, long long now) {
+    if (f->open && f->bytes > 0 &&
+        (f->bytes >= (unsigned long)conf.log_segment_bytes ||
+         (conf.log_segment_sec > 0 && now - f->first_ms >= conf.log_segment_sec * 1000LL)))
+        log_segment_close(f);
+    if (!f->open)
+        log_segment_open(f, now);
+    else if (f->fd < 0)
+        log_fd_open(f, O_APPEND);
+    else if (log_lru_head != f) {
+        log_lru_unlink(f);
+        log_lru_push(f);
+    }
+    return f->fd;
+}
+
+/* Close segments open past log_segment_sec, and drop streams idle past log_idle_sec */
+void log_streams_expire(long long now) {
+    for (int h = 0; h < LOG_STREAM_BUCKETS; h++) {
+        struct log_file **pp = &log_streams[h], *f;
+
+        while ((f = *pp) != NULL) {
+            if (f->open && f->bytes > 0 && conf.log_segment_sec > 0 &&
+                now - f->first_ms >= conf.log_segment_sec * 1000LL)
+                log_segment_close(f);
+            if (conf.log_idle_sec > 0 && now - f->last_ms >= conf.log_idle_sec * 1000LL) {
+                log_segment_close(f);
+                *pp = f->hnext;
+                free(f->block.buf);
+                free(f->block.users.slots);
+                free(f->block.rooms.slots);
+                free(f);
+                log_stream_count--;
+                log_idle_closes++;
+                continue;
+            }
+            pp = &f->hnext;
+        }
+    }
+}
+
+/*
+ * Full-text index of room messages. Terms are lowercased ASCII words and,
+ * for Hangul, every syllable and every pair of neighbouring syllables; a
+ * term maps to the ids of the messages containing it, kept as varint
+ * deltas. The logger adds each message as it encodes it, and a message id
+ * locates the record (segment, block offset, record number) so /search
+ * reads the text back from the log. search_lock guards the index; the
+ * logger holds it for one message at a time.
+ */
+#define SEARCH_TERM_MAX 32
+#define SEARCH_TERMS_PER_MSG 128
+#define SEARCH_CHECKPOINT LOG_DIR "/search.ckpt"
+#define SEARCH_CHECKPOINT_MAGIC 0x31495343u    /* "CSI1" */
+
+struct search_doc {
+    unsigned int segment;       /* segment number */
+    unsigned int offset;        /* of the block */
+    unsigned int record;        /* record number in the block */
+};
+
+typedef struct search_term {
+    struct search_term *next;
+    unsigned char *post;
+    unsigned int len, cap;
+    unsigned int count;
+    unsigned int last;          /* last message id in post */
+    char term[SEARCH_TERM_MAX];
+} search_term_t;
+
+static pthread_rwlock_t search_lock = PTHREAD_RWLOCK_INITIALIZER;
+static search_term_t **search_table = NULL;
+static unsigned int search_buckets = 0, search_nterms = 0;
+static struct search_doc *search_docs = NULL;
+static unsigned int search_ndocs = 0, search_docs_cap = 0;
+static unsigned long search_post_bytes = 0;
+static unsigned int search_saved_docs = 0;      /* in the last checkpoint */
+static _Atomic unsigned long search_queries = 0;
+static _Atomic unsigned long search_query_us = 0;
+static _Atomic unsigned long search_checkpoints = 0;
+
+/* UTF-8 Hangul syllable (U+AC00..U+D7A3) at p: 3, else 0 */
+int search_hangul(const unsigned char *p, const unsigned char *end) {
+    unsigned int cp;
+
+    if (end - p < 3 || (p[0] & 0xf0) != 0xe0 || (p[1] & 0xc0) != 0x80 || (p[2] & 0xc0) != 0x80)
+        return 0;
+    cp = (p[0] & 0x0f) << 12 | (p[1] & 0x3f) << 6 | (p[2] & 0x3f);
+    return cp >= 0xac00 && cp <= 0xd7a3 ? 3 : 0;
+}
+
+int search_term_add(char terms[][SEARCH_TERM_MAX], int n, int max, const char *term, size_t len) {
+    if (n == max || len == 0)
+        return n;
+    if (len >= SEARCH_TERM_MAX)
+        len = SEARCH_TERM_MAX - 1;
+    for (int i = 0; i < n; i++) {
+        if (strncmp(terms[i], term, len) == 0 && terms[i][len] == '\0')
+            return n;
+    }
+    memcpy(terms[n], term, len);
+    terms[n][len] = '\0';
+    return n + 1;
+}
+
+/* Distinct terms of a text; returns how many */
+int search_tokenize(const unsigned char *p, size_t len, char terms[][SEARCH_TERM_MAX], int max) {
+    const unsigned char *end = p + len, *prev = NULL;
+    int n = 0;
+
+    while (p < end) {
+        int h = search_hangul(p, end);
+
+        if (h) {
+            char pair[6];
+            n = search_term_add(terms, n, max, (const char *)p, 3);
+            if (prev) {
+                memcpy(pair, prev, 3);
+                memcpy(pair + 3, p, 3);
+                n = search_term_add(terms, n, max, pair, 6);
+            }
+            prev = p;
+            p += 3;
+        }
+        else if (*p < 0x80 && isalnum(*p)) {
+            char word[SEARCH_TERM_MAX];
+            size_t wlen = 0;
+
+            while (p < end && *p < 0x80 && isalnum(*p)) {
+                if (wlen < SEARCH_TERM_MAX - 1)
+                    word[wlen++] = tolower(*p);
+                p++;
+            }
+            if (wlen > 1)
+                n = search_term_add(terms, n, max, word, wlen);
+            prev = NULL;
+        }
+        else {
+            prev = NULL;
+            p++;
+        }
+    }
+    return n;
+}
+
+search_term_t *search_term_find(const char *term, bool create) {
+    unsigned long h;
+    search_term_t *t;
+
+    if (search_buckets == 0) {
+        if (!create || (search_table = calloc(1024, sizeof(search_term_t *))) == NULL)
+            return NULL;
+        search_buckets = 1024;
+    }
+    h = hash((unsigned char *)term) & (search_buckets - 1);
+    for (t = search_table[h]; t; t = t->next) {
+        if (strcmp(t->term, term) == 0)
+            return t;
+    }
+    if (!create || (t = calloc(1, sizeof(search_term_t))) == NULL)
+        return NULL;
+    snprintf(t->term, sizeof(t->term), "%s", term);
+    if (search_nterms >= search_buckets) {
+        search_term_t **table = calloc(search_buckets * 2, sizeof(search_term_t *));
+        if (table) {
+            for (unsigned int i = 0; i < search_buckets; i++) {
+                search_term_t *e, *next;
+                for (e = search_table[i]; e; e = next) {
+                    unsigned long nh = hash((unsigned char *)e->term) & (search_buckets * 2 - 1);
+                    next = e->next;
+                    e->next = table[nh];
+                    table[nh] = e;
+                }
+            }
+            free(search_table);
+            search_table = table;
+            search_buckets *= 2;
+            h = hash((unsigned char *)term) & (search_buckets - 1);
+        }
+    }
+    t->next = search_table[h];
+    search_table[h] = t;
+    search_nterms++;
+    return t;
+}
+
+bool search_post(search_term_t *t, unsigned int id) {
+    if (t->len + 5 > t->cap) {
+        unsigned int ncap = t->cap ? t->cap * 2 : 8;
+        unsigned char *n = realloc(t->post, ncap);
+        if (n == NULL)
+            return false;
+        search_post_bytes += ncap - t->cap;
+        t->post = n;
+        t->cap = ncap;
+    }
+    t->len = chat_log_put_varint(t->post + t->len, id - (t->count ? t->last : 0)) - t->post;
+    t->last = id;
+    t->count++;
+    return true;
+}
+
+/* Index one room message found at (segment, block offset, record number) */
+void search_add(unsigned int segment, unsigned int offset, unsigned int record, const unsigned char *text, size_t len) {
+    char terms[SEARCH_TERMS_PER_MSG][SEARCH_TERM_MAX];
+    int n = search_tokenize(text, len, terms, SEARCH_TERMS_PER_MSG);
+    unsigned int id;
+
+    if (n == 0)
+        return;
+    pthread_rwlock_wrlock(&search_lock);
+    if (search_ndocs == search_docs_cap) {
+        unsigned int ncap = search_docs_cap ? search_docs_cap * 2 : 4096;
+        struct search_doc *d = realloc(search_docs, ncap * sizeof(struct search_doc));
+        if (d == NULL) {
+            pthread_rwlock_unlock(&search_lock);
+            return;
+        }
+        search_docs = d;
+        search_docs_cap = ncap;
+    }
+    id = search_ndocs++;
+    search_docs[id].segment = segment;
+    search_docs[id].offset = offset;
+    search_docs[id].record = record;
+    for (int i = 0; i < n; i++) {
+        search_term_t *t = search_term_find(terms[i], true);
+        if (t)
+            search_post(t, id);
+    }
+    pthread_rwlock_unlock(&search_lock);
+}
+
+/*
+ * Durability (log_sync): 0 leaves flushing to the kernel, 1 calls fdatasync
+ * on written segments every log_sync_ms, 2 calls it after every batch the
+ * logger writes (group commit: everything queued while one fdatasync runs
+ * shares the next). DURABLE ON senders are answered once their record is
+ * covered by a sync, or right after the write with log_sync=0.
+ */
+enum log_sync_mode {
+    LOG_SYNC_NONE,
+    LOG_SYNC_PERIODIC,
+    LOG_SYNC_GROUP
+};
+
+struct log_ack {
+    char name[32];
+    int uid;
+};
+
+static struct log_ack *log_acks = NULL;      /* logger thread only */
+static unsigned int log_nacks = 0, log_acks_cap = 0;
+static _Atomic unsigned long log_syncs = 0;
+static _Atomic unsigned long log_sync_us = 0;
+static _Atomic unsigned long log_sync_max_us = 0;
+static _Atomic unsigned long log_acks_released = 0;
+
+void log_release_acks(struct log_ack *acks, unsigned int n);
+void session_send(const char *name, int uid, char *s);
+void mailbox_written(struct mailbox_delivery *d, bool delivered);
+void search_start();
+
+void log_ack_add(log_slot_t *s) {
+    if (log_nacks == log_acks_cap) {
+        unsigned int ncap = log_acks_cap ? log_acks_cap * 2 : 256;
+        struct log_ack *n = realloc(log_acks, ncap * sizeof(struct log_ack));
+        if (n == NULL) {
+            /* No room to wait for the sync: do not leave the sender hanging */
+            session_send(s->sender, s->ack_uid, "Not saved: the server is out of memory.\n");
+            return;
+        }
+        log_acks = n;
+        log_acks_cap = ncap;
+    }
+    memcpy(log_acks[log_nacks].name, s->sender, sizeof(s->sender));
+    log_acks[log_nacks++].uid = s->ack_uid;
+}
+
+/* Sync what has been written if the mode says it is time, then answer the
+   senders waiting for it; returns false while data is left unsynced */
+bool log_sync_batch(long long now) {
+    static long long last_sync = 0;
+    bool dirty = false;
+
+    for (struct log_file *f = log_lru_head; f && !dirty; f = f->lru_next)
+        dirty = f->dirty;
+    if (conf.log_sync == LOG_SYNC_PERIODIC && now - last_sync < conf.log_sync_ms)
+        return !dirty && log_nacks == 0;
+    if (conf.log_sync != LOG_SYNC_NONE && dirty) {
+        struct timespec t0, t1;
+        unsigned long us, max;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (struct log_file *f = log_lru_head; f; f = f->lru_next) {
+            if (f->dirty)
+                fdatasync(f->fd);
+            f->dirty = false;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        us = (t1.tv_sec - t0.tv_sec) * 1000000UL + (t1.tv_nsec - t0.tv_nsec) / 1000;
+        log_syncs++;
+        log_sync_us += us;
+        max = log_sync_max_us;
+        while (us > max && !atomic_compare_exchange_weak(&log_sync_max_us, &max, us))
+            ;
+    }
+    last_sync = now;
+    if (log_nacks > 0) {
+        log_release_acks(log_acks, log_nacks);
+        log_acks_released += log_nacks;
+        log_nacks = 0;
+    }
+    return true;
+}
+
+/*
+ * Log shipping. With repl_listen=<port> the logger copies every record it
+ * has written (after the batch's fdatasync under log_sync=2) into a ring of
+ * repl_buffer_bytes, dropping the oldest when it is full, and a replication
+ * thread streams them to a standby connected to 127.0.0.1:<port>. A standby
+ * (repl_primary=<port>) writes them to its own logs with their original
+ * times and posts room messages into its rooms, so their history is there
+ * to replay; it acks what it has applied. Lag is the records not acked yet
+ * and the age of the oldest of them.
+ *
+ * On connecting, the standby sends u64 epoch, u64 next seq it wants (0, 0
+ * when new); the primary answers u64 epoch (its start time), u64 first seq
+ * it will send, then frames (little endian)
+ *   u32 bytes after this field, u64 seq, u64 when (ms since the epoch),
+ *   u8 type, u8 file length, u8 sender length, u8 room length,
+ *   file, sender, room, text
+ * The standby answers each read with u64 seq, u64 when of the last frame
+ * applied. There is one standby at a time: it is served on its own thread,
+ * and while it is connected the primary answers another one with epoch 0
+ * and closes the connection.
+ */
+#define REPL_FRAME_HEAD 24
+#define REPL_SEND_CHUNK (64 * 1024)
+
+static unsigned char *repl_ring = NULL;
+static size_t repl_cap = 0, repl_head_off = 0, repl_used = 0;
+static unsigned long long repl_head_seq = 1;   /* oldest frame in the ring */
+static unsigned long long repl_next_seq = 1;   /* next seq to publish */
+static long long repl_epoch = 0;
+static pthread_mutex_t repl_lock = PTHREAD_MUTEX_INITIALIZER;
+static int repl_wakefd = -1;
+static _Atomic int repl_waiting = 0;
+/* Frames of the logger's current batch, published by repl_commit() */
+static unsigned char *repl_stage_buf = NULL;
+static size_t repl_stage_len = 0, repl_stage_cap = 0;
+static unsigned long long repl_stage_seq = 1;
+static _Atomic unsigned long repl_shipped = 0;
+static _Atomic unsigned long repl_overwritten = 0;
+static unsigned long long repl_acked_seq = 0;  /* under repl_lock */
+static _Atomic int repl_standbys = 0;
+static _Atomic int repl_serving = 0;            /* a standby thread is running */
+static _Atomic unsigned long repl_refused = 0;
+
+/* Ring for log shipping; before the logger starts */
+void repl_init() {
+    if (conf.repl_listen <= 0)
+        return;
+    repl_cap = conf.repl_buffer_bytes > 64 * 1024 ? conf.repl_buffer_bytes : 64 * 1024;
+    repl_epoch = wall_ms();
+    repl_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    repl_ring = malloc(repl_cap);
+}
+
+/* Copy a logged record into the current batch's frames; logger thread */
+void repl_stage(log_slot_t *s) {
+    const char *file = s->file ? s->file : "";
+    size_t flen = strlen(file), slen = strlen(s->sender), rlen = strlen(s->room);
+    size_t need = REPL_FRAME_HEAD + flen + slen + rlen + s->len;
+    unsigned char *p;
+
+    if (flen > 255 || need > repl_cap)
+        return;
+    if (repl_stage_len + need > repl_stage_cap) {
+        size_t ncap = repl_stage_cap ? repl_stage_cap : 64 * 1024;
+        unsigned char *n;
+        while (ncap < repl_stage_len + need)
+            ncap *= 2;
+        if ((n = realloc(repl_stage_buf, ncap)) == NULL)
+            return;
+        repl_stage_buf = n;
+        repl_stage_cap = ncap;
+    }
+    p = repl_stage_buf + repl_stage_len;
+    chat_log_put32(p, need - 4);
+    chat_log_put64(p + 4, repl_stage_seq++);
+    chat_log_put64(p + 12, s->when);
+    p[20] = s->type;
+    p[21] = flen;
+    p[22] = slen;
+    p[23] = rlen;
+    p += REPL_FRAME_HEAD;
+    memcpy(p, file, flen);
+    memcpy(p + flen, s->sender, slen);
+    memcpy(p + flen + slen, s->room, rlen);
+    memcpy(p + flen + slen + rlen, s->big ? s->big : s->text, s->len);
+    repl_stage_len += need;
+}
+
+/* Ring bytes at off (wrapping) */
+void repl_ring_get(size_t off, void *dst, size_t n) {
+    size_t first = repl_cap - off < n ? repl_cap - off : n;
+
+    memcpy(dst, repl_ring + off, first);
+    memcpy((unsigned char *)dst + first, repl_ring, n - first);
+}
+
+size_t repl_frame_len(size_t off) {
+    unsigned char head[4];
+
+    repl_ring_get(off, head, 4);
+    return 4 + chat_log_get32(head);
+}
+
+/* Publish the batch's frames to the replication thread; logger thread */
+void repl_commit() {
+    size_t off, first;
+
+    if (repl_stage_len == 0)
+        return;
+    pthread_mutex_lock(&repl_lock);
+    while (repl_used + repl_stage_len > repl_cap) {
+        size_t n = repl_frame_len(repl_head_off);
+        repl_head_off = (repl_head_off + n) % repl_cap;
+        repl_used -= n;
+        repl_head_seq++;
+        repl_overwritten++;
+    }
+    off = (repl_head_off + repl_used) % repl_cap;
+    first = repl_cap - off < repl_stage_len ? repl_cap - off : repl_stage_len;
+    memcpy(repl_ring + off, repl_stage_buf, first);
+    memcpy(repl_ring, repl_stage_buf + first, repl_stage_len - first);
+    repl_used += repl_stage_len;
+    repl_next_seq = repl_stage_seq;
+    pthread_mutex_unlock(&repl_lock);
+    repl_stage_len = 0;
+    if (repl_waiting && atomic_exchange(&repl_waiting, 0)) {
+        uint64_t one = 1;
+        write(repl_wakefd, &one, sizeof(one));
+    }
+}
+
+void *logger_main(void *arg) {
+    static char prefix[LOG_BATCH][96];
+    struct log_file *stream[LOG_BATCH];
+    struct iovec iov[LOG_BATCH * 2];
+    log_slot_t *batch[LOG_BATCH];
+    unsigned long batch_pos[LOG_BATCH];
+    char stamp[64];
+    long long stamp_sec = -1, expire_ms = 0;
+    int idle_rounds = 0;
+
+    thread_register(ROLE_LOGGER);
+    while (1) {
+        unsigned int n = 0;
+        long long now = wall_ms();
+
+        if (now - expire_ms >= 1000) {
+            log_streams_expire(now);
+            expire_ms = now;
+        }
+
+        while (n < LOG_BATCH) {
+            log_slot_t *slot = &log_ring[log_head & log_mask];
+            if (atomic_load_explicit(&slot->seq, memory_order_acquire) != log_head + 1)
+                break;
+            batch_pos[n] = log_head++;
+            batch[n++] = slot;
+        }
+        if (n == 0) {
+            /* Nothing queued: look again every LOG_IDLE_MS, so busy producers
+               never pay for a wakeup; after a quiet spell sleep until the
+               next producer sees log_sleeping */
+            struct pollfd pfd = { log_wakefd, POLLIN, 0 };
+            uint64_t v;
+            if (!log_sync_batch(wall_ms()) || ++idle_rounds < 100) {
+                poll(NULL, 0, LOG_IDLE_MS);
+                continue;
+            }
+            log_sleeping = 1;
+            if (atomic_load(&log_ring[log_head & log_mask].seq) != log_head + 1)
+                poll(&pfd, 1, 1000);
+            log_sleeping = 0;
+            read(log_wakefd, &v, sizeof(v));
+            thread_sample();
+            continue;
+        }
+        idle_rounds = 0;
+
+        for (unsigned int i = 0; i < n; i++) {
+            char name[48];
+            stream[i] = log_stream_find(log_stream_name(batch[i], name, sizeof(name)), now);
+        }
+        /* One write per stream, records in queue order */
+        for (unsigned int i = 0; i < n; i++) {
+            struct log_file *f = stream[i];
+            int cnt = 0, fd = -1;
+            ssize_t wrote = 0, block_bytes;
+            bool restart = false;
+
+            if (batch[i] == NULL)
+                continue;
+            if (f)
+                fd = log_stream_ready(f, now);
+            if (f && f->binary && fd >= 0 &&
+                (f->index_at == ULONG_MAX || f->bytes - f->index_at >= (unsigned long)conf.log_index_bytes)) {
+                /* The next block starts afresh so the index can point at it */
+                log_dict_reset(&f->block.users);
+                log_dict_reset(&f->block.rooms);
+                restart = true;
+            }
+            for (unsigned int j = i; j < n; j++) {
+                log_slot_t *s = batch[j];
+                long long sec;
+                int plen;
+
+                if (s == NULL || stream[j] != f || f == NULL)
+                    continue;
+                if (s->ack_uid)
+                    log_ack_add(s);
+                if (s->type && f->binary) {
+                    log_block_add(&f->block, s);
+                    if (s->type == CHAT_LOG_MSG && conf.search_index && strncmp(f->name, "rooms/", 6) == 0)
+                        search_add(f->number, f->bytes, f->block.count - 1,
+                            (unsigned char *)(s->big ? s->big : s->text), s->len);
+                    continue;
+                }
+                if ((sec = s->when / 1000) != stamp_sec) {
+                    struct tm tm;
+                    time_t t = sec;
+                    localtime_r(&t, &tm);
+                    snprintf(stamp, sizeof(stamp), "[%04d/%02d/%02d] %02d:%02d:%02d ",
+                        1900 + tm.tm_year, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+                    stamp_sec = sec;
+                }
+                memcpy(prefix[j], stamp, 22);
+                plen = 22;
+                if (s->type)
+                    plen += snprintf(prefix[j] + 22, sizeof(prefix[j]) - 22, "%c%s ",
+                        s->type == CHAT_LOG_DM ? '@' : '#', s->room);
+                iov[cnt].iov_base = prefix[j];
+                iov[cnt++].iov_len = plen;
+                iov[cnt].iov_base = s->big ? s->big : s->text;
+                iov[cnt++].iov_len = s->len;
+                log_bytes += plen + s->len;
+            }
+            if (cnt > 0 && fd >= 0)
+                wrote = writev(fd, iov, cnt);
+            if (f) {
+                if ((block_bytes = log_block_flush(&f->block, fd)) > 0 && restart)
+                    log_index_append(f, f->block.base, f->bytes + wrote);
+                wrote += block_bytes;
+                f->last_ms = now;
+            }
+            if (wrote > 0) {
+                f->bytes += wrote;
+                f->dirty = true;
+            }
+            for (unsigned int j = i; j < n; j++) {
+                log_slot_t *s = batch[j];
+                if (s == NULL || stream[j] != f)
+                    continue;
+                if (repl_ring)
+                    repl_stage(s);
+                free(s->big);
+                batch[j] = NULL;
+                /* Hand the slot back to producers one lap ahead */
+                atomic_store_explicit(&s->seq, batch_pos[j] + log_mask + 1, memory_order_release);
+            }
+        }
+        log_batches++;
+        log_sync_batch(now);
+        if (repl_ring)
+            repl_commit();
+    }
+    return NULL;
+}
+
+void start_logger() {
+    pthread_t tid;
+    unsigned long size = 64;
+
+    while (size < (unsigned long)conf.log_ring)
+        size *= 2;
+    log_ring = calloc(size, sizeof(log_slot_t));
+    log_mask = size - 1;
+    log_reserve = size / 4 < LOG_AUDIT_RESERVE ? size / 4 : LOG_AUDIT_RESERVE;
+    for (unsigned long i = 0; i < size; i++)
+        log_ring[i].seq = i;
+    log_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    mkdir(LOG_DIR, 0755);
+    mkdir(LOG_DIR "/rooms", 0755);
+    if (!manifest_load()) {
+        fprintf(stderr, "ERROR: out of memory loading " LOG_MANIFEST "\n");
+        exit(1);
+    }
+    search_start();
+    repl_init();
+    pthread_create(&tid, NULL, logger_main, NULL);
+    pthread_detach(tid);
+    pthread_create(&tid, NULL, compress_main, NULL);
+    pthread_detach(tid);
+}
+
+/* Add clients to queue */
+void queue_add(client_t *clnt){
+	pthread_mutex_lock(&clnt_mutex);
+
+	for(int i=0; i < conf.max_clients; ++i){
+		if(!clients[i]){
+			clients[i] = clnt;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&clnt_mutex);
+}
+
+/* Remove clients to queue */
+void queue_remove(int uid){
+	pthread_mutex_lock(&clnt_mutex);
+
+	for(int i=0; i < conf.max_clients; ++i){
+		if(clients[i]){
+			if(clients[i]->uid == uid){
+				clients[i] = NULL;
+				break;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&clnt_mutex);
+}
+
+/* Append to the output queue, growing it from the pool */
+int out_q_push(client_t *c, msg_t *m, unsigned int off) {
+    struct out_ref *ref;
+
+    if (c->out_count == c->out_cap) {
+        unsigned int cap, ncap = c->out_cap ? c->out_cap * 2 : 4;
+        struct out_ref *q = pool_alloc(ncap * sizeof(struct out_ref), &cap);
+
+        if (q == NULL)
+            return -1;
+        for (unsigned int i = 0; i < c->out_count; i++)
+            q[i] = c->out_q[(c->out_head + i) % c->out_cap];
+        pool_free(c->out_q, c->out_cap * sizeof(struct out_ref));
+        conn_buffer_bytes += (long)(ncap - c->out_cap) * sizeof(struct out_ref);
+        c->out_q = q;
+        c->out_head = 0;
+        c->out_cap = ncap;
+    }
+    ref = &c->out_q[(c->out_head + c->out_count) % c->out_cap];
+    ref->msg = m;
+    ref->off = off;
+    msg_hold(m);
+    c->out_count++;
+    c->out_bytes += m->len - off;
+    return 0;
+}
+
+/* Queue messages on a client; when nothing is queued they go out in one gathered write.
+   Returns false if they were discarded; otherwise <mark>, if given, is the
+   value out_sent reaches once the last of them is written. */
+bool conn_send_batch(client_t *c, msg_t **msgs, unsigned int count, unsigned int *mark) {
+    unsigned int first = 0, off = 0;
+    bool was_empty, ok = false;
+
+    pthread_mutex_lock(&c->out_lock);
+    if (c->state == CONN_CLOSING || (c->out_flags & CLIENT_DROPPED))
+        goto out;
+
+    was_empty = c->out_count == 0;
+    if (was_empty) {
+        struct iovec iov[HISTORY_MAX];
+        struct msghdr mh;
+        ssize_t n;
+
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov;
+        for (unsigned int i = 0; i < count && i < HISTORY_MAX; i++) {
+            iov[i].iov_base = msgs[i]->data;
+            iov[i].iov_len = msgs[i]->len;
+            mh.msg_iovlen++;
+        }
+        n = sendmsg(c->sockfd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                goto out; /* the owner sees the error through epoll */
+            n = 0;
+        }
+        c->out_sent += n;
+        while (first < count && n >= (ssize_t)msgs[first]->len) {
+            n -= msgs[first]->len;
+            first++;
+        }
+        off = n;
+        if ((ok = first == count))
+            goto out;
+    }
+
+    for (unsigned int i = first; i < count; i++, off = 0) {
+        if (c->out_bytes + msgs[i]->len - off > (unsigned int)conf.max_out_bytes
+            || out_q_push(c, msgs[i], off) < 0) {
+            /* Slow reader; the owner closes it on the resulting hangup */
+            printf("Dropping slow client %s\n", c->username);
+            c->out_flags |= CLIENT_DROPPED;
+            shutdown(c->sockfd, SHUT_RDWR);
+            goto out;
+        }
+    }
+    if (was_empty && !(c->out_flags & CLIENT_WRITE_LISTED)) {
+        /* Let the owner start the write-stall clock */
+        io_thread_t *io = c->io;
+        uint64_t one = 1;
+        pthread_mutex_lock(&io->mbox_lock);
+        c->out_flags |= CLIENT_WRITE_LISTED;
+        c->next_write = io->write_list;
+        io->write_list = c;
+        pthread_mutex_unlock(&io->mbox_lock);
+        write(io->wakefd, &one, sizeof(one));
+    }
+    ok = true;
+out:
+    if (ok && mark)
+        *mark = c->out_sent + c->out_bytes;
+    pthread_mutex_unlock(&c->out_lock);
+    return ok;
+}
+
+bool conn_send(client_t *c, msg_t *m) {
+    return conn_send_batch(c, &m, 1, NULL);
+}
+
+/* Queue a message ahead of everything not yet started on the wire */
+void conn_send_urgent(client_t *c, msg_t *m) {
+    unsigned int pos;
+
+    pthread_mutex_lock(&c->out_lock);
+    if (c->out_count == 0 || c->state == CONN_CLOSING || (c->out_flags & CLIENT_DROPPED)) {
+        pthread_mutex_unlock(&c->out_lock);
+        conn_send(c, m);
+        return;
+    }
+    if (out_q_push(c, m, 0) == 0) {
+        /* Bubble it forward past the queued messages; a partly written head stays first */
+        unsigned int front = c->out_q[c->out_head].off > 0;
+        if (c->mailbox)
+            c->mailbox_mark += m->len;
+        for (pos = c->out_count - 1; pos > front; pos--) {
+            struct out_ref *a = &c->out_q[(c->out_head + pos - 1) % c->out_cap];
+            struct out_ref *b = &c->out_q[(c->out_head + pos) % c->out_cap];
+            struct out_ref t = *a;
+            *a = *b;
+            *b = t;
+        }
+    }
+    pthread_mutex_unlock(&c->out_lock);
+}
+
+/* Write out as much of the queue as the socket takes; owner thread only */
+void conn_flush(client_t *c) {
+    struct iovec iov[64];
+
+    pthread_mutex_lock(&c->out_lock);
+    while (c->out_count > 0) {
+        int n = 0;
+        ssize_t w;
+
+        for (unsigned int i = 0; i < c->out_count && n < 64; i++, n++) {
+            struct out_ref *ref = &c->out_q[(c->out_head + i) % c->out_cap];
+            iov[n].iov_base = ref->msg->data + ref->off;
+            iov[n].iov_len = ref->msg->len - ref->off;
+        }
+        if ((w = writev(c->sockfd, iov, n)) <= 0)
+            break;
+        c->out_bytes -= w;
+        c->out_sent += w;
+        while (w > 0) {
+            struct out_ref *ref = &c->out_q[c->out_head];
+            unsigned int left = ref->msg->len - ref->off;
+            if ((size_t)w < left) {
+                ref->off += w;
+                break;
+            }
+            w -= left;
+            msg_release(ref->msg);
+            c->out_head = (c->out_head + 1) % c->out_cap;
+            c->out_count--;
+        }
+    }
+    if (c->mailbox && (int)(c->out_sent - c->mailbox_mark) >= 0) {
+        mailbox_written(c->mailbox, true);
+        c->mailbox = NULL;
+    }
+    if (c->out_count == 0 && c->out_q) {
+        /* Burst is over: give the queue back */
+        pool_free(c->out_q, c->out_cap * sizeof(struct out_ref));
+        conn_buffer_bytes -= c->out_cap * sizeof(struct out_ref);
+        c->out_q = NULL;
+        c->out_cap = 0;
+        c->out_head = 0;
+    }
+    pthread_mutex_unlock(&c->out_lock);
+}
+
+/* Chat room; members are only touched under lock, the rest under state_lock */
+typedef struct room {
+    char name[32];
+    unsigned long gen;          /* tells a recreated room from the old one */
+    bool replica;               /* fed by log shipping: kept when empty */
+    struct room *next;
+    pthread_rwlock_t lock;
+    client_t **members;
+    unsigned int nmembers;
+    unsigned int cap;
+    pthread_mutex_t state_lock;
+    rate_limit_t rate;
+    int vote_open;
+    int votes[3];
+    char question[100];
+    /* presence changes not yet sent, under presence_lock */
+    struct presence_change *pending;
+    unsigned int npending;
+    unsigned int pending_cap;
+    unsigned char presence_dirty;
+    struct room *next_dirty;
+    /* recent messages for late joiners, under history_lock */
+    pthread_mutex_t history_lock;
+    msg_t **history;
+    _Atomic unsigned long long seq;  /* last sequence number handed out, read lock-free */
+    unsigned long long low_water;    /* every acking member has acknowledged up to here */
+    unsigned int hist_cap;
+    unsigned int hist_head;
+    unsigned int hist_count;
+    unsigned int hist_bytes;
+} room_t;
+
+/* Online usernames found as @name in one message */
+typedef struct {
+    int n;
+    char names[MENTION_MAX][32];
+} mentions_t;
+
+/* Net joins (+) and leaves (-) of one name since the last batch */
+struct presence_change {
+    char name[32];
+    int delta;
+};
+
+/* Room table; a room exists while it has members */
+static room_t *room_table[ROOM_BUCKETS];
+static pthread_rwlock_t rooms_lock = PTHREAD_RWLOCK_INITIALIZER;
+static _Atomic long room_count = 0;
+static _Atomic unsigned long room_generation = 0;
+static _Atomic long history_bytes_total = 0;
+
+bool room_name_valid(const char *name) {
+    size_t len = strlen(name);
+
+    if (len == 0 || len >= 32)
+        return false;
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '-' && name[i] != '_')
+            return false;
+    }
+    return true;
+}
+
+room_t *room_find(const char *name) {
+    room_t *r = room_table[hash((unsigned char *)name) % ROOM_BUCKETS];
+
+    while (r && strcmp(r->name, name) != 0)
+        r = r->next;
+    return r;
+}
+
+/* Rooms with unsent presence changes, oldest first */
+static room_t *presence_head = NULL, *presence_tail = NULL;
+static pthread_mutex_t presence_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic unsigned long presence_events = 0;
+static _Atomic unsigned long presence_coalesced = 0;
+static _Atomic unsigned long presence_batches = 0;
+
+/* Record a join (+1) or leave (-1); it reaches members with the next batch */
+void presence_event(room_t *r, const char *name, int delta) {
+    struct presence_change *pc = NULL;
+
+    presence_events++;
+    pthread_mutex_lock(&presence_lock);
+    for (unsigned int i = 0; i < r->npending; i++) {
+        if (strcmp(r->pending[i].name, name) == 0) {
+            pc = &r->pending[i];
+            presence_coalesced++;
+            break;
+        }
+    }
+    if (pc == NULL) {
+        if (r->npending == r->pending_cap) {
+            unsigned int ncap = r->pending_cap ? r->pending_cap * 2 : 8;
+            struct presence_change *p = realloc(r->pending, ncap * sizeof(*p));
+            if (p == NULL) {
+                pthread_mutex_unlock(&presence_lock);
+                return;
+            }
+            r->pending = p;
+            r->pending_cap = ncap;
+        }
+        pc = &r->pending[r->npending++];
+        snprintf(pc->name, sizeof(pc->name), "%s", name);
+        pc->delta = 0;
+    }
+    pc->delta += delta;
+    if (!r->presence_dirty) {
+        r->presence_dirty = 1;
+        r->next_dirty = NULL;
+        if (presence_tail)
+            presence_tail->next_dirty = r;
+        else
+            presence_head = r;
+        presence_tail = r;
+    }
+    pthread_mutex_unlock(&presence_lock);
+}
+
+/* Drop pending changes of a room that is about to be freed (rooms_lock held for writing) */
+void presence_forget(room_t *r) {
+    pthread_mutex_lock(&presence_lock);
+    if (r->presence_dirty) {
+        room_t **pp = &presence_head, *prev = NULL;
+        while (*pp != r) {
+            prev = *pp;
+            pp = &(*pp)->next_dirty;
+        }
+        *pp = r->next_dirty;
+        if (presence_tail == r)
+            presence_tail = prev;
+        r->presence_dirty = 0;
+    }
+    r->npending = 0;
+    pthread_mutex_unlock(&presence_lock);
+}
+
+/* Send one message to the members that want presence updates */
+void presence_send(room_t *r, char *s, unsigned int len) {
+    msg_t *m = msg_new(s, len);
+
+    if (m == NULL)
+        return;
+    pthread_rwlock_rdlock(&r->lock);
+    for (unsigned int i = 0; i < r->nmembers; i++) {
+        if (!r->members[i]->presence_off)
+            conn_send(r->members[i], m);
+    }
+    pthread_rwlock_unlock(&r->lock);
+    msg_release(m);
+}
+
+/* Send every dirty room one coalesced "PRESENCE #room +a -b" batch */
+void presence_flush() {
+    char line[BUFFER_SZ];
+    int rooms = 0;
+
+    /* Holding rooms_lock for reading keeps every room alive */
+    pthread_rwlock_rdlock(&rooms_lock);
+    pthread_mutex_lock(&presence_lock);
+    for (room_t *r = presence_head; r; r = r->next_dirty)
+        rooms++;
+    pthread_mutex_unlock(&presence_lock);
+
+    while (rooms-- > 0) {
+        struct presence_change *changes;
+        unsigned int n, len = 0;
+        room_t *r;
+
+        pthread_mutex_lock(&presence_lock);
+        r = presence_head;
+        presence_head = r->next_dirty;
+        if (presence_head == NULL)
+            presence_tail = NULL;
+        r->presence_dirty = 0;
+        changes = r->pending;
+        n = r->npending;
+        r->pending = NULL;
+        r->npending = r->pending_cap = 0;
+        pthread_mutex_unlock(&presence_lock);
+
+        for (unsigned int i = 0; i < n; i++) {
+            if (changes[i].delta == 0)
+                continue;
+            if (len > 0 && len + strlen(changes[i].name) + 3 >= sizeof(line)) {
+                line[len++] = '\n';
+                presence_send(r, line, len);
+                len = 0;
+            }
+            if (len == 0)
+                len = snprintf(line, sizeof(line), "PRESENCE #%s", r->name);
+            len += snprintf(line + len, sizeof(line) - len, " %c%s",
+                changes[i].delta > 0 ? '+' : '-', changes[i].name);
+        }
+        if (len > 0) {
+            line[len++] = '\n';
+            presence_send(r, line, len);
+            presence_batches++;
+        }
+        free(changes);
+    }
+    pthread_rwlock_unlock(&rooms_lock);
+}
+
+/* "ROSTER #room a b c" lines with the current members, for a client that just joined */
+void presence_roster(client_t *c, room_t *r) {
+    char line[BUFFER_SZ];
+    unsigned int len = 0;
+
+    if (c->presence_off)
+        return;
+    pthread_rwlock_rdlock(&r->lock);
+    for (unsigned int i = 0; i <= r->nmembers; i++) {
+        if (len > 0 && (i == r->nmembers || len + strlen(r->members[i]->username) + 3 >= sizeof(line))) {
+            msg_t *m;
+            line[len++] = '\n';
+            if ((m = msg_new(line, len)) != NULL) {
+                conn_send(c, m);
+                msg_release(m);
+            }
+            len = 0;
+        }
+        if (i == r->nmembers)
+            break;
+        if (len == 0)
+            len = snprintf(line, sizeof(line), "ROSTER #%s", r->name);
+        len += snprintf(line + len, sizeof(line) - len, " %s", r->members[i]->username);
+    }
+    pthread_rwlock_unlock(&r->lock);
+}
+
+
+static _Atomic unsigned long acks_received = 0;
+static _Atomic unsigned long resend_requests = 0;
+
+/* The client's ACK entry for a room, or NULL */
+struct room_ack *room_ack_entry(client_t *c, room_t *r) {
+    for (int i = 0; i < ROOMS_PER_CLIENT; i++) {
+        if (c->acks[i].room == r)
+            return &c->acks[i];
+    }
+    return NULL;
+}
+
+/* Start tracking ACKs for a room; <acked> is what the client already has */
+void room_ack_start(client_t *c, room_t *r, unsigned long long acked) {
+    struct room_ack *a = room_ack_entry(c, r);
+
+    if (a == NULL && (a = room_ack_entry(c, NULL)) == NULL)
+        return;
+    a->acked = acked;
+    a->room = r;
+    pthread_mutex_lock(&r->history_lock);
+    if (acked < r->low_water)
+        r->low_water = acked;
+    pthread_mutex_unlock(&r->history_lock);
+}
+
+/* Stop tracking; returns the last acknowledged seq or ACK_NONE */
+unsigned long long room_ack_stop(client_t *c, room_t *r) {
+    struct room_ack *a = room_ack_entry(c, r);
+    unsigned long long acked;
+
+    if (a == NULL)
+        return ACK_NONE;
+    acked = a->acked;
+    a->room = NULL;
+    return acked;
+}
+
+/* Lowest ACK among acking members (r->lock held); ACK_NONE if nobody acks */
+unsigned long long room_low_water(room_t *r) {
+    unsigned long long low = ACK_NONE;
+
+    for (unsigned int i = 0; i < r->nmembers; i++) {
+        struct room_ack *a = room_ack_entry(r->members[i], r);
+        if (a && a->acked < low)
+            low = a->acked;
+    }
+    return low;
+}
+
+room_t *room_join_at(client_t *c, const char *name, unsigned long long acked);
+
+/* New empty room; rooms_lock held for writing */
+room_t *room_create(const char *name) {
+    room_t *r = calloc(1, sizeof(room_t));
+    unsigned long b = hash((unsigned char *)name) % ROOM_BUCKETS;
+
+    if (r == NULL)
+        return NULL;
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->gen = ++room_generation;
+    pthread_rwlock_init(&r->lock, NULL);
+    pthread_mutex_init(&r->state_lock, NULL);
+    pthread_mutex_init(&r->history_lock, NULL);
+    r->next = room_table[b];
+    room_table[b] = r;
+    room_count++;
+    return r;
+}
+
+/* Add a client to a room, creating it on first use; the room becomes active */
+room_t *room_join(client_t *c, const char *name) {
+    return room_join_at(c, name, ACK_NONE);
+}
+
+/* As room_join; a SEQ ON client is taken to have everything up to <acked>
+   (ACK_NONE: up to the newest message) */
+room_t *room_join_at(client_t *c, const char *name, unsigned long long acked) {
+    room_t *r;
+
+    for (int i = 0; i < c->nrooms; i++) {
+        if (strcmp(c->rooms[i]->name, name) == 0)
+            return c->room = c->rooms[i];
+    }
+    if (c->nrooms == ROOMS_PER_CLIENT || !room_name_valid(name))
+        return NULL;
+
+    /* rooms_lock keeps the room from being freed until we are a member */
+    pthread_rwlock_rdlock(&rooms_lock);
+    if ((r = room_find(name)) == NULL) {
+        pthread_rwlock_unlock(&rooms_lock);
+        pthread_rwlock_wrlock(&rooms_lock);
+        if ((r = room_find(name)) == NULL)
+            r = room_create(name);
+        if (r == NULL) {
+            pthread_rwlock_unlock(&rooms_lock);
+            return NULL;
+        }
+    }
+
+    pthread_rwlock_wrlock(&r->lock);
+    if (r->nmembers == r->cap) {
+        unsigned int ncap = r->cap ? r->cap * 2 : 8;
+        client_t **m = realloc(r->members, ncap * sizeof(client_t *));
+        if (m == NULL) {
+            pthread_rwlock_unlock(&r->lock);
+            pthread_rwlock_unlock(&rooms_lock);
+            return NULL;
+        }
+        r->members = m;
+        r->cap = ncap;
+    }
+    if (c->seq_on)
+        room_ack_start(c, r, acked == ACK_NONE ? r->seq : acked);
+    r->members[r->nmembers++] = c;
+    pthread_rwlock_unlock(&r->lock);
+    pthread_rwlock_unlock(&rooms_lock);
+
+    c->rooms[c->nrooms++] = r;
+    return c->room = r;
+}
+
+/* Remove a client from a room; the last member out frees it. *last_seq gets
+   the newest message the client acknowledged, or was sent, from this room. */
+void room_part(client_t *c, room_t *r, unsigned long long *last_seq) {
+    bool empty;
+
+    for (int i = 0; i < c->nrooms; i++) {
+        if (c->rooms[i] == r) {
+            c->rooms[i] = c->rooms[--c->nrooms];
+            break;
+        }
+    }
+    if (c->room == r)
+        c->room = c->nrooms ? c->rooms[c->nrooms - 1] : NULL;
+
+    pthread_rwlock_wrlock(&rooms_lock);
+    pthread_rwlock_wrlock(&r->lock);
+    for (unsigned int i = 0; i < r->nmembers; i++) {
+        if (r->members[i] == c) {
+            r->members[i] = r->members[--r->nmembers];
+            break;
+        }
+    }
+    if (last_seq)
+        *last_seq = r->seq;
+    {
+        unsigned long long acked = room_ack_stop(c, r);
+        if (last_seq && acked != ACK_NONE)
+            *last_seq = acked;
+    }
+    for (int i = 0; c->nmuted && i < ROOMS_PER_CLIENT; i++) {
+        if (c->muted[i] == r) {
+            c->muted[i] = NULL;
+            c->nmuted--;
+        }
+    }
+    empty = r->nmembers == 0 && !r->replica;
+    pthread_rwlock_unlock(&r->lock);
+    if (empty)
+        presence_forget(r);
+    if (empty) {
+        room_t **pp = &room_table[hash((unsigned char *)r->name) % ROOM_BUCKETS];
+        while (*pp != r)
+            pp = &(*pp)->next;
+        *pp = r->next;
+        room_count--;
+    }
+    pthread_rwlock_unlock(&rooms_lock);
+
+    if (empty) {
+        while (r->hist_count > 0) {
+            history_bytes_total -= r->history[r->hist_head]->len;
+            msg_release(r->history[r->hist_head]);
+            r->hist_head = (r->hist_head + 1) % r->hist_cap;
+            r->hist_count--;
+        }
+        free(r->history);
+        pthread_mutex_destroy(&r->history_lock);
+        free(r->pending);
+        pthread_rwlock_destroy(&r->lock);
+        pthread_mutex_destroy(&r->state_lock);
+        free(r->members);
+        free(r);
+    }
+}
+
+/* Send a line to one client */
+void send_reply(client_t *c, char *s) {
+    msg_t *m = msg_new(s, strlen(s));
+
+    if (m) {
+        conn_send(c, m);
+        msg_release(m);
+    }
+}
+
+/* Fan a message out to every member of a room except the sender */
+void room_send(room_t *r, msg_t *m, int uid) {
+    pthread_rwlock_rdlock(&r->lock);
+    for (unsigned int i = 0; i < r->nmembers; i++) {
+        if (r->members[i]->uid != uid)
+            conn_send(r->members[i], m);
+    }
+    pthread_rwlock_unlock(&r->lock);
+}
+
+/* Send message to every member of a room except the sender */
+void send_message(room_t *r, char *s, int uid){
+	msg_t *m;
+
+	if (r == NULL || (m = msg_new(s, strlen(s))) == NULL)
+		return;
+	room_send(r, m, uid);
+	msg_release(m);
+}
+
+/* Double the history ring, up to HISTORY_MAX slots */
+bool room_history_grow(room_t *r) {
+    unsigned int ncap = r->hist_cap ? r->hist_cap * 2 : (unsigned int)conf.history_msgs;
+    msg_t **h;
+
+    if (r->hist_cap >= HISTORY_MAX)
+        return false;
+    if (ncap > HISTORY_MAX)
+        ncap = HISTORY_MAX;
+    if ((h = malloc(ncap * sizeof(msg_t *))) == NULL)
+        return false;
+    for (unsigned int i = 0; i < r->hist_count; i++)
+        h[i] = r->history[(r->hist_head + i) % r->hist_cap];
+    free(r->history);
+    r->history = h;
+    r->hist_cap = ncap;
+    r->hist_head = 0;
+    return true;
+}
+
+/* Number a message and keep it in the room's ring (r->lock held). The
+   number is handed out under history_lock, so the ring stays in seq order.
+   Past history_msgs/history_bytes the oldest is dropped once every acking
+   member has acknowledged it; unacknowledged messages stay up to
+   HISTORY_MAX or history_unacked_bytes. */
+void room_history_add(room_t *r, msg_t *m) {
+    pthread_mutex_lock(&r->history_lock);
+    m->seq = atomic_fetch_add(&r->seq, 1) + 1;
+    if (conf.history_msgs <= 0 || m->len > (unsigned int)conf.history_bytes) {
+        pthread_mutex_unlock(&r->history_lock);
+        return;
+    }
+    while (r->hist_count > 0) {
+        msg_t *old = r->history[r->hist_head];
+        bool over = r->hist_count >= (unsigned int)conf.history_msgs
+            || r->hist_bytes + m->len > (unsigned int)conf.history_bytes;
+        bool full = r->hist_count >= HISTORY_MAX
+            || r->hist_bytes + m->len > (unsigned int)conf.history_unacked_bytes;
+
+        if (!over)
+            break;
+        if (!full && old->seq > r->low_water && (r->low_water = room_low_water(r)) < old->seq)
+            break;
+        r->hist_bytes -= old->len;
+        history_bytes_total -= old->len;
+        msg_release(old);
+        r->hist_head = (r->hist_head + 1) % r->hist_cap;
+        r->hist_count--;
+    }
+    if (r->hist_count == r->hist_cap && !room_history_grow(r)) {
+        pthread_mutex_unlock(&r->history_lock);
+        return;
+    }
+    msg_hold(m);
+    r->history[(r->hist_head + r->hist_count) % r->hist_cap] = m;
+    r->hist_count++;
+    r->hist_bytes += m->len;
+    history_bytes_total += m->len;
+    pthread_mutex_unlock(&r->history_lock);
+}
+
+/* "MSG #room <seq> <text>" copy of a room message for SEQ ON clients */
+msg_t *room_numbered(room_t *r, msg_t *m) {
+    char head[64];
+    int n = snprintf(head, sizeof(head), "MSG #%s %llu ", r->name, m->seq);
+    unsigned int cap;
+    msg_t *nm = pool_alloc(sizeof(msg_t) + n + m->len + 1, &cap);
+
+    if (nm == NULL)
+        return NULL;
+    nm->refs = 1;
+    nm->cap = cap;
+    nm->len = n + m->len;
+    nm->seq = m->seq;
+    memcpy(nm->data, head, n);
+    memcpy(nm->data + n, m->data, m->len + 1);
+    return nm;
+}
+
+static _Atomic unsigned long mentions_found = 0;
+static _Atomic unsigned long mention_notices = 0;
+
+bool client_muted(client_t *c, room_t *r) {
+    for (int i = 0; c->nmuted && i < ROOMS_PER_CLIENT; i++) {
+        if (c->muted[i] == r)
+            return true;
+    }
+    return false;
+}
+
+bool mentioned(const mentions_t *mn, const char *name) {
+    for (int i = 0; mn && i < mn->n; i++) {
+        if (strcmp(mn->names[i], name) == 0)
+            return true;
+    }
+    return false;
+}
+
+/* "MENTION " + what the member would otherwise get */
+msg_t *mention_notice(msg_t *m) {
+    unsigned int cap;
+    msg_t *nm = pool_alloc(sizeof(msg_t) + 8 + m->len + 1, &cap);
+
+    if (nm == NULL)
+        return NULL;
+    nm->refs = 1;
+    nm->cap = cap;
+    nm->len = 8 + m->len;
+    nm->seq = m->seq;
+    memcpy(nm->data, "MENTION ", 8);
+    memcpy(nm->data + 8, m->data, m->len + 1);
+    return nm;
+}
+
+/* One post on its way to a room's members. Large rooms split the member
+   list into fanout_chunk slices that the poster and the fan-out threads
+   claim one at a time; the poster keeps r->lock (read) until every slice
+   is done, so the list cannot change under the helpers. */
+typedef struct {
+    room_t *r;
+    msg_t *m;
+    msg_t *numbered;
+    msg_t *notice[2];           /* MENTION copies of m and numbered */
+    int uid;
+    mentions_t mn;
+    unsigned int nmembers;
+    unsigned int nchunks;
+    _Atomic unsigned int next;
+    _Atomic unsigned int done;
+    _Atomic int refs;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} fanout_t;
+
+static _Atomic unsigned long fanout_parallel_posts = 0;
+static _Atomic unsigned long fanout_helper_chunks = 0;
+
+/* Deliver to members [lo, hi); copies are made on first use, so callers
+   that share f between threads make them up front */
+void fanout_range(fanout_t *f, unsigned int lo, unsigned int hi) {
+    room_t *r = f->r;
+
+    for (unsigned int i = lo; i < hi; i++) {
+        client_t *c = r->members[i];
+        msg_t *out = f->m;
+
+        if (c->uid == f->uid)
+            continue;
+        if (c->seq_on && (f->numbered || (f->numbered = room_numbered(r, f->m)) != NULL))
+            out = f->numbered;
+        if (f->mn.n > 0 && mentioned(&f->mn, c->username)) {
+            int k = out == f->numbered;
+            if (f->notice[k] || (f->notice[k] = mention_notice(out)) != NULL) {
+                conn_send_urgent(c, f->notice[k]);
+                mention_notices++;
+                continue;
+            }
+        }
+        if (c->nmuted && client_muted(c, r))
+            continue;
+        conn_send(c, out);
+    }
+}
+
+void fanout_put(fanout_t *f) {
+    if (atomic_fetch_sub(&f->refs, 1) != 1)
+        return;
+    if (f->numbered)
+        msg_release(f->numbered);
+    for (int k = 0; k < 2; k++) {
+        if (f->notice[k])
+            msg_release(f->notice[k]);
+    }
+    msg_release(f->m);
+    pthread_mutex_destroy(&f->lock);
+    pthread_cond_destroy(&f->cond);
+    free(f);
+}
+
+/* Claim slices until none are left; returns how many this thread did */
+unsigned int fanout_work(fanout_t *f) {
+    unsigned int k, chunk = conf.fanout_chunk, worked = 0;
+
+    while ((k = atomic_fetch_add(&f->next, 1)) < f->nchunks) {
+        unsigned int hi = (k + 1) * chunk < f->nmembers ? (k + 1) * chunk : f->nmembers;
+        fanout_range(f, k * chunk, hi);
+        worked++;
+        if (atomic_fetch_add(&f->done, 1) + 1 == f->nchunks) {
+            pthread_mutex_lock(&f->lock);
+            pthread_cond_signal(&f->cond);
+            pthread_mutex_unlock(&f->lock);
+        }
+    }
+    return worked;
+}
+
+void fanout_job(void *arg) {
+    fanout_t *f = arg;
+
+    fanout_helper_chunks += fanout_work(f);
+    fanout_put(f);
+}
+
+/* Fan out across the fan-out threads (r->lock held); false to do it inline */
+bool fanout_parallel(room_t *r, msg_t *m, int uid, const mentions_t *mn) {
+    unsigned int helpers;
+    fanout_t *f = calloc(1, sizeof(fanout_t));
+
+    if (f == NULL)
+        return false;
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    msg_hold(m);
+    f->refs = 1;
+    f->r = r;
+    f->m = m;
+    f->uid = uid;
+    if (mn)
+        f->mn = *mn;
+    f->nmembers = r->nmembers;
+    f->nchunks = (f->nmembers + conf.fanout_chunk - 1) / conf.fanout_chunk;
+    f->numbered = room_numbered(r, m);
+    if (f->mn.n > 0) {
+        f->notice[0] = mention_notice(m);
+        f->notice[1] = f->numbered ? mention_notice(f->numbered) : NULL;
+    }
+    if (f->numbered == NULL || (f->mn.n > 0 && (f->notice[0] == NULL || f->notice[1] == NULL))) {
+        fanout_put(f);
+        return false;
+    }
+    helpers = f->nchunks - 1 < (unsigned int)conf.fanout_threads ? f->nchunks - 1 : (unsigned int)conf.fanout_threads;
+    f->refs = 1 + helpers;
+    for (unsigned int i = 0; i < helpers; i++) {
+        if (!job_push(&fanout_jobs, fanout_job, f))
+            f->refs--;
+    }
+    fanout_work(f);
+    pthread_mutex_lock(&f->lock);
+    while (f->done < f->nchunks)
+        pthread_cond_wait(&f->cond, &f->lock);
+    pthread_mutex_unlock(&f->lock);
+    fanout_parallel_posts++;
+    fanout_put(f);
+    return true;
+}
+
+/* Post a chat message: number it, keep it and fan it out as one step, so a
+   member leaving sees either all of it or none of it. Mentioned members get
+   it as a MENTION ahead of their queue, even in a muted room. */
+void room_post(room_t *r, msg_t *m, int uid, const mentions_t *mn) {
+    pthread_rwlock_rdlock(&r->lock);
+    room_history_add(r, m);
+    if (conf.fanout_threshold <= 0 || conf.fanout_threads <= 0
+        || r->nmembers < (unsigned int)conf.fanout_threshold || !fanout_parallel(r, m, uid, mn)) {
+        fanout_t f;
+
+        memset(&f, 0, sizeof(f));
+        f.r = r;
+        f.m = m;
+        f.uid = uid;
+        if (mn)
+            f.mn = *mn;
+        fanout_range(&f, 0, r->nmembers);
+        if (f.numbered)
+            msg_release(f.numbered);
+        for (int k = 0; k < 2; k++) {
+            if (f.notice[k])
+                msg_release(f.notice[k]);
+        }
+    }
+    pthread_rwlock_unlock(&r->lock);
+}
+
+/* Resend the room's messages in (after, upto] to one client in a single
+   gathered write, numbered if it asked for SEQ ON */
+void room_history_range(client_t *c, room_t *r, unsigned long long after, unsigned long long upto) {
+    msg_t *msgs[HISTORY_MAX];
+    unsigned int n = 0;
+    bool missed = false;
+
+    pthread_mutex_lock(&r->history_lock);
+    if (upto > r->seq)
+        upto = r->seq;
+    for (unsigned int i = 0; i < r->hist_count; i++) {
+        msg_t *m = r->history[(r->hist_head + i) % r->hist_cap];
+        if (m->seq <= after)
+            continue;
+        if (m->seq > upto)
+            break;
+        if (n == 0 && after > 0 && m->seq > after + 1)
+            missed = true;
+        msgs[n++] = m;
+        msg_hold(m);
+    }
+    if (n == 0 && after > 0 && upto > after)
+        missed = true;
+    pthread_mutex_unlock(&r->history_lock);
+
+    if (missed) {
+        char notice[80];
+        snprintf(notice, sizeof(notice), "(older messages in #%s are no longer available)\n", r->name);
+        send_reply(c, notice);
+    }
+
+    for (unsigned int i = 0; c->seq_on && i < n; i++) {
+        msg_t *nm = room_numbered(r, msgs[i]);
+        if (nm) {
+            msg_release(msgs[i]);
+            msgs[i] = nm;
+        }
+    }
+    if (n > 0)
+        conn_send_batch(c, msgs, n, NULL);
+    for (unsigned int i = 0; i < n; i++)
+        msg_release(msgs[i]);
+}
+
+/* Replay the room's messages after <since> to one client */
+void room_history_replay(client_t *c, room_t *r, unsigned long long since) {
+    room_history_range(c, r, since, ACK_NONE);
+}
+
+/* Chat log record of a room event; sender may be NULL */
+void room_log(room_t *r, int type, const char *sender, char *message) {
+    chat_log(type, sender, r->name, message);
+}
+
+/*
+ * Heavy hitters: every I/O thread counts the messages it handles per sender
+ * and per room in sketches of its own, so the hot path takes no lock. A
+ * sketch is a count-min table of totals since start, a ring of count-min
+ * tables for the last SKETCH_SLOTS periods of SKETCH_SLOT_MS (the recent
+ * rate), and a min-heap of the SKETCH_TRACK keys with the highest counts
+ * the thread has seen. The admin `top` command adds up the tables of all
+ * threads (they share their hashes, so count-min tables merge by sum) and
+ * ranks the union of the heaps by the merged estimates.
+ */
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 2048
+#define SKETCH_RATE_WIDTH 512
+#define SKETCH_SLOTS 6
+#define SKETCH_SLOT_MS 10000
+#define SKETCH_TRACK 32
+
+struct sketch_key {
+    uint64_t hash;
+    unsigned int count;         /* this thread's estimate when last counted */
+    char name[32];
+};
+
+struct sketch_slot {
+    _Atomic unsigned int period;    /* number + 1 of the period it counts; 0 while cleared */
+    _Atomic unsigned int count[SKETCH_DEPTH][SKETCH_RATE_WIDTH];
+};
+
+struct sketch {
+    _Atomic unsigned int total[SKETCH_DEPTH][SKETCH_WIDTH];
+    struct sketch_slot slots[SKETCH_SLOTS];
+    _Atomic unsigned int seq;   /* odd while the heap changes */
+    unsigned int ntop;
+    struct sketch_key top[SKETCH_TRACK];
+};
+
+uint64_t sketch_hash(const char *s) {
+    uint64_t h = 14695981039346656037ULL;
+
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+    return h;
+}
+
+/* Column of row i: double hashing from the two halves of h */
+static inline unsigned int sketch_col(uint64_t h, int i, unsigned int width) {
+    return ((uint32_t)h + i * ((uint32_t)(h >> 32) | 1)) & (width - 1);
+}
+
+void sketch_sift(struct sketch_key *top, unsigned int n, unsigned int i) {
+    while (1) {
+        unsigned int least = i, l = 2 * i + 1, r = l + 1;
+        struct sketch_key tmp;
+
+        if (l < n && top[l].count < top[least].count)
+            least = l;
+        if (r < n && top[r].count < top[least].count)
+            least = r;
+        if (least == i)
+            return;
+        tmp = top[i];
+        top[i] = top[least];
+        top[least] = tmp;
+        i = least;
+    }
+}
+
+/* Keep name among the thread's SKETCH_TRACK largest; est only grows per key */
+void sketch_track(struct sketch *s, uint64_t h, const char *name, unsigned int est) {
+    unsigned int seq, i;
+
+    if (s->ntop == SKETCH_TRACK && est <= s->top[0].count)
+        return;
+    seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+    atomic_store_explicit(&s->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (i = 0; i < s->ntop; i++) {
+        if (s->top[i].hash == h && strcmp(s->top[i].name, name) == 0)
+            break;
+    }
+    if (i == s->ntop) {
+        if (s->ntop < SKETCH_TRACK) {
+            /* Not full yet: append and restore the heap */
+            i = s->ntop++;
+            while (i > 0 && s->top[(i - 1) / 2].count > est) {
+                s->top[i] = s->top[(i - 1) / 2];
+                i = (i - 1) / 2;
+            }
+        }
+        else
+            i = 0;
+        s->top[i].hash = h;
+        snprintf(s->top[i].name, sizeof(s->top[i].name), "%s", name);
+    }
+    s->top[i].count = est;
+    sketch_sift(s->top, s->ntop, i);
+    atomic_store_explicit(&s->seq, seq + 2, memory_order_release);
+}
+
+/* Count one message for name; only the owning I/O thread writes s */
+void sketch_add(struct sketch *s, const char *name, unsigned int now_ticks) {
+    uint64_t h = sketch_hash(name);
+    unsigned int period = now_ticks / (SKETCH_SLOT_MS / WHEEL_TICK_MS);
+    unsigned int est = UINT_MAX;
+    struct sketch_slot *slot = &s->slots[period % SKETCH_SLOTS];
+
+    if (atomic_load_explicit(&slot->period, memory_order_relaxed) != period + 1) {
+        /* The slot's period is over: start counting the current one in it */
+        atomic_store_explicit(&slot->period, 0, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        for (int i = 0; i < SKETCH_DEPTH; i++) {
+            for (int k = 0; k < SKETCH_RATE_WIDTH; k++)
+                atomic_store_explicit(&slot->count[i][k], 0, memory_order_relaxed);
+        }
+        atomic_store_explicit(&slot->period, period + 1, memory_order_release);
+    }
+    for (int i = 0; i < SKETCH_DEPTH; i++) {
+        _Atomic unsigned int *c = &s->total[i][sketch_col(h, i, SKETCH_WIDTH)];
+        _Atomic unsigned int *r = &slot->count[i][sketch_col(h, i, SKETCH_RATE_WIDTH)];
+        unsigned int v = atomic_load_explicit(c, memory_order_relaxed) + 1;
+
+        atomic_store_explicit(c, v, memory_order_relaxed);
+        atomic_store_explicit(r, atomic_load_explicit(r, memory_order_relaxed) + 1, memory_order_relaxed);
+        if (v < est)
+            est = v;
+    }
+    sketch_track(s, h, name, est);
+}
+
+enum { SKETCH_SENDERS, SKETCH_ROOMS };
+
+static unsigned int sketch_since = 0;  /* ticks when counting started */
+
+/* A room message (room set) or DM from c, on c's I/O thread */
+void sketch_count(client_t *c, const char *room) {
+    io_thread_t *io = c->io;
+
+    if (io == NULL || io->sketches[SKETCH_SENDERS] == NULL)
+        return;
+    sketch_add(io->sketches[SKETCH_SENDERS], c->username, io->wheel.now);
+    if (room)
+        sketch_add(io->sketches[SKETCH_ROOMS], room, io->wheel.now);
+}
+
+/* Merged estimates of one key over all I/O threads: messages since start, and
+   messages in the last *window_ms */
+void sketch_estimate(int which, uint64_t h, unsigned int now_ticks, unsigned long *total, unsigned long *recent,
+                     long long *window_ms) {
+    unsigned long rows[SKETCH_DEPTH] = { 0 }, rate_rows[SKETCH_DEPTH] = { 0 };
+    unsigned int period = now_ticks / (SKETCH_SLOT_MS / WHEEL_TICK_MS);
+
+    for (int t = 0; t < conf.io_threads; t++) {
+        struct sketch *s = io_threads[t].sketches[which];
+
+        if (s == NULL)
+            continue;
+        for (int i = 0; i < SKETCH_DEPTH; i++)
+            rows[i] += atomic_load_explicit(&s->total[i][sketch_col(h, i, SKETCH_WIDTH)], memory_order_relaxed);
+        for (int k = 0; k < SKETCH_SLOTS; k++) {
+            unsigned int p = atomic_load_explicit(&s->slots[k].period, memory_order_acquire);
+            unsigned long counts[SKETCH_DEPTH];
+
+            /* Periods still in the window; skip a slot being cleared meanwhile */
+            if (p == 0 || period + 1 - p >= SKETCH_SLOTS)
+                continue;
+            for (int i = 0; i < SKETCH_DEPTH; i++)
+                counts[i] = atomic_load_explicit(&s->slots[k].count[i][sketch_col(h, i, SKETCH_RATE_WIDTH)],
+                    memory_order_relaxed);
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&s->slots[k].period, memory_order_relaxed) != p)
+                continue;
+            for (int i = 0; i < SKETCH_DEPTH; i++)
+                rate_rows[i] += counts[i];
+        }
+    }
+    *total = *recent = ULONG_MAX;
+    for (int i = 0; i < SKETCH_DEPTH; i++) {
+        if (rows[i] < *total)
+            *total = rows[i];
+        if (rate_rows[i] < *recent)
+            *recent = rate_rows[i];
+    }
+    *window_ms = (SKETCH_SLOTS - 1) * (long long)SKETCH_SLOT_MS + now_ticks % (SKETCH_SLOT_MS / WHEEL_TICK_MS) * WHEEL_TICK_MS;
+    /* Not a full window since the start */
+    if (*window_ms > (long long)(now_ticks - sketch_since) * WHEEL_TICK_MS)
+        *window_ms = (long long)(now_ticks - sketch_since) * WHEEL_TICK_MS;
+    if (*window_ms < 1000)
+        *window_ms = 1000;
+}
+
+struct sketch_row {
+    char name[32];
+    uint64_t hash;
+    unsigned long total, recent;
+};
+
+int sketch_row_cmp(const void *a, const void *b) {
+    const struct sketch_row *x = a, *y = b;
+
+    if (x->total != y->total)
+        return x->total < y->total ? 1 : -1;
+    return strcmp(x->name, y->name);
+}
+
+/* Admin "top": the sketch_top heaviest senders and rooms with their recent rates */
+void sketch_print_top(FILE *out) {
+    static const char *label[] = { "sender", "room" };
+    unsigned int now = now_ms() / WHEEL_TICK_MS;
+
+    for (int which = SKETCH_SENDERS; which <= SKETCH_ROOMS; which++) {
+        struct sketch_row *rows = calloc(conf.io_threads * SKETCH_TRACK, sizeof(struct sketch_row));
+        unsigned int n = 0;
+        long long window_ms = 1;
+
+        if (rows == NULL)
+            return;
+        for (int t = 0; t < conf.io_threads; t++) {
+            struct sketch *s = io_threads[t].sketches[which];
+            struct sketch_key top[SKETCH_TRACK];
+            unsigned int seq, ntop;
+
+            if (s == NULL)
+                continue;
+            /* Copy the heap while its owner is not changing it */
+            do {
+                while ((seq = atomic_load_explicit(&s->seq, memory_order_acquire)) & 1)
+                    sched_yield();
+                ntop = s->ntop;
+                memcpy(top, s->top, sizeof(top));
+                atomic_thread_fence(memory_order_acquire);
+            } while (atomic_load_explicit(&s->seq, memory_order_relaxed) != seq);
+            for (unsigned int i = 0; i < ntop && i < SKETCH_TRACK; i++) {
+                unsigned int k;
+                top[i].name[sizeof(top[i].name) - 1] = '\0';
+                for (k = 0; k < n; k++) {
+                    if (rows[k].hash == top[i].hash && strcmp(rows[k].name, top[i].name) == 0)
+                        break;
+                }
+                if (k == n) {
+                    snprintf(rows[n].name, sizeof(rows[n].name), "%s", top[i].name);
+                    rows[n++].hash = top[i].hash;
+                }
+            }
+        }
+        for (unsigned int k = 0; k < n; k++)
+            sketch_estimate(which, rows[k].hash, now, &rows[k].total, &rows[k].recent, &window_ms);
+        qsort(rows, n, sizeof(struct sketch_row), sketch_row_cmp);
+        for (unsigned int k = 0; k < n && k < (unsigned int)conf.sketch_top; k++)
+            fprintf(out, "%s %s %lu %.2f/s\n", label[which], rows[k].name, rows[k].total,
+                rows[k].recent * 1000.0 / window_ms);
+        free(rows);
+    }
+}
+
+/* Admin "rate <user>" / "rate #<room>" */
+void sketch_print_rate(FILE *out, const char *name) {
+    int which = name[0] == '#' ? SKETCH_ROOMS : SKETCH_SENDERS;
+    unsigned long total, recent;
+    long long window_ms;
+
+    if (which == SKETCH_ROOMS)
+        name++;
+    sketch_estimate(which, sketch_hash(name), now_ms() / WHEEL_TICK_MS, &total, &recent, &window_ms);
+    fprintf(out, "%s %s %lu %.2f/s (%lu in the last %lld s)\n", which == SKETCH_ROOMS ? "room" : "sender",
+        name, total, recent * 1000.0 / window_ms, recent, window_ms / 1000);
+}
+
+/* Sent chunks not acked yet: last seq and time of the first record, oldest first */
+#define REPL_INFLIGHT 256
+static struct {
+    unsigned long long last_seq;
+    long long first_when;
+} repl_inflight[REPL_INFLIGHT];
+static unsigned int repl_inflight_head = 0, repl_inflight_count = 0;
+static unsigned long long repl_cursor_seq = 0;  /* next frame to send, under repl_lock */
+static size_t repl_cursor_off = 0;
+static _Atomic unsigned long repl_lost = 0;     /* dropped from the ring before they were sent */
+
+bool send_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool recv_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* An ack from the standby; repl_lock held */
+void repl_acked(unsigned long long seq) {
+    if (seq <= repl_acked_seq)
+        return;
+    repl_acked_seq = seq;
+    while (repl_inflight_count > 0 && repl_inflight[repl_inflight_head].last_seq <= seq) {
+        repl_inflight_head = (repl_inflight_head + 1) % REPL_INFLIGHT;
+        repl_inflight_count--;
+    }
+}
+
+/* Stream the ring to one standby until it goes away */
+void repl_serve(int fd) {
+    unsigned char hello[16], ack[16], *buf = malloc(REPL_SEND_CHUNK);
+    unsigned long long want;
+    unsigned int ack_have = 0;
+    struct timeval tv = { 5, 0 };
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (buf == NULL || !recv_all(fd, hello, sizeof(hello))) {
+        free(buf);
+        return;
+    }
+    want = chat_log_get64(hello + 8);
+    pthread_mutex_lock(&repl_lock);
+    repl_cursor_seq = repl_head_seq;
+    repl_cursor_off = repl_head_off;
+    /* Resume where this standby left off if that is still in the ring */
+    if ((long long)chat_log_get64(hello) == repl_epoch && want > repl_head_seq && want <= repl_next_seq) {
+        while (repl_cursor_seq < want) {
+            repl_cursor_off = (repl_cursor_off + repl_frame_len(repl_cursor_off)) % repl_cap;
+            repl_cursor_seq++;
+        }
+    }
+    repl_acked_seq = repl_cursor_seq - 1;
+    repl_inflight_count = 0;
+    chat_log_put64(hello, repl_epoch);
+    chat_log_put64(hello + 8, repl_cursor_seq);
+    pthread_mutex_unlock(&repl_lock);
+    tv.tv_sec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (!send_all(fd, hello, sizeof(hello))) {
+        free(buf);
+        return;
+    }
+    printf("Standby connected, sending from record %llu\n", (unsigned long long)chat_log_get64(hello + 8));
+    repl_standbys++;
+
+    while (1) {
+        struct pollfd pfd[2] = { { fd, POLLIN, 0 }, { repl_wakefd, POLLIN, 0 } };
+        size_t len = 0;
+        unsigned long long first = 0;
+        long long first_when = 0;
+        uint64_t v;
+
+        /* Say we are waiting before looking, so a commit in between wakes us */
+        repl_waiting = 1;
+        pthread_mutex_lock(&repl_lock);
+        if (repl_cursor_seq < repl_head_seq) {
+            /* Overwritten before it went out */
+            repl_lost += repl_head_seq - repl_cursor_seq;
+            repl_cursor_seq = repl_head_seq;
+            repl_cursor_off = repl_head_off;
+        }
+        first = repl_cursor_seq;
+        while (repl_cursor_seq < repl_next_seq) {
+            size_t n = repl_frame_len(repl_cursor_off);
+            if (len + n > REPL_SEND_CHUNK && len > 0)
+                break;
+            if (n > REPL_SEND_CHUNK)
+                n = REPL_SEND_CHUNK;        /* cannot happen: frames hold one log line */
+            repl_ring_get(repl_cursor_off, buf + len, n);
+            if (len == 0)
+                first_when = chat_log_get64(buf + 12);
+            len += n;
+            repl_cursor_off = (repl_cursor_off + n) % repl_cap;
+            repl_cursor_seq++;
+        }
+        if (len > 0) {
+            if (repl_inflight_count == REPL_INFLIGHT) {
+                /* Full: fold into the newest entry, the oldest time stays right */
+                repl_inflight[(repl_inflight_head + repl_inflight_count - 1) % REPL_INFLIGHT].last_seq =
+                    repl_cursor_seq - 1;
+            }
+            else {
+                unsigned int k = (repl_inflight_head + repl_inflight_count++) % REPL_INFLIGHT;
+                repl_inflight[k].last_seq = repl_cursor_seq - 1;
+                repl_inflight[k].first_when = first_when;
+            }
+        }
+        pthread_mutex_unlock(&repl_lock);
+
+        if (len > 0) {
+            repl_waiting = 0;
+            if (!send_all(fd, buf, len))
+                break;
+            repl_shipped += repl_cursor_seq - first;
+        }
+        if (poll(pfd, 2, len > 0 ? 0 : 1000) < 0 && errno != EINTR)
+            break;
+        if (pfd[1].revents & POLLIN)
+            read(repl_wakefd, &v, sizeof(v));
+        if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n;
+            while ((n = recv(fd, ack + ack_have, sizeof(ack) - ack_have, MSG_DONTWAIT)) > 0) {
+                if ((ack_have += n) == sizeof(ack)) {
+                    pthread_mutex_lock(&repl_lock);
+                    repl_acked(chat_log_get64(ack));
+                    pthread_mutex_unlock(&repl_lock);
+                    ack_have = 0;
+                }
+            }
+            if (n == 0 || (errno != EAGAIN && errno != EINTR))
+                break;
+        }
+    }
+    repl_standbys--;
+    printf("Standby disconnected\n");
+    free(buf);
+}
+
+void *repl_serve_main(void *arg) {
+    int fd = (int)(intptr_t)arg;
+
+    thread_register(ROLE_REPL);
+    repl_serve(fd);
+    close(fd);
+    thread_unregister();
+    repl_serving = 0;
+    return NULL;
+}
+
+/* Accepts standbys; one is served at a time, the others are told so */
+void *repl_primary_main(void *arg) {
+    int sock = *(int *)arg;
+
+    thread_register(ROLE_REPL);
+    while (1) {
+        int fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC), one = 1;
+        pthread_t tid;
+
+        if (fd < 0)
+            continue;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (atomic_exchange(&repl_serving, 1)) {
+            unsigned char refuse[16] = { 0 };
+            struct timeval tv = { 1, 0 };
+
+            /* Epoch 0: no primary ever has it */
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            send_all(fd, refuse, sizeof(refuse));
+            close(fd);
+            repl_refused++;
+            continue;
+        }
+        if (pthread_create(&tid, NULL, repl_serve_main, (void *)(intptr_t)fd) != 0) {
+            close(fd);
+            repl_serving = 0;
+            continue;
+        }
+        pthread_detach(tid);
+    }
+    return NULL;
+}
+
+/* Standby side */
+static _Atomic unsigned long repl_applied = 0;
+static _Atomic unsigned long long repl_applied_seq = 0;
+static _Atomic long long repl_apply_lag_ms = 0;
+static _Atomic unsigned long repl_gaps = 0;     /* records the primary no longer had */
+static _Atomic int repl_connected = 0;
+
+/* A replicated room message: into the room's history (and to anyone in it
+   here). A replica room is never freed, so once it is marked the post can
+   go ahead without rooms_lock. */
+void repl_room_post(const char *name, msg_t *m) {
+    room_t *r;
+
+    if (!room_name_valid(name))
+        return;
+    pthread_rwlock_rdlock(&rooms_lock);
+    if ((r = room_find(name)) == NULL) {
+        pthread_rwlock_unlock(&rooms_lock);
+        pthread_rwlock_wrlock(&rooms_lock);
+        if ((r = room_find(name)) == NULL && (r = room_create(name)) == NULL) {
+            pthread_rwlock_unlock(&rooms_lock);
+            return;
+        }
+    }
+    r->replica = true;
+    pthread_rwlock_unlock(&rooms_lock);
+    room_post(r, m, 0, NULL);
+}
+
+/* repl_apply results */
+enum {
+    REPL_BAD,       /* malformed frame */
+    REPL_APPLIED,
+    REPL_BUSY       /* out of log ring slots or memory: try the frame again later */
+};
+
+/* Apply one frame. Nothing of a busy frame has been applied yet. */
+int repl_apply(const unsigned char *f, size_t len) {
+    static const char *files[] = { "login.log", "filter.log", NULL };
+    const char *file = NULL;
+    char sender[32], room[32], *text;
+    msg_t *m = NULL;
+    size_t flen = f[21], slen = f[22], rlen = f[23], tlen;
+    long long when = chat_log_get64(f + 12);
+    int type = f[20];
+
+    if (len < REPL_FRAME_HEAD + flen + slen + rlen || slen >= sizeof(sender) || rlen >= sizeof(room))
+        return REPL_BAD;
+    tlen = len - REPL_FRAME_HEAD - flen - slen - rlen;
+    f += REPL_FRAME_HEAD;
+    for (int i = 0; type == 0 && files[i]; i++) {
+        if (strlen(files[i]) == flen && memcmp(files[i], f, flen) == 0)
+            file = files[i];
+    }
+    memcpy(sender, f + flen, slen);
+    sender[slen] = '\0';
+    memcpy(room, f + flen + slen, rlen);
+    room[rlen] = '\0';
+    if ((text = malloc(tlen + 1)) == NULL)
+        return REPL_BUSY;
+    memcpy(text, f + flen + slen + rlen, tlen);
+    text[tlen] = '\0';
+    if ((type == CHAT_LOG_MSG || type == CHAT_LOG_NOTICE) && room[0]
+        && (m = msg_new(text, tlen)) == NULL) {
+        free(text);
+        return REPL_BUSY;
+    }
+    if ((type != 0 || file != NULL) && !log_enqueue(file, type, sender, room, text, 0, when)) {
+        if (m)
+            msg_release(m);
+        free(text);
+        return REPL_BUSY;
+    }
+    free(text);
+    if (m) {
+        repl_room_post(room, m);
+        msg_release(m);
+    }
+    repl_apply_lag_ms = wall_ms() - when;
+    return REPL_APPLIED;
+}
+
+/* Follow the primary, reconnecting every second while it is away. Where it
+   got to (u64 epoch, u64 seq) is kept in REPL_POSITION, so a restarted
+   standby does not apply records twice. */
+#define REPL_POSITION LOG_DIR "/repl.pos"
+
+void *repl_standby_main(void *arg) {
+    struct sockaddr_in addr;
+    size_t cap = 256 * 1024;
+    unsigned char *buf = malloc(cap), pos[16];
+    long long epoch = 0;
+    bool busy, refused = false;
+    int posfd = open(REPL_POSITION, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    thread_register(ROLE_REPL);
+    if (posfd >= 0 && pread(posfd, pos, sizeof(pos), 0) == sizeof(pos)) {
+        epoch = chat_log_get64(pos);
+        repl_applied_seq = chat_log_get64(pos + 8);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(conf.repl_primary);
+    while (buf) {
+        unsigned char hello[16];
+        unsigned long long first;
+        size_t have = 0;
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0), one = 1;
+
+        if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            if (fd >= 0)
+                close(fd);
+            sleep(1);
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        chat_log_put64(hello, epoch);
+        chat_log_put64(hello + 8, epoch ? repl_applied_seq + 1 : 0);
+        if (!send_all(fd, hello, sizeof(hello)) || !recv_all(fd, hello, sizeof(hello))) {
+            close(fd);
+            sleep(1);
+            continue;
+        }
+        first = chat_log_get64(hello + 8);
+        if (chat_log_get64(hello) == 0) {
+            if (!refused)
+                printf("Primary 127.0.0.1:%d already has a standby; retrying\n", conf.repl_primary);
+            refused = true;
+            close(fd);
+            sleep(1);
+            continue;
+        }
+        refused = false;
+        if ((long long)chat_log_get64(hello) != epoch) {
+            /* A new primary (or our first): its numbering starts over */
+            epoch = chat_log_get64(hello);
+            repl_applied_seq = first - 1;
+        }
+        else if (first > repl_applied_seq + 1) {
+            repl_gaps += first - repl_applied_seq - 1;
+            repl_applied_seq = first - 1;
+        }
+        printf("Replicating from primary 127.0.0.1:%d\n", conf.repl_primary);
+        repl_connected = 1;
+
+        busy = false;
+        while (1) {
+            size_t used = 0;
+            long long last_when = 0;
+            unsigned int applied = 0;
+
+            if (busy) {
+                /* Let the logger drain before retrying the held frame */
+                usleep(1000);
+                busy = false;
+            }
+            else {
+                ssize_t n = recv(fd, buf + have, cap - have, 0);
+
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    break;
+                have += n;
+            }
+            while (have - used >= 4) {
+                size_t flen = 4 + chat_log_get32(buf + used);
+                int rc;
+
+                if (flen < REPL_FRAME_HEAD || flen > cap)
+                    break;
+                if (have - used < flen)
+                    break;
+                if ((rc = repl_apply(buf + used, flen)) != REPL_APPLIED) {
+                    busy = rc == REPL_BUSY;
+                    break;
+                }
+                repl_applied_seq = chat_log_get64(buf + used + 4);
+                last_when = chat_log_get64(buf + used + 12);
+                used += flen;
+                applied++;
+            }
+            memmove(buf, buf + used, have - used);
+            have -= used;
+            if (applied > 0) {
+                unsigned char ack[16];
+                repl_applied += applied;
+                chat_log_put64(pos, epoch);
+                chat_log_put64(pos + 8, repl_applied_seq);
+                if (posfd >= 0)
+                    pwrite(posfd, pos, sizeof(pos), 0);
+                chat_log_put64(ack, repl_applied_seq);
+                chat_log_put64(ack + 8, last_when);
+                if (!send_all(fd, ack, sizeof(ack)))
+                    break;
+            }
+            else if (have == cap && !busy) {
+                break;  /* a frame larger than the buffer: not from us */
+            }
+        }
+        repl_connected = 0;
+        close(fd);
+        printf("Lost the primary; retrying\n");
+        sleep(1);
+    }
+    return NULL;
+}
+
+void start_replication() {
+    pthread_t tid;
+
+    if (conf.repl_listen > 0 && repl_ring) {
+        static int sock;
+        struct sockaddr_in addr;
+        int option = 1;
+
+        sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(conf.repl_listen);
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char*)&option, sizeof(option));
+        if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sock, 4) < 0) {
+            perror("ERROR: replication socket");
+            exit(1);
+        }
+        pthread_create(&tid, NULL, repl_primary_main, &sock);
+        pthread_detach(tid);
+    }
+    if (conf.repl_primary > 0) {
+        pthread_create(&tid, NULL, repl_standby_main, NULL);
+        pthread_detach(tid);
+    }
+}
+
+/* Replication lines of "stats" */
+void repl_print_stats(FILE *out) {
+    if (conf.repl_listen > 0) {
+        unsigned long long last, acked;
+        long long lag_ms = 0;
+
+        pthread_mutex_lock(&repl_lock);
+        last = repl_next_seq - 1;
+        acked = repl_acked_seq;
+        if (acked < last) {
+            /* Age of the oldest record the standby has not acked */
+            if (repl_inflight_count > 0)
+                lag_ms = wall_ms() - repl_inflight[repl_inflight_head].first_when;
+            else if (repl_used > 0) {
+                /* Nothing in flight: the oldest is the next to send */
+                unsigned char head[REPL_FRAME_HEAD];
+                repl_ring_get(repl_cursor_seq >= repl_head_seq ? repl_cursor_off : repl_head_off, head, sizeof(head));
+                lag_ms = wall_ms() - (long long)chat_log_get64(head + 12);
+            }
+        }
+        pthread_mutex_unlock(&repl_lock);
+        fprintf(out, "repl_standbys %d\n", (int)repl_standbys);
+        fprintf(out, "repl_refused %lu\n", repl_refused);
+        fprintf(out, "repl_records %llu\n", last);
+        fprintf(out, "repl_shipped %lu\n", repl_shipped);
+        fprintf(out, "repl_acked %llu\n", acked);
+        fprintf(out, "repl_lag_records %llu\n", last - acked);
+        fprintf(out, "repl_lag_ms %lld\n", lag_ms);
+        fprintf(out, "repl_overwritten %lu\n", repl_overwritten);
+        fprintf(out, "repl_lost %lu\n", repl_lost);
+    }
+    if (conf.repl_primary > 0) {
+        fprintf(out, "repl_connected %d\n", (int)repl_connected);
+        fprintf(out, "repl_applied %lu\n", repl_applied);
+        fprintf(out, "repl_applied_seq %llu\n", (unsigned long long)repl_applied_seq);
+        fprintf(out, "repl_apply_lag_ms %lld\n", (long long)repl_apply_lag_ms);
+        fprintf(out, "repl_gaps %lu\n", repl_gaps);
+    }
+}
+
+/* Online sessions of one username */
+typedef struct user_entry {
+    char name[32];
+    struct user_entry *next;
+    client_t **sessions;
+    unsigned int nsessions;
+    unsigned int cap;
+} user_entry_t;
+
+/* Username -> sessions index, kept up to date at login and logout */
+static user_entry_t *user_table[USER_BUCKETS];
+static pthread_rwlock_t users_lock = PTHREAD_RWLOCK_INITIALIZER;
+static _Atomic long online_users = 0;
+
+user_entry_t *user_find(const char *name) {
+    user_entry_t *u = user_table[hash((unsigned char *)name) % USER_BUCKETS];
+
+    while (u && strcmp(u->name, name) != 0)
+        u = u->next;
+    return u;
+}
+
+/*
+ * Trie of online usernames for @mention scanning: nodes live in one array,
+ * linked first-child/next-sibling, and are recycled through a free list.
+ * Changed at login/logout under users_lock (write); mentions_scan reads it
+ * without a lock. The array is published through an atomic pointer and a
+ * node is linked in only once it is filled; a replaced array or unlinked
+ * nodes are reused only after every scan that might see them has ended.
+ */
+typedef struct {
+    _Atomic unsigned int child;
+    _Atomic unsigned int sibling;
+    unsigned char label;
+    _Atomic unsigned char terminal;
+} trie_node_t;
+
+static trie_node_t *_Atomic trie_nodes = NULL;   /* node 0 is the root */
+static unsigned int trie_len = 0, trie_cap = 0, trie_free = 0;
+/* Scans in progress, counted in the slot of the phase they started in */
+static _Atomic unsigned int trie_phase = 0;
+static _Atomic unsigned long trie_readers[2];
+
+unsigned int trie_read_begin(void) {
+    unsigned int idx = trie_phase & 1;
+
+    trie_readers[idx]++;
+    return idx;
+}
+
+void trie_read_end(unsigned int idx) {
+    trie_readers[idx]--;
+}
+
+/* Wait out every scan that started before the last change (users_lock held) */
+void trie_synchronize(void) {
+    for (int i = 0; i < 2; i++) {
+        unsigned int idx = atomic_fetch_add(&trie_phase, 1) & 1;
+        while (trie_readers[idx] != 0)
+            sched_yield();
+    }
+}
+
+unsigned int trie_node_new(unsigned char label) {
+    trie_node_t *t;
+    unsigned int i;
+
+    if (trie_free) {
+        i = trie_free;
+        trie_free = trie_nodes[i].sibling;
+    }
+    else {
+        if (trie_len == trie_cap) {
+            /* Grow into a new array; scans still on the old one finish first */
+            unsigned int ncap = trie_cap ? trie_cap * 2 : 256;
+            trie_node_t *old = trie_nodes, *n = malloc(ncap * sizeof(trie_node_t));
+            if (n == NULL)
+                return 0;
+            memcpy(n, old, trie_len * sizeof(trie_node_t));
+            trie_nodes = n;
+            trie_cap = ncap;
+            trie_synchronize();
+            free(old);
+        }
+        i = trie_len++;
+    }
+    t = trie_nodes;
+    t[i].child = 0;
+    t[i].sibling = 0;
+    t[i].label = label;
+    t[i].terminal = 0;
+    return i;
+}
+
+unsigned int trie_child(const trie_node_t *t, unsigned int node, unsigned char label) {
+    unsigned int i = t[node].child;
+
+    while (i && t[i].label != label)
+        i = t[i].sibling;
+    return i;
+}
+
+void trie_insert(const char *name) {
+    unsigned int node = 0, next;
+
+    if (trie_len == 0) {
+        trie_node_t *t = calloc(256, sizeof(trie_node_t));
+        if (t == NULL)
+            return;
+        trie_cap = 256;
+        trie_len = 1;
+        trie_nodes = t;
+    }
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++, node = next) {
+        if ((next = trie_child(trie_nodes, node, *p)) == 0) {
+            if ((next = trie_node_new(*p)) == 0)
+                return;
+            trie_nodes[next].sibling = trie_nodes[node].child;
+            trie_nodes[node].child = next;
+        }
+    }
+    trie_nodes[node].terminal = 1;
+}
+
+/* Unmark a name and give back the nodes only it was using */
+void trie_remove(const char *name) {
+    unsigned int path[32], gone[32], depth = 0, ngone = 0, node = 0;
+    trie_node_t *t = trie_nodes;
+
+    if (trie_len == 0)
+        return;
+    for (const unsigned char *p = (const unsigned char *)name; *p && depth < 31; p++) {
+        path[depth++] = node;
+        if ((node = trie_child(t, node, *p)) == 0)
+            return;
+    }
+    t[node].terminal = 0;
+    while (depth > 0 && !t[node].terminal && t[node].child == 0) {
+        unsigned int parent = path[--depth];
+        _Atomic unsigned int *pp = &t[parent].child;
+        while (*pp != node)
+            pp = &t[*pp].sibling;
+        *pp = t[node].sibling;
+        gone[ngone++] = node;
+        node = parent;
+    }
+    /* A scan may still be standing on an unlinked node */
+    if (ngone > 0)
+        trie_synchronize();
+    for (unsigned int i = 0; i < ngone; i++) {
+        t[gone[i]].sibling = trie_free;
+        trie_free = gone[i];
+    }
+}
+
+bool mention_char(unsigned char ch) {
+    return isalnum(ch) || ch == '_' || ch == '-' || ch >= 0x80;
+}
+
+/* Find @name tokens naming online users in one pass over the text */
+void mentions_scan(const char *text, mentions_t *mn) {
+    const unsigned char *p = (const unsigned char *)text;
+    unsigned int phase = trie_read_begin();
+    const trie_node_t *t = trie_nodes;
+
+    mn->n = 0;
+    for (; *p && mn->n < MENTION_MAX && t != NULL; p++) {
+        unsigned int node = 0, match = 0;
+        const unsigned char *q;
+
+        if (*p != '@' || (p != (const unsigned char *)text && mention_char(p[-1])))
+            continue;
+        /* Longest online name that ends on a token boundary */
+        for (q = p + 1; *q && q - p <= 31 && (node = trie_child(t, node, *q)) != 0; q++) {
+            if (t[node].terminal && !mention_char(q[1]))
+                match = q - p;
+        }
+        if (match > 0) {
+            bool dup = false;
+            snprintf(mn->names[mn->n], sizeof(mn->names[0]), "%.*s", (int)match, (const char *)p + 1);
+            for (int i = 0; i < mn->n; i++)
+                dup |= strcmp(mn->names[i], mn->names[mn->n]) == 0;
+            if (!dup)
+                mn->n++;
+            p += match;
+        }
+    }
+    trie_read_end(phase);
+    mentions_found += mn->n;
+}
+
+void user_index_add(client_t *c) {
+    user_entry_t *u;
+
+    pthread_rwlock_wrlock(&users_lock);
+    if ((u = user_find(c->username)) == NULL && (u = calloc(1, sizeof(user_entry_t))) != NULL) {
+        unsigned long b = hash((unsigned char *)c->username) % USER_BUCKETS;
+        snprintf(u->name, sizeof(u->name), "%s", c->username);
+        u->next = user_table[b];
+        user_table[b] = u;
+        online_users++;
+        trie_insert(u->name);
+    }
+    if (u && u->nsessions == u->cap) {
+        unsigned int ncap = u->cap ? u->cap * 2 : 2;
+        client_t **s = realloc(u->sessions, ncap * sizeof(client_t *));
+        if (s) {
+            u->sessions = s;
+            u->cap = ncap;
+        }
+    }
+    if (u && u->nsessions < u->cap)
+        u->sessions[u->nsessions++] = c;
+    pthread_rwlock_unlock(&users_lock);
+}
+
+void user_index_remove(client_t *c) {
+    user_entry_t **pp, *u;
+
+    pthread_rwlock_wrlock(&users_lock);
+    pp = &user_table[hash((unsigned char *)c->username) % USER_BUCKETS];
+    while ((u = *pp) != NULL && strcmp(u->name, c->username) != 0)
+        pp = &u->next;
+    if (u) {
+        for (unsigned int i = 0; i < u->nsessions; i++) {
+            if (u->sessions[i] == c) {
+                u->sessions[i] = u->sessions[--u->nsessions];
+                break;
+            }
+        }
+        if (u->nsessions == 0) {
+            *pp = u->next;
+            online_users--;
+            trie_remove(u->name);
+            free(u->sessions);
+            free(u);
+        }
+    }
+    pthread_rwlock_unlock(&users_lock);
+}
+
+/* Send to every session of a user (users_lock held); returns how many sessions got it */
+int user_deliver(const char *name, char *s) {
+    user_entry_t *u = user_find(name);
+    msg_t *m;
+
+    if (u == NULL || (m = msg_new(s, strlen(s))) == NULL)
+        return 0;
+    for (unsigned int i = 0; i < u->nsessions; i++)
+        conn_send(u->sessions[i], m);
+    msg_release(m);
+    return u->nsessions;
+}
+
+/*
+ * History queries: HISTORY <from> <to> [#room] [@user] [page] over the room
+ * log segments. For each segment overlapping the range, the sparse index
+ * gives the last restart block at or before <from>; decoding starts there
+ * (through mmap, or gzseek for compressed segments) and stops at the first
+ * block past <to>. A room's stream stops once it has yielded enough
+ * matches to fill the pages up to the one asked for; the rooms' matches
+ * are then sorted by time. Runs as a background job; DMs are never searched.
+ */
+#define HISTORY_MAX_RESULTS 10000   /* deepest match a page can reach */
+
+typedef struct {
+    char name[32];          /* requester */
+    int uid;
+    long long from, to;
+    char room[32];
+    char sender[32];
+    int page;
+} history_query_t;
+
+struct history_hit {
+    long long when;
+    unsigned int seq;       /* keeps log order for equal times */
+    char *line;
+};
+
+typedef struct {
+    struct history_hit *hits;
+    unsigned int count, cap;
+    unsigned int want;          /* matches per room that can reach the page, plus one */
+    unsigned int stream_hits;   /* matches of the room being scanned */
+    bool truncated;             /* a room had more than want */
+    unsigned long blocks;
+} history_scan_t;
+
+/* Reads the verified blocks of one binary segment from an offset, through
+   mmap or, once compressed, through zlib; keeps the name dictionary */
+typedef struct {
+    unsigned char *map;
+    size_t size;
+    gzFile gz;
+    unsigned char head[CHAT_LOG_HEADER];
+    unsigned char *payload;
+    size_t cap;
+    unsigned long offset;           /* of the next block */
+    unsigned long block_offset;     /* of the block last returned */
+    char (*users)[32];
+    char (*rooms)[32];
+    unsigned int users_cap, rooms_cap;
+} segment_reader_t;
+
+static _Atomic unsigned long history_queries = 0;
+static _Atomic unsigned long history_segments = 0;
+static _Atomic unsigned long history_blocks = 0;
+static _Atomic unsigned long history_query_us = 0;
+
+/* Send to one session of a user, if it is still logged in */
+void session_send(const char *name, int uid, char *s) {
+    user_entry_t *u;
+
+    pthread_rwlock_rdlock(&users_lock);
+    if ((u = user_find(name)) != NULL) {
+        for (unsigned int i = 0; i < u->nsessions; i++) {
+            if (u->sessions[i]->uid == uid)
+                send_reply(u->sessions[i], s);
+        }
+    }
+    pthread_rwlock_unlock(&users_lock);
+}
+
+/* Last index entry of LOG_DIR/file whose field (0: time, 8: offset) is at
+   most key; 0 (the start) without an index */
+unsigned long segment_seek(const char *file, int field, long long key) {
+    char idx[140];
+    unsigned char *map;
+    unsigned long offset = 0;
+    struct stat st;
+    size_t lo = 0, hi, n, len = strlen(file);
+    int fd;
+
+    /* A compressed segment keeps the index of its plain name */
+    if (len > 3 && strcmp(file + len - 3, ".gz") == 0)
+        len -= 3;
+    snprintf(idx, sizeof(idx), LOG_DIR "/%.*s.idx", (int)len, file);
+    if ((fd = open(idx, O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;
+    if (fstat(fd, &st) < 0 || (n = st.st_size / CHAT_LOG_INDEX_ENTRY) == 0 ||
+        (map = mmap(NULL, n * CHAT_LOG_INDEX_ENTRY, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+    close(fd);
+    hi = n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if ((long long)chat_log_get64(map + mid * CHAT_LOG_INDEX_ENTRY + field) <= key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo > 0)
+        offset = chat_log_get64(map + (lo - 1) * CHAT_LOG_INDEX_ENTRY + 8);
+    munmap(map, n * CHAT_LOG_INDEX_ENTRY);
+    return offset;
+}
+
+bool segment_open(segment_reader_t *r, const char *file, unsigned long offset) {
+    char path[140];
+    struct stat sb;
+    int fd;
+
+    memset(r, 0, sizeof(*r));
+    r->offset = offset;
+    snprintf(path, sizeof(path), LOG_DIR "/%s", file);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+        if (fstat(fd, &sb) < 0 || (size_t)sb.st_size <= offset ||
+            (r->map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+            r->map = NULL;
+            close(fd);
+            return false;
+        }
+        close(fd);
+        r->size = sb.st_size;
+        madvise(r->map + (offset & ~4095UL), r->size - (offset & ~4095UL), MADV_SEQUENTIAL);
+        return true;
+    }
+    /* Compressed since the manifest was read */
+    snprintf(path, sizeof(path), LOG_DIR "/%s.gz", file);
+    if ((r->gz = gzopen(path, "rb")) == NULL)
+        return false;
+    gzbuffer(r->gz, 65536);
+    if (gzseek(r->gz, offset, SEEK_SET) != (z_off_t)offset) {
+        gzclose(r->gz);
+        r->gz = NULL;
+        return false;
+    }
+    return true;
+}
+
+/* Payload of the next block (*head set to its header); NULL at the end or at a damaged block */
+const unsigned char *segment_next(segment_reader_t *r, const unsigned char **head) {
+    uint32_t len;
+
+    r->block_offset = r->offset;
+    if (r->map) {
+        const unsigned char *h = r->map + r->offset;
+
+        if (r->offset + CHAT_LOG_HEADER > r->size)
+            return NULL;
+        len = chat_log_get32(h + 4);
+        if (chat_log_get32(h) != CHAT_LOG_MAGIC || len > r->size - r->offset - CHAT_LOG_HEADER ||
+            chat_log_crc32(h + CHAT_LOG_HEADER, len) != chat_log_get32(h + 12))
+            return NULL;
+        r->offset += CHAT_LOG_HEADER + len;
+        *head = h;
+        return h + CHAT_LOG_HEADER;
+    }
+    if (r->gz == NULL || gzread(r->gz, r->head, CHAT_LOG_HEADER) != CHAT_LOG_HEADER)
+        return NULL;
+    len = chat_log_get32(r->head + 4);
+    if (chat_log_get32(r->head) != CHAT_LOG_MAGIC || len > (64u << 20))
+        return NULL;
+    if (len > r->cap) {
+        unsigned char *n = realloc(r->payload, len);
+        if (n == NULL)
+            return NULL;
+        r->payload = n;
+        r->cap = len;
+    }
+    if (gzread(r->gz, r->payload, len) != (int)len ||
+        chat_log_crc32(r->payload, len) != chat_log_get32(r->head + 12))
+        return NULL;
+    r->offset += CHAT_LOG_HEADER + len;
+    *head = r->head;
+    return r->payload;
+}
+
+void segment_close(segment_reader_t *r) {
+    if (r->map)
+        munmap(r->map, r->size);
+    if (r->gz)
+        gzclose(r->gz);
+    free(r->payload);
+    free(r->users);
+    free(r->rooms);
+}
+
+/* Take in a name definition; true if rec was one */
+bool segment_define(segment_reader_t *r, struct chat_log_record *rec) {
+    char (**names)[32];
+    unsigned int *cap;
+
+    if (rec->type != CHAT_LOG_DEF_USER && rec->type != CHAT_LOG_DEF_ROOM)
+        return false;
+    names = rec->type == CHAT_LOG_DEF_USER ? &r->users : &r->rooms;
+    cap = rec->type == CHAT_LOG_DEF_USER ? &r->users_cap : &r->rooms_cap;
+    if (rec->sender == 0 || rec->sender > 1000000)
+        return true;
+    if (rec->sender >= *cap) {
+        unsigned int ncap = *cap ? *cap : 64;
+        char (*n)[32];
+        while (ncap <= rec->sender)
+            ncap *= 2;
+        if ((n = realloc(*names, ncap * 32)) == NULL)
+            return true;
+        memset(n + *cap, 0, (ncap - *cap) * 32);
+        *names = n;
+        *cap = ncap;
+    }
+    snprintf((*names)[rec->sender], 32, "%.*s", (int)(rec->len < 31 ? rec->len : 31), rec->payload);
+    return true;
+}
+
+const char *segment_name(char (*names)[32], unsigned int cap, uint64_t id) {
+    return id < cap && names[id][0] ? names[id] : "?";
+}
+
+/* "[YYYY/MM/DD] HH:MM:SS #room <text>" as in chatting.log */
+void history_line(char *line, size_t size, long long when, const char *room, const unsigned char *text, size_t len) {
+    struct tm tm;
+    time_t t = when / 1000;
+
+    localtime_r(&t, &tm);
+    snprintf(line, size, "[%04d/%02d/%02d] %02d:%02d:%02d #%s %.*s",
+        1900 + tm.tm_year, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+        room, (int)(len < BUFFER_SZ ? len : BUFFER_SZ), text);
+}
+
+/* "YYYY/MM/DD-HH:MM[:SS]" or "HH:MM[:SS]" (today), local time */
+bool history_parse_time(const char *str, long long *ms) {
+    struct tm tm;
+    time_t now = time(NULL);
+    int y, mo, d, h, mi, sec = 0, n = 0;
+
+    localtime_r(&now, &tm);
+    if (sscanf(str, "%d/%d/%d-%d:%d%n", &y, &mo, &d, &h, &mi, &n) == 5) {
+        tm.tm_year = y - 1900;
+        tm.tm_mon = mo - 1;
+        tm.tm_mday = d;
+    }
+    else if (sscanf(str, "%d:%d%n", &h, &mi, &n) != 2) {
+        return false;
+    }
+    str += n;
+    if (*str == ':' && sscanf(str + 1, "%d%n", &sec, &n) == 1)
+        str += n + 1;
+    if (*str != '\0')
+        return false;
+    tm.tm_hour = h;
+    tm.tm_min = mi;
+    tm.tm_sec = sec;
+    tm.tm_isdst = -1;
+    *ms = mktime(&tm) * 1000LL;
+    return true;
+}
+
+/* Collect the matches of one block; false once it starts after the range */
+bool history_block(history_query_t *q, history_scan_t *st, segment_reader_t *r,
+                   const unsigned char *head, const unsigned char *p) {
+    const unsigned char *end = p + chat_log_get32(head + 4);
+    long long when = chat_log_get64(head + 16);
+    struct chat_log_record rec;
+
+    if (when > q->to)
+        return false;
+    st->blocks++;
+    while (p < end && (p = chat_log_next_record(p, end, &rec)) != NULL) {
+        char line[BUFFER_SZ + 96];
+
+        when += rec.dt;
+        if (segment_define(r, &rec) || when < q->from || when > q->to || rec.type == CHAT_LOG_DM)
+            continue;
+        if (q->sender[0] && strcmp(segment_name(r->users, r->users_cap, rec.sender), q->sender) != 0)
+            continue;
+        if (st->stream_hits == st->want) {
+            st->truncated = true;
+            return false;
+        }
+        if (st->count == st->cap) {
+            unsigned int ncap = st->cap ? st->cap * 2 : 256;
+            struct history_hit *n = realloc(st->hits, ncap * sizeof(struct history_hit));
+            if (n == NULL)
+                return false;
+            st->hits = n;
+            st->cap = ncap;
+        }
+        history_line(line, sizeof(line), when, segment_name(r->rooms, r->rooms_cap, rec.room), rec.payload, rec.len);
+        st->hits[st->count].when = when;
+        st->hits[st->count].seq = st->count;
+        st->hits[st->count++].line = strdup(line);
+        st->stream_hits++;
+    }
+    return true;
+}
+
+void history_segment(history_query_t *q, history_scan_t *st, const char *file) {
+    segment_reader_t r;
+    const unsigned char *head, *payload;
+
+    history_segments++;
+    if (!segment_open(&r, file, segment_seek(file, 0, q->from)))
+        return;
+    while ((payload = segment_next(&r, &head)) != NULL && history_block(q, st, &r, head, payload))
+        ;
+    segment_close(&r);
+}
+
+int history_hit_cmp(const void *a, const void *b) {
+    const struct history_hit *x = a, *y = b;
+    if (x->when != y->when)
+        return x->when < y->when ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+void history_job(void *arg) {
+    history_query_t *q = arg;
+    history_scan_t st;
+    struct { char file[64]; char stream[48]; } *files = NULL;
+    unsigned int nfiles = 0, first, last;
+    size_t size = 0, len = 0;
+    char *out = NULL, footer[160];
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    memset(&st, 0, sizeof(st));
+    first = (q->page - 1) * conf.history_page;
+    st.want = (first + conf.history_page < HISTORY_MAX_RESULTS ? first + conf.history_page : HISTORY_MAX_RESULTS) + 1;
+
+    /* Room segments that may overlap the range, oldest first */
+    pthread_mutex_lock(&manifest_lock);
+    files = malloc((log_nsegments + 1) * sizeof(*files));
+    for (unsigned int i = 0; files && i < log_nsegments; i++) {
+        log_segment_t *s = &log_segments[i];
+        size_t n = strlen(s->stream);
+
+        if (strncmp(s->stream, "rooms/", 6) != 0 || n < 4 || strcmp(s->stream + n - 4, ".bin") != 0)
+            continue;
+        if (q->room[0] && (n - 10 != strlen(q->room) || strncmp(s->stream + 6, q->room, n - 10) != 0))
+            continue;
+        if (s->first_ms > q->to || (s->state != SEGMENT_OPEN && s->last_ms < q->from))
+            continue;
+        memcpy(files[nfiles].file, s->file, sizeof(s->file));
+        memcpy(files[nfiles++].stream, s->stream, sizeof(s->stream));
+    }
+    pthread_mutex_unlock(&manifest_lock);
+
+    /* One room at a time, its segments oldest first, until it has enough */
+    for (unsigned int i = 0; i < nfiles && first < HISTORY_MAX_RESULTS; i++) {
+        if (files[i].file[0] == '\0')
+            continue;
+        st.stream_hits = 0;
+        for (unsigned int k = i; k < nfiles; k++) {
+            if (files[k].file[0] == '\0' || strcmp(files[k].stream, files[i].stream) != 0)
+                continue;
+            if (st.stream_hits < st.want)
+                history_segment(q, &st, files[k].file);
+            files[k].file[0] = '\0';
+        }
+    }
+    free(files);
+    qsort(st.hits, st.count, sizeof(struct history_hit), history_hit_cmp);
+
+    last = first + conf.history_page < st.count ? first + conf.history_page : st.count;
+    if (last > HISTORY_MAX_RESULTS)
+        last = HISTORY_MAX_RESULTS;
+    for (unsigned int i = first; i < last; i++) {
+        size_t n = strlen(st.hits[i].line);
+        if (len + n + 1 > size) {
+            char *nb = realloc(out, size = (len + n + 1) * 2);
+            if (nb == NULL)
+                break;
+            out = nb;
+        }
+        memcpy(out + len, st.hits[i].line, n + 1);
+        len += n;
+    }
+    if (out)
+        session_send(q->name, q->uid, out);
+    if (first >= HISTORY_MAX_RESULTS)
+        snprintf(footer, sizeof(footer), "History: pages end at match %d; narrow the range.\n", HISTORY_MAX_RESULTS);
+    else if (last < st.count && last == HISTORY_MAX_RESULTS)
+        snprintf(footer, sizeof(footer), "History: %u-%u; narrow the range for the rest.\n", first + 1, last);
+    else if (last < st.count && st.truncated)
+        snprintf(footer, sizeof(footer), "History: %u-%u. Add 'page %d' for more.\n", first + 1, last, q->page + 1);
+    else if (last < st.count)
+        snprintf(footer, sizeof(footer), "History: %u-%u of %u. Add 'page %d' for more.\n",
+            first + 1, last, st.count, q->page + 1);
+    else if (st.count == 0 || first >= st.count)
+        snprintf(footer, sizeof(footer), "History: no %smessages.\n", st.count ? "more " : "");
+    else
+        snprintf(footer, sizeof(footer), "History: %u-%u of %u.\n", first + 1, last, st.count);
+    session_send(q->name, q->uid, footer);
+
+    for (unsigned int i = 0; i < st.count; i++)
+        free(st.hits[i].line);
+    free(st.hits);
+    free(out);
+    free(q);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    history_blocks += st.blocks;
+    history_query_us += (t1.tv_sec - t0.tv_sec) * 1000000UL + (t1.tv_nsec - t0.tv_nsec) / 1000;
+    history_queries++;
+}
+
+/* HISTORY <from> <to> [#room] [@user] [page] */
+void history_cmd(client_t *cli, char *args) {
+    history_query_t *q = calloc(1, sizeof(history_query_t));
+    char *save, *tok, *end;
+    unsigned long page;
+    int n = 0;
+
+    if (q == NULL)
+        return;
+    q->page = 1;
+    for (tok = strtok_r(args, " ", &save); tok; tok = strtok_r(NULL, " ", &save), n++) {
+        if (n == 0 && history_parse_time(tok, &q->from))
+            continue;
+        if (n == 1 && history_parse_time(tok, &q->to))
+            continue;
+        if (n >= 2 && tok[0] == '#' && room_name_valid(tok + 1))
+            snprintf(q->room, sizeof(q->room), "%s", tok + 1);
+        else if (n >= 2 && tok[0] == '@' && tok[1])
+            snprintf(q->sender, sizeof(q->sender), "%s", tok + 1);
+        else if (n >= 2 && strcmp(tok, "page") == 0)
+            ;
+        else if (n >= 2 && isdigit((unsigned char)tok[0]) && (page = strtoul(tok, &end, 10)) > 0
+                 && *end == '\0' && page <= HISTORY_MAX_RESULTS)
+            q->page = page;
+        else
+            break;
+    }
+    if (tok != NULL || n < 2 || q->to < q->from) {
+        send_reply(cli, "Usage: HISTORY <from> <to> [#room] [@user] [page <n>]"
+            " (times as YYYY/MM/DD-HH:MM[:SS] or HH:MM[:SS] today)\n");
+        free(q);
+        return;
+    }
+    /* Whole seconds: a "to" of 13:25 includes 13:25:00.999 */
+    q->to += 999;
+    snprintf(q->name, sizeof(q->name), "%s", cli->username);
+    q->uid = cli->uid;
+    worker_submit(history_job, q);
+}
+
+/* File of a segment by number, false if it is not in the manifest */
+bool segment_file(unsigned int number, char *file, size_t size) {
+    bool found = false;
+
+    pthread_mutex_lock(&manifest_lock);
+    for (unsigned int i = log_nsegments; i-- > 0; ) {
+        if (log_segments[i].number == number) {
+            snprintf(file, size, "%s", log_segments[i].file);
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&manifest_lock);
+    return found;
+}
+
+/* Read message d back from the log as a chatting.log line */
+bool search_fetch(struct search_doc *d, char *line, size_t size) {
+    segment_reader_t r;
+    const unsigned char *head, *p;
+    char file[64];
+    bool found = false;
+
+    if (!segment_file(d->segment, file, sizeof(file)) ||
+        !segment_open(&r, file, segment_seek(file, 8, d->offset)))
+        return false;
+    while (!found && (p = segment_next(&r, &head)) != NULL && r.block_offset <= d->offset) {
+        const unsigned char *end = p + chat_log_get32(head + 4);
+        long long when = chat_log_get64(head + 16);
+        struct chat_log_record rec;
+
+        for (unsigned int n = 0; p < end && (p = chat_log_next_record(p, end, &rec)) != NULL; n++) {
+            when += rec.dt;
+            if (segment_define(&r, &rec) || r.block_offset != d->offset || n != d->record)
+                continue;
+            history_line(line, size, when, segment_name(r.rooms, r.rooms_cap, rec.room), rec.payload, rec.len);
+            found = true;
+            break;
+        }
+    }
+    segment_close(&r);
+    return found;
+}
+
+int search_term_cmp(const void *a, const void *b) {
+    const search_term_t *x = *(search_term_t * const *)a, *y = *(search_term_t * const *)b;
+    return (x->count > y->count) - (x->count < y->count);
+}
+
+/* Ids of the messages having every term, into ids (ascending); returns the total */
+unsigned int search_match(char terms[][SEARCH_TERM_MAX], int nterms, unsigned int **ids) {
+    search_term_t *lists[SEARCH_TERMS_PER_MSG];
+    unsigned int n = 0;
+
+    *ids = NULL;
+    for (int i = 0; i < nterms; i++) {
+        if ((lists[i] = search_term_find(terms[i], false)) == NULL)
+            return 0;
+    }
+    /* Rarest term first; the others only narrow it down */
+    qsort(lists, nterms, sizeof(search_term_t *), search_term_cmp);
+    if ((*ids = malloc(lists[0]->count * sizeof(unsigned int))) == NULL)
+        return 0;
+    {
+        const unsigned char *p = lists[0]->post, *end = p + lists[0]->len;
+        uint64_t delta, id = 0;
+        while (p < end && (p = chat_log_get_varint(p, end, &delta)) != NULL)
+            (*ids)[n++] = id += delta;
+    }
+    for (int i = 1; i < nterms && n > 0; i++) {
+        const unsigned char *p = lists[i]->post, *end = p + lists[i]->len;
+        uint64_t delta, id = 0;
+        unsigned int k = 0, kept = 0;
+
+        while (k < n && p < end && (p = chat_log_get_varint(p, end, &delta)) != NULL) {
+            id += delta;
+            while (k < n && (*ids)[k] < id)
+                k++;
+            if (k < n && (*ids)[k] == id)
+                (*ids)[kept++] = (*ids)[k++];
+        }
+        n = kept;
+    }
+    return n;
+}
+
+typedef struct {
+    char name[32];          /* requester */
+    int uid;
+    char terms[IN_MAX];     /* as typed; no longer than a line */
+} search_query_t;
+
+/* /search <terms>: the latest history_page room messages having all the terms */
+void search_job(void *arg) {
+    search_query_t *q = arg;
+    char terms[SEARCH_TERMS_PER_MSG][SEARCH_TERM_MAX];
+    int nterms = search_tokenize((unsigned char *)q->terms, strlen(q->terms), terms, SEARCH_TERMS_PER_MSG);
+    struct search_doc *docs = NULL;
+    unsigned int *ids, total = 0, shown = 0;
+    size_t size = 0, len = 0;
+    char *out = NULL, line[BUFFER_SZ + 96];
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (nterms > 0) {
+        pthread_rwlock_rdlock(&search_lock);
+        total = search_match(terms, nterms, &ids);
+        shown = total < (unsigned int)conf.history_page ? total : (unsigned int)conf.history_page;
+        if (shown > 0 && (docs = malloc(shown * sizeof(struct search_doc))) != NULL) {
+            for (unsigned int i = 0; i < shown; i++)
+                docs[i] = search_docs[ids[total - shown + i]];
+        }
+        pthread_rwlock_unlock(&search_lock);
+        free(ids);
+    }
+    for (unsigned int i = 0; docs && i < shown; i++) {
+        size_t n;
+        if (!search_fetch(&docs[i], line, sizeof(line)))
+            continue;
+        n = strlen(line);
+        if (len + n + 1 > size) {
+            char *nb = realloc(out, size = (len + n + 1) * 2);
+            if (nb == NULL)
+                break;
+            out = nb;
+        }
+        memcpy(out + len, line, n + 1);
+        len += n;
+    }
+    if (out)
+        session_send(q->name, q->uid, out);
+    if (total > shown)
+        snprintf(line, sizeof(line), "Search: %u matches, showing the latest %u.\n", total, shown);
+    else
+        snprintf(line, sizeof(line), "Search: %u matches.\n", total);
+    session_send(q->name, q->uid, line);
+    free(docs);
+    free(out);
+    free(q);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    search_query_us += (t1.tv_sec - t0.tv_sec) * 1000000UL + (t1.tv_nsec - t0.tv_nsec) / 1000;
+    search_queries++;
+}
+
+void search_cmd(client_t *cli, char *terms) {
+    search_query_t *q;
+
+    if (strlen(terms) >= sizeof(q->terms)) {
+        send_reply(cli, "Search: query too long.\n");
+        return;
+    }
+    if ((q = calloc(1, sizeof(search_query_t))) == NULL)
+        return;
+    snprintf(q->terms, sizeof(q->terms), "%s", terms);
+    snprintf(q->name, sizeof(q->name), "%s", cli->username);
+    q->uid = cli->uid;
+    worker_submit(search_job, q);
+}
+
+/*
+ * Checkpoint: SEARCH_CHECKPOINT holds the message locations and every
+ * posting list as they were (u32 magic, u32 messages, u32 terms, u32
+ * lowest segment still open; 12 bytes per message; per term u8 length,
+ * term, u32 count, u32 last id, u32 bytes, postings; u32 CRC-32 of all
+ * that). On start it is loaded and the segments written since are read
+ * to index what came after it.
+ */
+static unsigned int search_min_open = 0;
+
+void search_checkpoint_job(void *arg) {
+    unsigned char *buf, *p;
+    size_t size;
+    unsigned int min_open = UINT_MAX;
+    int fd;
+
+    pthread_mutex_lock(&manifest_lock);
+    for (unsigned int i = 0; i < log_nsegments; i++) {
+        if (log_segments[i].state == SEGMENT_OPEN && log_segments[i].number < min_open)
+            min_open = log_segments[i].number;
+    }
+    if (min_open == UINT_MAX)
+        min_open = log_next_segment;
+    pthread_mutex_unlock(&manifest_lock);
+
+    /* Copy under the lock, write after it */
+    pthread_rwlock_rdlock(&search_lock);
+    size = 20 + search_ndocs * 12UL;
+    for (unsigned int h = 0; h < search_buckets; h++) {
+        for (search_term_t *t = search_table[h]; t; t = t->next)
+            size += 13 + strlen(t->term) + t->len;
+    }
+    if ((buf = malloc(size)) == NULL) {
+        pthread_rwlock_unlock(&search_lock);
+        return;
+    }
+    chat_log_put32(buf, SEARCH_CHECKPOINT_MAGIC);
+    chat_log_put32(buf + 4, search_ndocs);
+    chat_log_put32(buf + 8, search_nterms);
+    chat_log_put32(buf + 12, min_open);
+    p = buf + 16;
+    for (unsigned int i = 0; i < search_ndocs; i++, p += 12) {
+        chat_log_put32(p, search_docs[i].segment);
+        chat_log_put32(p + 4, search_docs[i].offset);
+        chat_log_put32(p + 8, search_docs[i].record);
+    }
+    for (unsigned int h = 0; h < search_buckets; h++) {
+        for (search_term_t *t = search_table[h]; t; t = t->next) {
+            size_t tlen = strlen(t->term);
+            *p++ = tlen;
+            memcpy(p, t->term, tlen);
+            p += tlen;
+            chat_log_put32(p, t->count);
+            chat_log_put32(p + 4, t->last);
+            chat_log_put32(p + 8, t->len);
+            memcpy(p + 12, t->post, t->len);
+            p += 12 + t->len;
+        }
+    }
+    search_saved_docs = search_ndocs;
+    pthread_rwlock_unlock(&search_lock);
+    chat_log_put32(p, chat_log_crc32(buf, p - buf));
+
+    if ((fd = open(SEARCH_CHECKPOINT ".tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) >= 0) {
+        bool ok = write(fd, buf, size) == (ssize_t)size && (!conf.log_sync || fdatasync(fd) == 0);
+        close(fd);
+        if (ok && rename(SEARCH_CHECKPOINT ".tmp", SEARCH_CHECKPOINT) == 0) {
+            log_dir_sync();
+            search_checkpoints++;
+        }
+    }
+    free(buf);
+}
+
+bool search_load() {
+    unsigned char *buf, *p, *end;
+    unsigned int ndocs, nterms;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(SEARCH_CHECKPOINT, O_RDONLY | O_CLOEXEC)) < 0)
+        return false;
+    if (fstat(fd, &st) < 0 || st.st_size < 20 || (buf = malloc(st.st_size)) == NULL) {
+        close(fd);
+        return false;
+    }
+    if (read(fd, buf, st.st_size) != st.st_size || chat_log_get32(buf) != SEARCH_CHECKPOINT_MAGIC ||
+        chat_log_crc32(buf, st.st_size - 4) != chat_log_get32(buf + st.st_size - 4)) {
+        fprintf(stderr, "Ignoring damaged %s\n", SEARCH_CHECKPOINT);
+        close(fd);
+        free(buf);
+        return false;
+    }
+    close(fd);
+    ndocs = chat_log_get32(buf + 4);
+    nterms = chat_log_get32(buf + 8);
+    search_min_open = chat_log_get32(buf + 12);
+    end = buf + st.st_size - 4;
+    p = buf + 16;
+    if ((size_t)(end - p) < ndocs * 12UL || (search_docs = malloc((ndocs + 1) * sizeof(struct search_doc))) == NULL) {
+        free(buf);
+        return false;
+    }
+    for (unsigned int i = 0; i < ndocs; i++, p += 12) {
+        search_docs[i].segment = chat_log_get32(p);
+        search_docs[i].offset = chat_log_get32(p + 4);
+        search_docs[i].record = chat_log_get32(p + 8);
+    }
+    search_ndocs = search_saved_docs = ndocs;
+    search_docs_cap = ndocs + 1;
+    for (unsigned int i = 0; i < nterms && p < end; i++) {
+        char term[SEARCH_TERM_MAX];
+        unsigned int tlen = *p++, len;
+        search_term_t *t;
+
+        if (tlen >= SEARCH_TERM_MAX || end - p < tlen + 12)
+            break;
+        memcpy(term, p, tlen);
+        term[tlen] = '\0';
+        p += tlen;
+        len = chat_log_get32(p + 8);
+        if ((size_t)(end - p - 12) < len || (t = search_term_find(term, true)) == NULL ||
+            (t->post = malloc(len + 8)) == NULL)
+            break;
+        t->count = chat_log_get32(p);
+        t->last = chat_log_get32(p + 4);
+        t->len = len;
+        t->cap = len + 8;
+        memcpy(t->post, p + 12, len);
+        search_post_bytes += t->cap;
+        p += 12 + len;
+    }
+    free(buf);
+    return true;
+}
+
+/* Index the room messages logged after the checkpoint (all of them without
+   one); runs before the logger starts */
+void search_catch_up() {
+    struct {
+        unsigned int offset, record;
+        bool any;
+    } *done = calloc(log_next_segment + 1, sizeof(*done));
+    unsigned long added = 0;
+
+    if (done == NULL)
+        return;
+    /* Where each segment's indexed messages end */
+    for (unsigned int i = 0; i < search_ndocs; i++) {
+        struct search_doc *d = &search_docs[i];
+        if (d->segment > log_next_segment)
+            continue;
+        if (!done[d->segment].any || d->offset > done[d->segment].offset ||
+            (d->offset == done[d->segment].offset && d->record > done[d->segment].record)) {
+            done[d->segment].offset = d->offset;
+            done[d->segment].record = d->record;
+            done[d->segment].any = true;
+        }
+    }
+    for (unsigned int i = 0; i < log_nsegments; i++) {
+        log_segment_t *s = &log_segments[i];
+        size_t n = strlen(s->stream);
+        segment_reader_t r;
+        const unsigned char *head, *p;
+        unsigned long start = 0;
+
+        if (s->number < search_min_open || strncmp(s->stream, "rooms/", 6) != 0 || n < 4 ||
+            strcmp(s->stream + n - 4, ".bin") != 0)
+            continue;
+        if (s->number <= log_next_segment && done[s->number].any)
+            start = segment_seek(s->file, 8, done[s->number].offset);
+        if (!segment_open(&r, s->file, start))
+            continue;
+        while ((p = segment_next(&r, &head)) != NULL) {
+            const unsigned char *end = p + chat_log_get32(head + 4);
+            struct chat_log_record rec;
+
+            for (unsigned int k = 0; p < end && (p = chat_log_next_record(p, end, &rec)) != NULL; k++) {
+                if (segment_define(&r, &rec) || rec.type != CHAT_LOG_MSG)
+                    continue;
+                if (done[s->number].any && (r.block_offset < done[s->number].offset ||
+                    (r.block_offset == done[s->number].offset && k <= done[s->number].record)))
+                    continue;
+                search_add(s->number, r.block_offset, k, rec.payload, rec.len);
+                added++;
+            }
+        }
+        segment_close(&r);
+    }
+    free(done);
+    if (added > 0)
+        printf("Search index: %lu messages added from the log\n", added);
+}
+
+/* Load the checkpoint and catch up with the log; called before the logger starts */
+void search_start() {
+    if (!conf.search_index)
+        return;
+    search_load();
+    search_catch_up();
+}
+
+/* Answer DURABLE ON senders whose records the logger has synced */
+void log_release_acks(struct log_ack *acks, unsigned int n) {
+    static msg_t *saved = NULL;
+
+    if (saved == NULL && (saved = msg_new("SAVED\n", 6)) == NULL)
+        return;
+    pthread_rwlock_rdlock(&users_lock);
+    for (unsigned int i = 0; i < n; i++) {
+        user_entry_t *u = user_find(acks[i].name);
+        for (unsigned int k = 0; u && k < u->nsessions; k++) {
+            if (u->sessions[k]->uid == acks[i].uid)
+                conn_send(u->sessions[k], saved);
+        }
+    }
+    pthread_rwlock_unlock(&users_lock);
+}
+
+/*
+ * Offline mailboxes: mailbox/<user>/ holds append-only segments
+ * (%08u.seg, records are a 4-byte length and the text) and a cursor file
+ * "<segment> <offset>" marking the first undelivered byte. Delivered and
+ * expired segments are removed by a background job.
+ */
+static pthread_mutex_t mailbox_locks[MAILBOX_LOCKS];
+static _Atomic unsigned long mailbox_stored = 0;
+static _Atomic unsigned long mailbox_delivered = 0;
+static _Atomic unsigned long mailbox_rejected = 0;
+static _Atomic unsigned long mailbox_segments_removed = 0;
+
+/* A drain queued on a session; the cursor moves once its bytes are written */
+struct mailbox_delivery {
+    char user[32];
+    unsigned int seg;           /* cursor after the drained messages */
+    long off;
+    unsigned int count;
+    bool delivered;
+    int again;                  /* session to drain to afterwards, -1 for none */
+    struct mailbox_delivery *next;
+};
+static struct mailbox_delivery *mailbox_inflight[MAILBOX_LOCKS];   /* under mailbox_locks */
+
+pthread_mutex_t *mailbox_lock(const char *user) {
+    return &mailbox_locks[hash((unsigned char *)user) % MAILBOX_LOCKS];
+}
+
+/* Segment ids in the user's mailbox, sorted; returns how many (at most max) */
+int mailbox_segments(const char *dir, unsigned int *ids, int max) {
+    struct dirent *de;
+    DIR *d = opendir(dir);
+    int n = 0;
+
+    if (d == NULL)
+        return 0;
+    while ((de = readdir(d)) != NULL && n < max) {
+        unsigned int id;
+        char tail[8];
+        if (sscanf(de->d_name, "%8u.%3s", &id, tail) == 2 && strcmp(tail, "seg") == 0)
+            ids[n++] = id;
+    }
+    closedir(d);
+    for (int i = 1; i < n; i++) {
+        for (int j = i; j > 0 && ids[j - 1] > ids[j]; j--) {
+            unsigned int t = ids[j];
+            ids[j] = ids[j - 1];
+            ids[j - 1] = t;
+        }
+    }
+    return n;
+}
+
+/* First undelivered position; defaults to the start of the oldest segment */
+void mailbox_cursor(const char *dir, unsigned int *ids, int n, unsigned int *seg, long *off) {
+    char path[128];
+    FILE *fp;
+
+    *seg = n > 0 ? ids[0] : 1;
+    *off = 0;
+    snprintf(path, sizeof(path), "%s/cursor", dir);
+    if ((fp = fopen(path, "r")) != NULL) {
+        if (fscanf(fp, "%u %ld", seg, off) != 2) {
+            *seg = n > 0 ? ids[0] : 1;
+            *off = 0;
+        }
+        fclose(fp);
+    }
+}
+
+void mailbox_set_cursor(const char *dir, unsigned int seg, long off) {
+    char path[128], tmp[128];
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/cursor", dir);
+    snprintf(tmp, sizeof(tmp), "%s/cursor.tmp", dir);
+    if ((fp = fopen(tmp, "w")) == NULL)
+        return;
+    fprintf(fp, "%u %ld\n", seg, off);
+    if (fflush(fp) != 0 || fsync(fileno(fp)) < 0) {
+        fclose(fp);
+        unlink(tmp);
+        return;
+    }
+    fclose(fp);
+    rename(tmp, path);
+}
+
+long file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+/* Append one message for an offline user; <0 if it cannot be stored */
+int mailbox_append(const char *user, const char *text) {
+    unsigned int ids[1024], seg, cur_seg, len = strlen(text);
+    char dir[64], path[128];
+    long pending = 0, cur_off, size;
+    int n, fd;
+
+    if (!room_name_valid(user))
+        return -1;
+    snprintf(dir, sizeof(dir), MAILBOX_DIR "/%s", user);
+    pthread_mutex_lock(mailbox_lock(user));
+    mkdir(dir, 0700);
+    n = mailbox_segments(dir, ids, 1024);
+    mailbox_cursor(dir, ids, n, &cur_seg, &cur_off);
+    for (int i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "%s/%08u.seg", dir, ids[i]);
+        if (ids[i] >= cur_seg && (size = file_size(path)) > 0)
+            pending += size - (ids[i] == cur_seg ? cur_off : 0);
+    }
+    if (pending + len + 4 > conf.mailbox_max_bytes) {
+        pthread_mutex_unlock(mailbox_lock(user));
+        return -1;
+    }
+
+    /* Roll to a new segment when the last one is full or already delivered */
+    seg = n > 0 ? ids[n - 1] : cur_seg;
+    snprintf(path, sizeof(path), "%s/%08u.seg", dir, seg);
+    size = file_size(path);
+    if (size > 0 && (size + len + 4 > conf.mailbox_segment_bytes || (seg == cur_seg && cur_off >= size))) {
+        seg++;
+        snprintf(path, sizeof(path), "%s/%08u.seg", dir, seg);
+    }
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600)) < 0) {
+        pthread_mutex_unlock(mailbox_lock(user));
+        return -1;
+    }
     {
-    char s4[100]; // #stop
-    char* s5 = "#stop"; // Comparing with #stop
-    char buffer[MAX] = { 0, }; // read vote.txt buf
-    FILE* fp = fopen("vote.txt", "r+"); // read 'vote.txt' file
-
-         printf("Enter '#stop' to check the results\n");
-    printf("");
-    scanf("%s", s4);
-    if (strcmp(s4, s5) == 0)
+        struct iovec iov[2] = { { &len, 4 }, { (void *)text, len } };
+        writev(fd, iov, 2);
+    }
+    close(fd);
+    pthread_mutex_unlock(mailbox_lock(user));
+    mailbox_stored++;
+    return 0;
+}
+
+/* Remove delivered and expired segments of one mailbox */
+void mailbox_compact(const char *user) {
+    unsigned int ids[1024], cur_seg;
+    char dir[64], path[128];
+    long cur_off;
+    time_t now = time(NULL);
+    int n, left;
+
+    snprintf(dir, sizeof(dir), MAILBOX_DIR "/%s", user);
+    pthread_mutex_lock(mailbox_lock(user));
+    n = mailbox_segments(dir, ids, 1024);
+    mailbox_cursor(dir, ids, n, &cur_seg, &cur_off);
+    left = n;
+    for (int i = 0; i < n; i++) {
+        struct stat st;
+        bool delivered, expired;
+
+        snprintf(path, sizeof(path), "%s/%08u.seg", dir, ids[i]);
+        if (stat(path, &st) < 0)
+            continue;
+        delivered = ids[i] < cur_seg || (ids[i] == cur_seg && cur_off >= st.st_size && i == n - 1);
+        expired = conf.mailbox_ttl_sec > 0 && st.st_mtime + conf.mailbox_ttl_sec < now;
+        if (!delivered && !expired)
+            continue;
+        unlink(path);
+        mailbox_segments_removed++;
+        left--;
+        if (ids[i] >= cur_seg) {
+            cur_seg = ids[i] + 1;
+            cur_off = 0;
+            mailbox_set_cursor(dir, cur_seg, cur_off);
+        }
+    }
+    if (left == 0) {
+        snprintf(path, sizeof(path), "%s/cursor", dir);
+        unlink(path);
+        rmdir(dir);
+    }
+    pthread_mutex_unlock(mailbox_lock(user));
+}
+
+void mailbox_compact_job(void *arg) {
+    mailbox_compact(arg);
+    free(arg);
+}
+
+/* Periodic pass over every mailbox for expired segments */
+void mailbox_sweep_job(void *arg) {
+    struct dirent *de;
+    DIR *d = opendir(MAILBOX_DIR);
+
+    if (d == NULL)
+        return;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] != '.' && room_name_valid(de->d_name))
+            mailbox_compact(de->d_name);
+    }
+    closedir(d);
+}
+
+/* Mailbox work for the background queue, kept off the I/O threads */
+typedef struct {
+    char user[32];          /* mailbox owner */
+    char from[32];          /* sender of a DM to store */
+    int uid;                /* session told the outcome (store) or drained to */
+    char text[];            /* the DM to store; empty for a drain */
+} mailbox_job_t;
+
+/* Deliver everything waiting for one session in one write. The cursor only
+   moves once the bytes are on the wire; until then further drains of the
+   mailbox wait for this one. */
+void mailbox_drain_job(void *arg) {
+    mailbox_job_t *j = arg;
+    unsigned int ids[1024], cur_seg, last_seg = 0, count = 0;
+    char dir[64], path[128], *buf = NULL;
+    long cur_off, last_size = 0, used = 0;
+    struct mailbox_delivery **inflight = &mailbox_inflight[mailbox_lock(j->user) - mailbox_locks], *d;
+    bool written = false, queued = false;
+    int n;
+
+    snprintf(dir, sizeof(dir), MAILBOX_DIR "/%s", j->user);
+    pthread_mutex_lock(mailbox_lock(j->user));
+    for (d = *inflight; d && strcmp(d->user, j->user) != 0; d = d->next)
+        ;
+    if (d) {
+        d->again = j->uid;
+        pthread_mutex_unlock(mailbox_lock(j->user));
+        free(j);
+        return;
+    }
+    n = mailbox_segments(dir, ids, 1024);
+    mailbox_cursor(dir, ids, n, &cur_seg, &cur_off);
+    for (int i = 0; i < n; i++) {
+        long size, off = ids[i] == cur_seg ? cur_off : 0;
+        char *seg;
+        FILE *fp;
+
+        if (ids[i] < cur_seg)
+            continue;
+        snprintf(path, sizeof(path), "%s/%08u.seg", dir, ids[i]);
+        if ((size = file_size(path)) <= off || (fp = fopen(path, "r")) == NULL)
+            continue;
+        if ((seg = malloc(size - off)) != NULL && fseek(fp, off, SEEK_SET) == 0
+            && fread(seg, 1, size - off, fp) == (size_t)(size - off)) {
+            char *nbuf = realloc(buf, used + size - off);
+            if (nbuf) {
+                /* Strip the length prefixes; a torn last record is skipped */
+                buf = nbuf;
+                for (long p = 0; p + 4 <= size - off; ) {
+                    unsigned int len;
+                    memcpy(&len, seg + p, 4);
+                    if (p + 4 + len > (unsigned long)(size - off))
+                        break;
+                    memcpy(buf + used, seg + p + 4, len);
+                    used += len;
+                    p += 4 + len;
+                    count++;
+                }
+                last_seg = ids[i];
+                last_size = size;
+            }
+        }
+        free(seg);
+        fclose(fp);
+    }
+    if (used > 0 && (d = calloc(1, sizeof(*d))) != NULL) {
+        msg_t *m = msg_new(buf, used);
+
+        snprintf(d->user, sizeof(d->user), "%s", j->user);
+        d->seg = last_seg;
+        d->off = last_size;
+        d->count = count;
+        d->again = -1;
+        if (m) {
+            user_entry_t *u;
+
+            pthread_rwlock_rdlock(&users_lock);
+            if ((u = user_find(j->user)) != NULL) {
+                for (unsigned int i = 0; i < u->nsessions; i++) {
+                    client_t *c = u->sessions[i];
+                    unsigned int mark;
+
+                    if (c->uid != j->uid)
+                        continue;
+                    if (!conn_send_batch(c, &m, 1, &mark))
+                        break;
+                    /* Let the owner's flush report when the last byte is out */
+                    pthread_mutex_lock(&c->out_lock);
+                    if ((int)(c->out_sent - mark) >= 0) {
+                        written = true;
+                    }
+                    else if (c->state != CONN_CLOSING) {
+                        c->mailbox = d;
+                        c->mailbox_mark = mark;
+                        queued = true;
+                    }
+                    pthread_mutex_unlock(&c->out_lock);
+                    break;
+                }
+            }
+            pthread_rwlock_unlock(&users_lock);
+            msg_release(m);
+        }
+        if (queued) {
+            d->next = *inflight;
+            *inflight = d;
+        }
+        else {
+            free(d);
+        }
+    }
+    if (written)
+        mailbox_set_cursor(dir, last_seg, last_size);
+    pthread_mutex_unlock(mailbox_lock(j->user));
+
+    if (written) {
+        mailbox_delivered += count;
+        worker_submit(mailbox_compact_job, strdup(j->user));
+    }
+    free(buf);
+    free(j);
+}
+
+/* Finish a queued drain: move the cursor if the session got it all, then
+   run a drain that waited behind it */
+void mailbox_commit_job(void *arg) {
+    struct mailbox_delivery *d = arg, **pp = &mailbox_inflight[mailbox_lock(d->user) - mailbox_locks];
+    mailbox_job_t *j;
+    char dir[64];
+
+    pthread_mutex_lock(mailbox_lock(d->user));
+    if (d->delivered) {
+        snprintf(dir, sizeof(dir), MAILBOX_DIR "/%s", d->user);
+        mailbox_set_cursor(dir, d->seg, d->off);
+    }
+    while (*pp != d)
+        pp = &(*pp)->next;
+    *pp = d->next;
+    pthread_mutex_unlock(mailbox_lock(d->user));
+
+    if (d->delivered) {
+        mailbox_delivered += d->count;
+        mailbox_compact(d->user);
+    }
+    if (d->again >= 0 && (j = calloc(1, sizeof(mailbox_job_t) + 1)) != NULL) {
+        snprintf(j->user, sizeof(j->user), "%s", d->user);
+        j->uid = d->again;
+        mailbox_drain_job(j);
+    }
+    free(d);
+}
+
+/* A session's flush or close settled a queued drain (out_lock held) */
+void mailbox_written(struct mailbox_delivery *d, bool delivered) {
+    d->delivered = delivered;
+    worker_submit(mailbox_commit_job, d);
+}
+
+/* Hand <c>'s waiting messages to it from a background job */
+void mailbox_drain(client_t *c) {
+    mailbox_job_t *j;
+
+    if (!room_name_valid(c->username) || (j = calloc(1, sizeof(mailbox_job_t) + 1)) == NULL)
+        return;
+    snprintf(j->user, sizeof(j->user), "%s", c->username);
+    j->uid = c->uid;
+    worker_submit(mailbox_drain_job, j);
+}
+
+/* Store a DM for an offline user and tell the sender how it went */
+void mailbox_store_job(void *arg) {
+    mailbox_job_t *j = arg;
+    char reply[96];
+    user_entry_t *u;
+    int uid = -1;
+
+    if (mailbox_append(j->user, j->text) < 0) {
+        mailbox_rejected++;
+        snprintf(reply, sizeof(reply), "%s is offline and the message could not be stored.\n", j->user);
+    }
+    else {
+        snprintf(reply, sizeof(reply), "%s is offline; message stored.\n", j->user);
+    }
+    session_send(j->from, j->uid, reply);
+
+    /* A login since the send may have drained before the append: drain again
+       to the newest session */
+    pthread_rwlock_rdlock(&users_lock);
+    if ((u = user_find(j->user)) != NULL) {
+        for (unsigned int i = 0; i < u->nsessions; i++) {
+            if (u->sessions[i]->uid > uid)
+                uid = u->sessions[i]->uid;
+        }
+    }
+    pthread_rwlock_unlock(&users_lock);
+    if (uid >= 0) {
+        j->uid = uid;
+        mailbox_drain_job(j);
+        return;
+    }
+    free(j);
+}
+
+/* Deliver to every session of an online user, or queue it to be stored.
+   Returns the sessions reached, 0 if queued and -1 if it cannot be. */
+int send_or_store(client_t *from, const char *name, char *online, char *offline) {
+    mailbox_job_t *j;
+    size_t len = strlen(offline);
+    int sent;
+
+    pthread_rwlock_rdlock(&users_lock);
+    sent = user_deliver(name, online);
+    pthread_rwlock_unlock(&users_lock);
+    if (sent > 0)
+        return sent;
+    if (!room_name_valid(name) || (j = calloc(1, sizeof(mailbox_job_t) + len + 1)) == NULL) {
+        mailbox_rejected++;
+        return -1;
+    }
+    snprintf(j->user, sizeof(j->user), "%s", name);
+    snprintf(j->from, sizeof(j->from), "%s", from->username);
+    j->uid = from->uid;
+    memcpy(j->text, offline, len + 1);
+    worker_submit(mailbox_store_job, j);
+    return 0;
+}
+
+/* Send a message to the client at IP:PORT; returns its uid or -1 */
+int send_message_to(char* s, char* IP, char* PORT) {
+    msg_t *m;
+    int found = -1;
+
+    if (IP == NULL || PORT == NULL || (m = msg_new(s, strlen(s))) == NULL)
+        return -1;
+    pthread_mutex_lock(&clnt_mutex);
+
+    for (int i = 0; i < conf.max_clients; ++i) {
+        if (clients[i]) {
+            if ((strcmp(inet_ntoa(clients[i]->address.sin_addr), IP) == 0)
+                && (clients[i]->address.sin_port == atoi(PORT))) {
+                conn_send(clients[i], m);
+                found = clients[i]->uid;
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&clnt_mutex);
+    msg_release(m);
+    return found;
+}
+
+/* Forward raw bytes to the client with the given uid */
+void send_message_to_uid(char *s, unsigned int len, int uid) {
+    msg_t *m;
+
+    if (uid < 0 || (m = msg_new(s, len)) == NULL)
+        return;
+    pthread_mutex_lock(&clnt_mutex);
+    for (int i = 0; i < conf.max_clients; ++i) {
+        if (clients[i] && clients[i]->uid == uid) {
+            conn_send(clients[i], m);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&clnt_mutex);
+    msg_release(m);
+}
+
+/* Resumable session: what a reconnect within the grace period gets back */
+typedef struct resume {
+    char token[TOKEN_LEN + 1];
+    char username[32];
+    struct resume *next;
+    struct resume *prev_detached;
+    struct resume *next_detached;
+    client_t *client;           /* live session, NULL during the grace period */
+    long long expires;
+    unsigned char nrooms;
+    unsigned char active;
+    unsigned char presence_off;
+    unsigned char seq_on;
+    struct {
+        char name[32];
+        unsigned long gen;
+        unsigned long long seq; /* last message acknowledged (or sent) before the drop */
+    } rooms[ROOMS_PER_CLIENT];
+} resume_t;
+
+static resume_t *resume_table[RESUME_BUCKETS];
+static resume_t *detached_head = NULL, *detached_tail = NULL;
+static pthread_mutex_t resume_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic long resume_waiting = 0;
+static _Atomic unsigned long resume_resumed = 0;
+static _Atomic unsigned long resume_expired = 0;
+
+resume_t **resume_slot(const char *token) {
+    resume_t **pp = &resume_table[hash((unsigned char *)token) % RESUME_BUCKETS];
+
+    while (*pp && strcmp((*pp)->token, token) != 0)
+        pp = &(*pp)->next;
+    return pp;
+}
+
+void detached_unlink(resume_t *rec) {
+    if (rec->prev_detached)
+        rec->prev_detached->next_detached = rec->next_detached;
+    else
+        detached_head = rec->next_detached;
+    if (rec->next_detached)
+        rec->next_detached->prev_detached = rec->prev_detached;
+    else
+        detached_tail = rec->prev_detached;
+    resume_waiting--;
+}
+
+/* Give a fresh session a token: "SESSION <token>" */
+void resume_issue(client_t *c) {
+    unsigned char rnd[TOKEN_LEN / 2];
+    char line[TOKEN_LEN + 16];
+    resume_t *rec;
+
+    if (conf.resume_grace_ms <= 0 || (rec = calloc(1, sizeof(resume_t))) == NULL)
+        return;
+    if (getrandom(rnd, sizeof(rnd), 0) != sizeof(rnd)) {
+        free(rec);
+        return;
+    }
+    for (int i = 0; i < TOKEN_LEN / 2; i++)
+        sprintf(rec->token + i * 2, "%02x", rnd[i]);
+    snprintf(rec->username, sizeof(rec->username), "%s", c->username);
+    rec->client = c;
+
+    pthread_mutex_lock(&resume_lock);
+    rec->next = *resume_slot(rec->token);
+    *resume_slot(rec->token) = rec;
+    pthread_mutex_unlock(&resume_lock);
+    c->resume = rec;
+
+    snprintf(line, sizeof(line), "SESSION %s\n", rec->token);
+    send_reply(c, line);
+}
+
+/* A login presenting <token> as its password; NULL if it is not a waiting
+   session of <username>. *busy is set when it is <username>'s token but the
+   old connection is still attached: that one is cut, and the login should
+   be retried once it has gone. */
+resume_t *resume_claim(const char *username, const char *token, bool *busy) {
+    resume_t *rec;
+
+    *busy = false;
+    if (conf.resume_grace_ms <= 0 || strlen(token) != TOKEN_LEN)
+        return NULL;
+    pthread_mutex_lock(&resume_lock);
+    rec = *resume_slot(token);
+    if (rec && strcmp(rec->username, username) == 0) {
+        if (rec->client) {
+            shutdown(rec->client->sockfd, SHUT_RDWR);
+            *busy = true;
+            rec = NULL;
+        }
+        else {
+            detached_unlink(rec);
+        }
+    }
+    else {
+        rec = NULL;
+    }
+    pthread_mutex_unlock(&resume_lock);
+    return rec;
+}
+
+/* Start the grace period of a dropped session */
+void resume_detach(resume_t *rec) {
+    pthread_mutex_lock(&resume_lock);
+    rec->client = NULL;
+    rec->expires = now_ms() + conf.resume_grace_ms;
+    rec->next_detached = NULL;
+    rec->prev_detached = detached_tail;
+    if (detached_tail)
+        detached_tail->next_detached = rec;
+    else
+        detached_head = rec;
+    detached_tail = rec;
+    resume_waiting++;
+    pthread_mutex_unlock(&resume_lock);
+}
+
+/* Forget a session that ended for good */
+void resume_drop(resume_t *rec) {
+    pthread_mutex_lock(&resume_lock);
+    *resume_slot(rec->token) = rec->next;
+    pthread_mutex_unlock(&resume_lock);
+    free(rec);
+}
+
+/* Put a resumed session back in its rooms and send only what it missed */
+void resume_attach(client_t *c, resume_t *rec) {
+    char line[TOKEN_LEN + 16];
+
+    pthread_mutex_lock(&resume_lock);
+    rec->client = c;
+    pthread_mutex_unlock(&resume_lock);
+    c->resume = rec;
+    c->presence_off = rec->presence_off;
+    c->seq_on = rec->seq_on;
+
+    snprintf(line, sizeof(line), "SESSION %s\n", rec->token);
+    send_reply(c, line);
+    for (int i = 0; i < rec->nrooms; i++) {
+        unsigned long long since = rec->rooms[i].seq;
+        room_t *r = room_join_at(c, rec->rooms[i].name, since);
+        if (r == NULL)
+            continue;
+        if (r->gen != rec->rooms[i].gen) {
+            since = 0;
+            if (c->seq_on)
+                room_ack_start(c, r, 0);
+        }
+        presence_roster(c, r);
+        room_history_replay(c, r, since);
+    }
+    if (rec->nrooms > 0)
+        room_join(c, rec->rooms[rec->active].name);
+    resume_resumed++;
+}
+
+/* Sessions whose grace period ran out leave their rooms now */
+void resume_expire() {
+    long long now = now_ms();
+    resume_t *expired = NULL;
+
+    pthread_mutex_lock(&resume_lock);
+    while (detached_head && detached_head->expires <= now) {
+        resume_t *rec = detached_head;
+        detached_unlink(rec);
+        *resume_slot(rec->token) = rec->next;
+        rec->next = expired;
+        expired = rec;
+    }
+    pthread_mutex_unlock(&resume_lock);
+
+    while (expired) {
+        resume_t *rec = expired;
+        expired = rec->next;
+        pthread_rwlock_rdlock(&rooms_lock);
+        for (int i = 0; i < rec->nrooms; i++) {
+            room_t *r = room_find(rec->rooms[i].name);
+            if (r && r->gen == rec->rooms[i].gen)
+                presence_event(r, rec->username, -1);
+        }
+        pthread_rwlock_unlock(&rooms_lock);
+        resume_expired++;
+        free(rec);
+    }
+}
+
+void filter_reload(bool force);
+
+/* Presence batches, resume grace periods, mailbox sweeps and filter reloads */
+void *presence_main(void *arg) {
+    long long next_sweep = now_ms(), next_checkpoint = now_ms() + conf.search_checkpoint_sec * 1000LL;
+
+    thread_register(ROLE_WORKER);
+    while (1) {
+        usleep(conf.presence_ms * 1000);
+        presence_flush();
+        resume_expire();
+        filter_reload(false);
+        if (now_ms() >= next_sweep) {
+            worker_submit(mailbox_sweep_job, NULL);
+            next_sweep = now_ms() + MAILBOX_SWEEP_MS;
+        }
+        if (conf.search_checkpoint_sec > 0 && now_ms() >= next_checkpoint) {
+            if (search_ndocs != search_saved_docs)
+                worker_submit(search_checkpoint_job, NULL);
+            next_checkpoint = now_ms() + conf.search_checkpoint_sec * 1000LL;
+        }
+    }
+    return NULL;
+}
+
+/* Compare a password with the hash stored in user_auth.txt */
+bool check_password(char *passwd) {
+    char hashpass2[100];
+    char line[1000] = {};
+    FILE *fPtr;
+
+    // converting the resultant hash(int) to hashpass2(char)
+    unsigned long hash1 = hash(passwd);
+    snprintf( hashpass2, DATA_SIZE, "%d", hash1 );
+
+    fPtr = fopen("user_auth.txt", "r");
+
+    /* fopen() return NULL if last operation was unsuccessful */
+    if(fPtr == NULL){
+        /* File not created hence exit */
+        printf("Unable to read user_auth.txt file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    fgets(line, 1000, fPtr);
+    fclose(fPtr);
+    return strcmp(line, hashpass2) == 10;
+}
+
+/* Check the username/password block; the username is copied out on success.
+   Returns 0 when logged in, -1 when refused and 1 when a resume has to be
+   retried. */
+int client_auth(char *block, char *username, resume_t **resumed) {
+    char buff_out[BUFFER_SZ];
+    char passwd[32];
+    bool busy;
+
+    memcpy(username, block, 32);
+    username[31] = '\0';
+    memcpy(passwd, block + 32, 32);
+    passwd[31] = '\0';
+
+	if(strlen(username) <  2 || strlen(username) >= 32-1){
+		printf("Didn't enter the Username.\n");
+		return -1;
+	}
+    if(strlen(passwd) <  2 || strlen(passwd) >= 32-1){
+        printf("Didn't enter the Password.\n");
+        return -1;
+    }
+
+    if ((*resumed = resume_claim(username, passwd, &busy)) != NULL)
+        return 0;
+    if (busy)
+        return 1;
+    if (!check_password(passwd)) {
+        printf("Incorrect Password.\n");
+        sprintf(buff_out, "%s enter incorrect Password.\n", username);
+        update_log(buff_out, "login.log");
+        return -1;
+    }
+    return 0;
+}
+
+/* Announce a newly authenticated client */
+void client_join(client_t *cli, resume_t *resumed) {
+    char buff_out[BUFFER_SZ];
+    room_t *lobby = NULL;
+
+    queue_add(cli);
+    user_index_add(cli);
+    if (resumed) {
+        /* Same session as before the drop: no presence change, only the gap */
+        sprintf(buff_out, "%s:%d  \"%s\" has resumed\n",
+            inet_ntoa(cli->address.sin_addr), cli->address.sin_port, cli->username);
+        update_log(buff_out, "login.log");
+        printf("%s", buff_out);
+        resume_attach(cli, resumed);
+        mailbox_drain(cli);
+        return;
+    }
+    resume_issue(cli);
+    if (conf.join_lobby)
+        lobby = room_join(cli, LOBBY_ROOM);
+    sprintf(buff_out, "%s:%d  \"%s\" has joined\n",
+        inet_ntoa(cli->address.sin_addr),
+        cli->address.sin_port,
+        cli->username);
+    update_log(buff_out, "login.log");
+    printf("%s", buff_out);
+    if (lobby) {
+        room_log(lobby, CHAT_LOG_JOIN, cli->username, buff_out);
+        presence_roster(cli, lobby);
+        room_history_replay(cli, lobby, 0);
+        presence_event(lobby, cli->username, 1);
+    }
+    mailbox_drain(cli);
+}
+
+/* JOIN <room>: subscribe and make it the active room */
+void room_cmd_join(client_t *cli, char *name) {
+    char buff_out[BUFFER_SZ];
+    int was_member = 0;
+    room_t *r;
+
+    for (int i = 0; i < cli->nrooms; i++)
+        was_member |= strcmp(cli->rooms[i]->name, name) == 0;
+    if ((r = room_join(cli, name)) == NULL) {
+        send_reply(cli, cli->nrooms == ROOMS_PER_CLIENT ? "Too many rooms.\n" : "Invalid room name.\n");
+        return;
+    }
+    if (was_member)
+        return;
+    sprintf(buff_out, "\"%s\" has joined #%s\n", cli->username, r->name);
+    room_log(r, CHAT_LOG_JOIN, cli->username, buff_out);
+    presence_roster(cli, r);
+    room_history_replay(cli, r, 0);
+    presence_event(r, cli->username, 1);
+}
+
+/* A room the client is in, by name */
+room_t *client_room(client_t *c, const char *name) {
+    for (int i = 0; i < c->nrooms; i++) {
+        if (strcmp(c->rooms[i]->name, name) == 0)
+            return c->rooms[i];
+    }
+    return NULL;
+}
+
+/* SEQ ON|OFF: numbered room messages ("MSG #room <seq> text") and ACK tracking */
+void room_cmd_seq(client_t *cli, bool on) {
+    if (cli->seq_on == on)
+        return;
+    cli->seq_on = on;
+    for (int i = 0; i < cli->nrooms; i++) {
+        if (on)
+            room_ack_start(cli, cli->rooms[i], cli->rooms[i]->seq);
+        else
+            room_ack_stop(cli, cli->rooms[i]);
+    }
+}
+
+/* ACK #<room> <seq>: the client has every message of the room up to seq */
+void room_cmd_ack(client_t *cli, char *args) {
+    char name[32];
+    unsigned long long seq;
+    struct room_ack *a;
+    room_t *r;
+
+    if (sscanf(args, "#%31s %llu", name, &seq) != 2 || (r = client_room(cli, name)) == NULL
+        || (a = room_ack_entry(cli, r)) == NULL)
+        return;
+    if (seq > r->seq)
+        seq = r->seq;
+    if (seq > a->acked)
+        a->acked = seq;
+    acks_received++;
+}
+
+/* RESEND #<room> <after> [<upto>]: fill a gap the client noticed */
+void room_cmd_resend(client_t *cli, char *args) {
+    char name[32];
+    unsigned long long after, upto = ACK_NONE;
+    room_t *r;
+
+    if (sscanf(args, "#%31s %llu %llu", name, &after, &upto) < 2) {
+        send_reply(cli, "Usage: RESEND #<room> <after> [<upto>]\n");
+        return;
+    }
+    if ((r = client_room(cli, name)) == NULL) {
+        send_reply(cli, "Not in that room.\n");
+        return;
+    }
+    resend_requests++;
+    room_history_range(cli, r, after, upto);
+}
+
+/* MUTE|UNMUTE [<room>]: stop or restart delivery of a room's messages */
+void room_cmd_mute(client_t *cli, char *name, bool mute) {
+    room_t *r = *name ? client_room(cli, name) : cli->room;
+    int free_slot = -1;
+
+    if (r == NULL) {
+        send_reply(cli, "Not in that room.\n");
+        return;
+    }
+    for (int i = 0; i < ROOMS_PER_CLIENT; i++) {
+        if (cli->muted[i] == r) {
+            if (!mute) {
+                cli->muted[i] = NULL;
+                cli->nmuted--;
+            }
+            return;
+        }
+        if (cli->muted[i] == NULL && free_slot < 0)
+            free_slot = i;
+    }
+    if (mute && free_slot >= 0) {
+        cli->muted[free_slot] = r;
+        cli->nmuted++;
+    }
+}
+
+/* PART [<room>]: leave the named or the active room */
+void room_cmd_part(client_t *cli, char *name) {
+    char buff_out[BUFFER_SZ];
+    room_t *r = *name ? NULL : cli->room;
+
+    for (int i = 0; r == NULL && i < cli->nrooms; i++) {
+        if (strcmp(cli->rooms[i]->name, name) == 0)
+            r = cli->rooms[i];
+    }
+    if (r == NULL) {
+        send_reply(cli, "Not in that room.\n");
+        return;
+    }
+    sprintf(buff_out, "%s has left #%s\n", cli->username, r->name);
+    room_log(r, CHAT_LOG_LEAVE, cli->username, buff_out);
+    send_reply(cli, buff_out);
+    presence_event(r, cli->username, -1);
+    room_part(cli, r, NULL);
+}
+
+/* VOTE#<question>: open a vote in the active room */
+void room_vote_open(client_t *cli, char *line, char *question) {
+    room_t *r = cli->room;
+
+    pthread_mutex_lock(&r->state_lock);
+    snprintf(r->question, sizeof(r->question), "%s", question ? question : "");
+    memset(r->votes, 0, sizeof(r->votes));
+    r->vote_open = 1;
+    pthread_mutex_unlock(&r->state_lock);
+    send_message(r, line, cli->uid);
+    send_message(r, "\n1) YES\n2) NO\n3) NONE\nAnswer with 'VOTE <n>', close with 'VOTE STOP'\n", -1);
+}
+
+/* VOTE <n> casts a vote, VOTE STOP closes it and posts the result */
+void room_vote_cmd(client_t *cli, char *arg) {
+    char result[MAX], summary[100];
+    room_t *r = cli->room;
+    int n = atoi(arg);
+    FILE *fp;
+
+    pthread_mutex_lock(&r->state_lock);
+    if (!r->vote_open) {
+        pthread_mutex_unlock(&r->state_lock);
+        send_reply(cli, "No vote in progress.\n");
+        return;
+    }
+    if (strcmp(arg, "STOP") != 0) {
+        if (n > 0 && n <= 3)
+            r->votes[n - 1]++;
+        pthread_mutex_unlock(&r->state_lock);
+        send_reply(cli, n > 0 && n <= 3 ? "Vote recorded.\n" : "Enter Valid input\n");
+        return;
+    }
+    r->vote_open = 0;
+    vote_result(r->votes, result, sizeof(result));
+    pthread_mutex_unlock(&r->state_lock);
+
+    fp = fopen("vote.txt", "w");
+    if (fp) {
+        fprintf(fp, "#%s %s\n%s", r->name, r->question, result);
+        fclose(fp);
+    }
+    snprintf(summary, sizeof(summary), "Vote result: YES = %d NO = %d NONE = %d\n",
+        r->votes[0], r->votes[1], r->votes[2]);
+    room_log(r, CHAT_LOG_NOTICE, NULL, summary);
+    send_message(r, result, -1);
+}
+
+/* @<user> <text>: private message to every session of <user> */
+void direct_message(client_t *cli, char *parse) {
+    char buff_out[BUFFER_SZ + 64];
+    char *name = parse + 1;
+    char *text = strchr(name, ' ');
+
+    if (text == NULL || *name == ' ') {
+        send_reply(cli, "Usage: @<user> <message>\n");
+        return;
+    }
+    *text++ = '\0';
+    snprintf(buff_out, sizeof(buff_out), "(DM) %s: %s\n", cli->username, text);
     {
-        fread(buffer, 1, MAX, fp); //전체 읽기
-        printf("%s", buffer);
+        char stored[BUFFER_SZ + 96];
+        time_t t = time(NULL);
+        struct tm *tm = localtime(&t);
+        int sent;
+
+        snprintf(stored, sizeof(stored), "(DM %04d/%02d/%02d %02d:%02d) %s: %s\n",
+            1900 + tm->tm_year, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour, tm->tm_min,
+            cli->username, text);
+        if ((sent = send_or_store(cli, name, buff_out, stored)) < 0) {
+            snprintf(buff_out, sizeof(buff_out), "%s is offline and the message could not be stored.\n", name);
+            send_reply(cli, buff_out);
+            return;
+        }
+    }
+    snprintf(buff_out, sizeof(buff_out), "%s: %s\n", cli->username, text);
+    sketch_count(cli, NULL);
+    if (!cli->durable)
+        chat_log(CHAT_LOG_DM, cli->username, name, buff_out);
+    else if (!chat_log_durable(cli, CHAT_LOG_DM, name, buff_out))
+        send_reply(cli, "Not saved: the log queue is full.\n");
+}
+
+/*
+ * Keyword filter: "<block|mask|flag> <pattern>" lines of filter.txt compiled
+ * into an Aho-Corasick automaton (ASCII case-insensitive, UTF-8 bytes
+ * otherwise). A shufti-style SSSE3 prefilter over the patterns' first bytes
+ * finds where the automaton has to start; lines without such a byte skip
+ * it. The file is recompiled when its mtime changes and swapped in under
+ * filter_lock.
+ */
+enum { FILTER_FLAG = 1, FILTER_MASK, FILTER_BLOCK };
+
+typedef struct {
+    int fail;
+    int dict;                   /* nearest state on the fail chain that ends a pattern */
+    int pattern;                /* strongest pattern ending here, -1 if none */
+    unsigned int edges;         /* children: labels/targets[edges .. edges + nedges) */
+    unsigned int nedges;
+} ac_state_t;
+
+typedef struct {
+    ac_state_t *states;
+    unsigned char *labels;
+    int *targets;
+    int root[256];
+    unsigned int npatterns;
+    unsigned char *actions;
+    unsigned short *lens;
+    char **texts;
+    unsigned char lo[16], hi[16];   /* prefilter: b is a first byte if lo[b & 15] & hi[b >> 4] */
+    time_t mtime;
+} filter_t;
+
+static filter_t *filter = NULL;
+static pthread_rwlock_t filter_lock = PTHREAD_RWLOCK_INITIALIZER;
+static time_t filter_mtime = 0;
+static bool filter_simd = false;
+static _Atomic unsigned long filter_lines = 0;
+static _Atomic unsigned long filter_skipped = 0;
+static _Atomic unsigned long filter_blocked = 0;
+static _Atomic unsigned long filter_masked = 0;
+static _Atomic unsigned long filter_flagged = 0;
+static _Atomic unsigned long filter_ns = 0;
+static _Atomic unsigned long filter_max_ns = 0;
+
+void filter_free(filter_t *f) {
+    if (f == NULL)
+        return;
+    for (unsigned int i = 0; i < f->npatterns; i++)
+        free(f->texts[i]);
+    free(f->texts);
+    free(f->lens);
+    free(f->actions);
+    free(f->states);
+    free(f->labels);
+    free(f->targets);
+    free(f);
+}
+
+/* Build-time trie node */
+struct ac_build {
+    int child, sibling, pattern;
+    unsigned char label;
+};
+
+int ac_build_child(struct ac_build *t, int node, unsigned char c) {
+    int i = t[node].child;
+
+    while (i && t[i].label != c)
+        i = t[i].sibling;
+    return i;
+}
+
+filter_t *filter_compile(FILE *fp) {
+    filter_t *f = calloc(1, sizeof(filter_t));
+    struct ac_build *t = NULL;
+    int nt = 1, tcap = 0, *queue = NULL, qh = 0, qt = 0;
+    unsigned int pcap = 0;
+    char line[512];
+
+    if (f == NULL)
+        return NULL;
+    if ((t = calloc(tcap = 1024, sizeof(*t))) == NULL)
+        goto fail;
+    t[0].pattern = -1;
+
+    while (fgets(line, sizeof(line), fp)) {
+        char *word = line, *pat;
+        unsigned char action;
+        int node = 0;
+
+        str_trim_lf(line, strlen(line));
+        if (line[0] == '#' || (pat = strchr(line, ' ')) == NULL)
+            continue;
+        *pat++ = '\0';
+        if (strcmp(word, "block") == 0)
+            action = FILTER_BLOCK;
+        else if (strcmp(word, "mask") == 0)
+            action = FILTER_MASK;
+        else if (strcmp(word, "flag") == 0)
+            action = FILTER_FLAG;
+        else
+            continue;
+        if (*pat == '\0' || strlen(pat) > 255)
+            continue;
+        if (f->npatterns == pcap) {
+            pcap = pcap ? pcap * 2 : 64;
+            f->actions = realloc(f->actions, pcap);
+            f->lens = realloc(f->lens, pcap * sizeof(unsigned short));
+            f->texts = realloc(f->texts, pcap * sizeof(char *));
+            if (!f->actions || !f->lens || !f->texts)
+                goto fail;
+        }
+        f->actions[f->npatterns] = action;
+        f->lens[f->npatterns] = strlen(pat);
+        f->texts[f->npatterns] = strdup(pat);
+        for (unsigned char *p = (unsigned char *)pat; *p; p++) {
+            unsigned char c = tolower(*p);
+            int next = ac_build_child(t, node, c);
+            if (next == 0) {
+                if (nt == tcap && (t = realloc(t, (tcap *= 2) * sizeof(*t))) == NULL)
+                    goto fail;
+                next = nt++;
+                t[next].label = c;
+                t[next].child = 0;
+                t[next].pattern = -1;
+                t[next].sibling = t[node].child;
+                t[node].child = next;
+            }
+            node = next;
+        }
+        if (t[node].pattern < 0 || f->actions[t[node].pattern] < action)
+            t[node].pattern = f->npatterns;
+        f->npatterns++;
+        /* Prefilter on the first byte, both cases */
+        for (int k = 0; k < 2; k++) {
+            unsigned char b = k ? toupper((unsigned char)pat[0]) : tolower((unsigned char)pat[0]);
+            f->lo[b & 15] |= 1 << ((b >> 4) & 7);
+            f->hi[b >> 4] |= 1 << ((b >> 4) & 7);
+        }
+    }
+
+    /* Breadth-first: fail and dictionary links, then children as sorted edge arrays */
+    f->states = calloc(nt, sizeof(ac_state_t));
+    f->labels = malloc(nt);
+    f->targets = malloc(nt * sizeof(int));
+    queue = malloc(nt * sizeof(int));
+    if (!f->states || !f->labels || !f->targets || !queue)
+        goto fail;
+    queue[qt++] = 0;
+    while (qh < qt) {
+        int u = queue[qh++];
+        unsigned int first = qt;
+
+        f->states[u].pattern = t[u].pattern;
+        for (int v = t[u].child; v; v = t[v].sibling) {
+            int fs = f->states[u].fail, to = 0;
+            if (u != 0) {
+                while ((to = ac_build_child(t, fs, t[v].label)) == 0 && fs != 0)
+                    fs = f->states[fs].fail;
+            }
+            f->states[v].fail = to;
+            f->states[v].dict = t[to].pattern >= 0 ? to : f->states[to].dict;
+            queue[qt++] = v;
+        }
+        /* Children are contiguous in BFS order; sort them by label */
+        for (unsigned int i = first + 1; i < (unsigned int)qt; i++) {
+            for (unsigned int j = i; j > first && t[queue[j - 1]].label > t[queue[j]].label; j--) {
+                int x = queue[j];
+                queue[j] = queue[j - 1];
+                queue[j - 1] = x;
+            }
+        }
+        f->states[u].edges = first - 1;
+        f->states[u].nedges = qt - first;
+    }
+    /* Edge k (for k >= 0) points at queue[k + 1], the k-th state after the root */
+    for (int i = 1; i < nt; i++) {
+        f->labels[i - 1] = t[queue[i]].label;
+        f->targets[i - 1] = queue[i];
+    }
+    for (int c = 0; c < 256; c++)
+        f->root[c] = 0;
+    for (unsigned int i = 0; i < f->states[0].nedges; i++)
+        f->root[f->labels[f->states[0].edges + i]] = f->targets[f->states[0].edges + i];
+    free(queue);
+    free(t);
+    return f;
+fail:
+    free(queue);
+    free(t);
+    filter_free(f);
+    return NULL;
+}
+
+int ac_next(const filter_t *f, int s, unsigned char c) {
+    while (s != 0) {
+        const ac_state_t *st = &f->states[s];
+        for (unsigned int i = st->edges; i < st->edges + st->nedges && f->labels[i] <= c; i++) {
+            if (f->labels[i] == c)
+                return f->targets[i];
+        }
+        s = st->fail;
+    }
+    return f->root[c];
+}
+
+/* Offset of the first byte that can start a pattern, or len */
+unsigned int filter_prefilter_scalar(const filter_t *f, const unsigned char *p, unsigned int len) {
+    for (unsigned int i = 0; i < len; i++) {
+        if (f->lo[p[i] & 15] & f->hi[p[i] >> 4])
+            return i;
+    }
+    return len;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+unsigned int filter_prefilter_ssse3(const filter_t *f, const unsigned char *p, unsigned int len) {
+    __m128i lo = _mm_loadu_si128((const __m128i *)f->lo);
+    __m128i hi = _mm_loadu_si128((const __m128i *)f->hi);
+    __m128i nib = _mm_set1_epi8(0x0f);
+    unsigned int i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(v, nib));
+        __m128i h = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(v, 4), nib));
+        int hit = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(l, h), _mm_setzero_si128())) & 0xffff;
+        if (hit)
+            return i + __builtin_ctz(hit);
+    }
+    return i + filter_prefilter_scalar(f, p + i, len - i);
+}
+#endif
+
+unsigned int filter_prefilter(const filter_t *f, const unsigned char *p, unsigned int len) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (filter_simd)
+        return filter_prefilter_ssse3(f, p, len);
+#endif
+    return filter_prefilter_scalar(f, p, len);
+}
+
+/* Load filter.txt again if it changed (or force); a missing file turns the filter off */
+void filter_reload(bool force) {
+    struct stat st;
+    filter_t *f = NULL, *old;
+    FILE *fp;
+
+    if (stat(FILTER_FILE, &st) < 0) {
+        if (filter == NULL)
+            return;
+        st.st_mtime = 0;
+    }
+    else if (!force && st.st_mtime == filter_mtime) {
+        return;
+    }
+    else if ((fp = fopen(FILTER_FILE, "r")) != NULL) {
+        f = filter_compile(fp);
+        fclose(fp);
+        if (f == NULL)
+            return;
+    }
+    filter_mtime = st.st_mtime;
+    pthread_rwlock_wrlock(&filter_lock);
+    old = filter;
+    filter = f;
+    pthread_rwlock_unlock(&filter_lock);
+    filter_free(old);
+    printf("Keyword filter: %u patterns\n", f ? f->npatterns : 0);
+}
+
+/* Apply the filter to one line in place; false if it is blocked */
+bool filter_line(client_t *cli, char *text) {
+    unsigned char mask[BUFFER_SZ + 1];
+    char line[BUFFER_SZ + 320];
+    unsigned int len = strlen(text), start;
+    struct timespec t0, t1;
+    bool masked = false, blocked = false;
+    int flagged = -1;
+    const filter_t *f;
+    unsigned long ns, max;
+
+    pthread_rwlock_rdlock(&filter_lock);
+    if ((f = filter) == NULL || f->npatterns == 0) {
+        pthread_rwlock_unlock(&filter_lock);
+        return true;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    filter_lines++;
+    if ((start = filter_prefilter(f, (unsigned char *)text, len)) == len) {
+        filter_skipped++;
+    }
+    else {
+        int s = 0;
+        memset(mask, 0, len);
+        for (unsigned int i = start; i < len && !blocked; i++) {
+            s = ac_next(f, s, tolower((unsigned char)text[i]));
+            for (int o = f->states[s].pattern >= 0 ? s : f->states[s].dict; o; o = f->states[o].dict) {
+                int p = f->states[o].pattern;
+                if (f->actions[p] == FILTER_BLOCK) {
+                    blocked = true;
+                    flagged = p;
+                    break;
+                }
+                if (f->actions[p] == FILTER_MASK) {
+                    memset(mask + i + 1 - f->lens[p], 1, f->lens[p]);
+                    masked = true;
+                }
+                else if (flagged < 0) {
+                    flagged = p;
+                }
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (masked && !blocked) {
+        /* One '*' per masked character; UTF-8 continuation bytes are dropped */
+        unsigned int out = 0;
+        for (unsigned int i = 0; i < len; i++) {
+            if (!mask[i])
+                text[out++] = text[i];
+            else if (((unsigned char)text[i] & 0xC0) != 0x80)
+                text[out++] = '*';
+        }
+        text[out] = '\0';
+        filter_masked++;
+    }
+    if (flagged >= 0) {
+        snprintf(line, sizeof(line), "%s %s \"%s\": %s%s", cli->username,
+            blocked ? "blocked" : "flagged", f->texts[flagged], text,
+            text[0] && text[strlen(text) - 1] == '\n' ? "" : "\n");
+    }
+    pthread_rwlock_unlock(&filter_lock);
+
+    /* Logged outside filter_lock so a reload never waits on the log queue */
+    if (flagged >= 0) {
+        update_log(line, "filter.log");
+        if (blocked)
+            filter_blocked++;
+        else
+            filter_flagged++;
+    }
+
+    ns = (t1.tv_sec - t0.tv_sec) * 1000000000UL + t1.tv_nsec - t0.tv_nsec;
+    filter_ns += ns;
+    max = filter_max_ns;
+    while (ns > max && !atomic_compare_exchange_weak(&filter_max_ns, &max, ns))
+        ;
+    return !blocked;
+}
+
+/* Handle one complete line from an authenticated client */
+void handle_line(client_t *cli, char *line, unsigned int len) {
+	char buff_out[BUFFER_SZ + 1];
+    char parse[BUFFER_SZ + 1];
+    char* IP, *PORT, *filename, *question;
+
+    memcpy(buff_out, line, len);
+    buff_out[len] = '\0';
+    if (strlen(buff_out) == 0)
+        return;
+    strcpy(parse, buff_out);
+    str_trim_lf(parse, strlen(parse));
+    if (strcmp(parse, "exit") == 0) {
+        cli->quitting = 1;
+        shutdown(cli->sockfd, SHUT_RD);
+        return;
+    }
+    if (strcmp(parse, "PONG") == 0)
+        return;
+    if (strncmp(parse, "JOIN ", 5) == 0) {
+        room_cmd_join(cli, parse + 5);
+        return;
+    }
+    if (strcmp(parse, "PART") == 0 || strncmp(parse, "PART ", 5) == 0) {
+        room_cmd_part(cli, parse + 4 + (parse[4] == ' '));
+        return;
+    }
+    if (strcmp(parse, "PRESENCE OFF") == 0 || strcmp(parse, "PRESENCE ON") == 0) {
+        cli->presence_off = parse[10] == 'F';
+        return;
+    }
+    if (strcmp(parse, "DURABLE ON") == 0 || strcmp(parse, "DURABLE OFF") == 0) {
+        cli->durable = parse[9] == 'N';
+        return;
+    }
+    if (strcmp(parse, "SEQ ON") == 0 || strcmp(parse, "SEQ OFF") == 0) {
+        room_cmd_seq(cli, parse[5] == 'N');
+        return;
+    }
+    if (strncmp(parse, "MUTE", 4) == 0 && (parse[4] == '\0' || parse[4] == ' ')) {
+        room_cmd_mute(cli, parse + 4 + (parse[4] == ' '), true);
+        return;
+    }
+    if (strncmp(parse, "UNMUTE", 6) == 0 && (parse[6] == '\0' || parse[6] == ' ')) {
+        room_cmd_mute(cli, parse + 6 + (parse[6] == ' '), false);
+        return;
+    }
+    if (strncmp(parse, "ACK ", 4) == 0) {
+        room_cmd_ack(cli, parse + 4);
+        return;
+    }
+    if (strncmp(parse, "RESEND ", 7) == 0) {
+        room_cmd_resend(cli, parse + 7);
+        return;
+    }
+    if (strncmp(parse, "HISTORY ", 8) == 0) {
+        history_cmd(cli, parse + 8);
+        return;
+    }
+    if (strncmp(parse, "/search ", 8) == 0) {
+        search_cmd(cli, parse + 8);
+        return;
+    }
+    if (strncmp(parse, "SEND ", 5) != 0 && strncmp(parse, "VOTE ", 5) != 0) {
+        if (!filter_line(cli, buff_out)) {
+            send_reply(cli, "Message blocked by the keyword filter.\n");
+            return;
+        }
+        strcpy(parse, buff_out);
+        str_trim_lf(parse, strlen(parse));
+    }
+    if (parse[0] == '@') {
+        direct_message(cli, parse);
+        return;
+    }
+    if (cli->room == NULL) {
+        send_reply(cli, "You are not in a room. Use 'JOIN <room>'.\n");
+        return;
+    }
+    if (strncmp(parse, "VOTE ", 5) == 0) {
+        room_vote_cmd(cli, parse + 5);
+        return;
+    }
 
-        fclose(fp);
+    sketch_count(cli, cli->room->name);
+    if (!cli->durable)
+        room_log(cli->room, CHAT_LOG_MSG, cli->username, buff_out);
+    else if (!chat_log_durable(cli, CHAT_LOG_MSG, cli->room->name, buff_out))
+        send_reply(cli, "Not saved: the log queue is full.\n");
+    if (is_send_command(parse, &IP, &PORT, &filename)) {
+        /* Following bytes up to '*' are the file, relayed to the target */
+        cli->relay_uid = send_message_to(buff_out, IP, PORT);
+        cli->state = CONN_RELAY;
+    }
+    else if (is_vote_command(parse, &question)){
+        room_vote_open(cli, buff_out, question);
+    }
+    else {
+        msg_t *m = msg_new(buff_out, strlen(buff_out));
+        mentions_t mn;
+        if (m) {
+            mentions_scan(buff_out, &mn);
+            room_post(cli->room, m, cli->uid, &mn);
+            msg_release(m);
+        }
+        str_trim_lf(buff_out, strlen(buff_out));
+        printf("#%s %s -> %s\n", cli->room->name, buff_out, cli->username);
     }
-    return 0;
 }
 
-/*Hash Function: Convert the password into a hash*/
-unsigned long hash(unsigned char *str)
-{
-    unsigned long hash = 5381;
-    int c;
+/* Lines handle_line answers itself instead of posting them into the active
+   room; they count against the client's budget only */
+bool line_is_control(const char *p, unsigned int n) {
+    static const char *words[] = { "exit", "PONG", "PART", "MUTE", "UNMUTE", "PRESENCE ON", "PRESENCE OFF",
+        "DURABLE ON", "DURABLE OFF", "SEQ ON", "SEQ OFF", NULL };
+    static const char *prefixes[] = { "JOIN ", "PART ", "MUTE ", "UNMUTE ", "ACK ", "RESEND ", "HISTORY ",
+        "/search ", "@", NULL };
+    const char *nl = memchr(p, '\n', n);
 
-    while (c = *str++)
-        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+    if (nl)
+        n = nl - p;
+    for (int i = 0; words[i]; i++) {
+        if (strlen(words[i]) == n && memcmp(words[i], p, n) == 0)
+            return true;
+    }
+    for (int i = 0; prefixes[i]; i++) {
+        size_t len = strlen(prefixes[i]);
+        if (len <= n && memcmp(prefixes[i], p, len) == 0)
+            return true;
+    }
+    return false;
+}
 
-    return hash;
+/* Charge one unit to the client's (and the room's) budget; false pauses the client */
+bool rate_admit(client_t *c, unsigned int bytes, bool room) {
+    io_thread_t *io = c->io;
+    unsigned int now = io->wheel.now;
+    unsigned int wait = rate_wait(&c->rate, conf.client_msgs_per_sec, conf.client_bytes_per_sec, now);
+
+    if (wait > 0) {
+        client_throttles++;
+    }
+    else if (room && c->room) {
+        room_t *r = c->room;
+        pthread_mutex_lock(&r->state_lock);
+        wait = rate_wait(&r->rate, conf.room_msgs_per_sec, conf.room_bytes_per_sec, now);
+        if (wait == 0)
+            rate_charge(&r->rate, conf.room_msgs_per_sec, conf.room_bytes_per_sec, 1, bytes);
+        pthread_mutex_unlock(&r->state_lock);
+        if (wait > 0)
+            room_throttles++;
+    }
+    if (wait > 0) {
+        /* Stop reading; the socket buffer fills and TCP pushes back on the sender */
+        c->flags |= CLIENT_THROTTLED;
+        c->resume_at = now + (wait + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+        timer_arm_before(&io->wheel, &c->timer, wait);
+        return false;
+    }
+    rate_charge(&c->rate, conf.client_msgs_per_sec, conf.client_bytes_per_sec, 1, bytes);
+    return true;
 }
 
-/* Client structure */
-typedef struct{
-	struct sockaddr_in address;
-	int sockfd;
-	int uid;
-	char username[32];
-    char passwd[32];
-} client_t;
+/* Consume complete units (lines, relayed file) from data */
+unsigned int conn_consume(client_t *c, char *data, unsigned int len) {
+    unsigned int used = 0;
 
-client_t *clients[MAX_CLIENTS];
+    while (used < len && c->state != CONN_CLOSING) {
+        char *p = data + used;
+        unsigned int left = len - used;
+        char *end;
 
-pthread_mutex_t clnt_mutex = PTHREAD_MUTEX_INITIALIZER;
+        if (c->state == CONN_RELAY) {
+            unsigned int n = left;
+            if ((end = memchr(p, '*', left)) != NULL)
+                n = end - p + 1;
+            if (!rate_admit(c, n, false))
+                break;
+            if (end != NULL)
+                c->state = CONN_CHAT;
+            send_message_to_uid(p, n, c->relay_uid);
+            used += n;
+        }
+        else {
+            unsigned int n;
+            if (*p == '\0') {
+                used++;
+                continue;
+            }
+            if ((end = memchr(p, '\n', left)) != NULL)
+                n = end - p + 1;
+            else if (left >= BUFFER_SZ)
+                n = BUFFER_SZ;
+            else
+                break;
+            if (!rate_admit(c, n, !line_is_control(p, n)))
+                break;
+            handle_line(c, p, n > BUFFER_SZ ? BUFFER_SZ : n);
+            used += n;
+        }
+    }
+    return used;
+}
 
-bool is_send_command(char* msg, char** IP, char** PORT, char** filename) {
-    char* option;
-    char message[BUFFER_SZ + 1] = {};
+/* Resize the partial-input buffer to hold at least <need> bytes */
+int conn_in_reserve(client_t *c, unsigned int need) {
+    unsigned int cap;
+    char *buf;
 
-    strcpy(message, msg);
-    message[5] = '\0';
-    if (strcmp(message, "SEND ") == 0) {
-        option = msg + 5;
-        option = strtok(option, " ");
-        *IP = option;
-        option = strtok(NULL, " ");
-        *PORT = option;
-        option = strtok(NULL, " ");
-        *filename = option;
+    if (need <= c->in_cap && (c->in_cap <= 256 || need * 4 > c->in_cap))
+        return 0;
+    if ((buf = pool_alloc(need, &cap)) == NULL)
+        return -1;
+    memcpy(buf, c->in_buf, c->in_len);
+    pool_free(c->in_buf, c->in_cap);
+    conn_buffer_bytes += (long)cap - c->in_cap;
+    c->in_buf = buf;
+    c->in_cap = cap;
+    return 0;
+}
 
-        return true;
+void conn_in_release(client_t *c) {
+    pool_free(c->in_buf, c->in_cap);
+    conn_buffer_bytes -= c->in_cap;
+    c->in_buf = NULL;
+    c->in_cap = 0;
+    c->in_len = 0;
+}
+
+/* Unregister a connection; it is freed after the current event batch */
+void conn_close(client_t *c) {
+	char buff_out[BUFFER_SZ];
+    io_thread_t *io = c->io;
+    bool keep;
+
+    if (c->state == CONN_CLOSING)
+        return;
+    queue_remove(c->uid);
+    user_index_remove(c);
+    sprintf(buff_out, "%s has left\n", c->username);
+    printf("%s", buff_out);
+    update_log(buff_out, "login.log");
+    keep = c->resume && !c->quitting;
+    if (keep)
+        c->resume->nrooms = 0;
+    while (c->nrooms > 0) {
+        room_t *r = c->rooms[c->nrooms - 1];
+        unsigned long long *last_seq = NULL;
+
+        room_log(r, CHAT_LOG_LEAVE, c->username, buff_out);
+        if (keep) {
+            /* Stay listed for the grace period; resume_expire announces the leave */
+            resume_t *rec = c->resume;
+            int i = rec->nrooms++;
+            snprintf(rec->rooms[i].name, sizeof(rec->rooms[i].name), "%s", r->name);
+            rec->rooms[i].gen = r->gen;
+            last_seq = &rec->rooms[i].seq;
+            if (r == c->room)
+                rec->active = i;
+        }
+        else {
+            presence_event(r, c->username, -1);
+        }
+        room_part(c, r, last_seq);
+    }
+    if (keep) {
+        c->resume->presence_off = c->presence_off;
+        c->resume->seq_on = c->seq_on;
+        resume_detach(c->resume);
     }
+    else if (c->resume) {
+        resume_drop(c->resume);
+    }
+    c->resume = NULL;
 
-    return false;
+    pthread_mutex_lock(&c->out_lock);
+    c->state = CONN_CLOSING;
+    pthread_mutex_unlock(&c->out_lock);
+    epoll_ctl(io->epfd, EPOLL_CTL_DEL, c->sockfd, NULL);
+    if (!(c->flags & CLIENT_AGAIN)) {
+        c->next_ready = io->closing;
+        io->closing = c;
+    }
 }
 
-bool is_vote_command(char* msg, char** question) {
-    char* option;
-    char message[BUFFER_SZ + 1] = {};
+void conn_free(client_t *c) {
+    io_thread_t *io = c->io;
 
-    strcpy(message, msg);
-    message[5] = '\0';
-    printf("%s\n%s\n", msg, message);
-    if (strcmp(message, "VOTE#") == 0) {
-        printf("TRUE\n");
-        option = msg + 5;
-        option = strtok(option, "#");
-        *question = option;
-        return true;
+    timer_cancel(&io->wheel, &c->timer);
+    pthread_mutex_lock(&io->mbox_lock);
+    if (c->out_flags & CLIENT_WRITE_LISTED) {
+        client_t **pp = &io->write_list;
+        while (*pp != c)
+            pp = &(*pp)->next_write;
+        *pp = c->next_write;
     }
+    pthread_mutex_unlock(&io->mbox_lock);
 
-    return false;
+    if (c->mailbox)
+        mailbox_written(c->mailbox, false);
+    while (c->out_count > 0) {
+        msg_release(c->out_q[c->out_head].msg);
+        c->out_head = (c->out_head + 1) % c->out_cap;
+        c->out_count--;
+    }
+    pool_free(c->out_q, c->out_cap * sizeof(struct out_ref));
+    conn_buffer_bytes -= c->out_cap * sizeof(struct out_ref);
+    conn_in_release(c);
+    close(c->sockfd);
+    pthread_mutex_destroy(&c->out_lock);
+    conn_struct_bytes -= c->cap;
+    pool_free(c, c->cap);
+    clnt_count--;
 }
-void vote(int uid){
-    int n, stop;
-    printf("Entered Vote Function\n");
-    send_message("\n1) YES\n2) NO\n3) NONE\n", uid);
-    printf("1) YES\n2) NO\n3) NONE\n");
-    printf(""); // input number
-    scanf("%d", &n);
-    if (n > 0 && n <= 3)
-    {
-        Vote_data(n);
+
+/* Read what is available; complete lines are handled from the scratch buffer */
+void conn_read(client_t *c) {
+    io_thread_t *io = c->io;
+
+    if (c->flags & CLIENT_THROTTLED)
+        return;
+    for (int round = 0; round < READ_ROUNDS; round++) {
+        ssize_t n = recv(c->sockfd, io->scratch, SCRATCH_SZ, 0);
+        unsigned int off = 0;
+
+        if (n == 0) {
+            conn_close(c);
+            return;
+        }
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                conn_close(c);
+            return;
+        }
+        thread_sample();
+        c->last_rx = io->wheel.now;
+        c->ping_sent = 0;
+
+        while (off < n) {
+            if (c->in_len > 0) {
+                /* Finish the partial unit carried over from the last read */
+                unsigned int take = n - off;
+                unsigned int used;
+                if (take > IN_MAX - c->in_len)
+                    take = IN_MAX - c->in_len;
+                if (conn_in_reserve(c, c->in_len + take) < 0) {
+                    conn_close(c);
+                    return;
+                }
+                memcpy(c->in_buf + c->in_len, io->scratch + off, take);
+                c->in_len += take;
+                off += take;
+                used = conn_consume(c, c->in_buf, c->in_len);
+                memmove(c->in_buf, c->in_buf + used, c->in_len - used);
+                c->in_len -= used;
+                if ((c->flags & CLIENT_THROTTLED) && off < n) {
+                    /* Keep the rest of this read until the client is resumed */
+                    if (conn_in_reserve(c, c->in_len + n - off) < 0) {
+                        conn_close(c);
+                        return;
+                    }
+                    memcpy(c->in_buf + c->in_len, io->scratch + off, n - off);
+                    c->in_len += n - off;
+                    off = n;
+                }
+            }
+            else {
+                off += conn_consume(c, io->scratch + off, n - off);
+                if (off < n && c->state != CONN_CLOSING) {
+                    if (conn_in_reserve(c, n - off) < 0) {
+                        conn_close(c);
+                        return;
+                    }
+                    memcpy(c->in_buf, io->scratch + off, n - off);
+                    c->in_len = n - off;
+                    off = n;
+                }
+            }
+            if (c->state == CONN_CLOSING)
+                return;
+        }
+
+        if (c->in_len == 0)
+            conn_in_release(c);
+        else
+            conn_in_reserve(c, c->in_len);
+        if (c->flags & CLIENT_THROTTLED)
+            return;
     }
-    else
-    {
-    printf("Enter Valid input\n");
+
+    /* More input is probably waiting; come back after the other connections */
+    if (!(c->flags & CLIENT_AGAIN)) {
+        c->flags |= CLIENT_AGAIN;
+        c->next_ready = io->again;
+        io->again = c;
     }
-    Vote_data(stop);
+}
 
+/* Handle the input held back while throttled, then read the socket again */
+void conn_resume(client_t *c) {
+    c->flags &= ~CLIENT_THROTTLED;
+    if (c->in_len > 0) {
+        unsigned int used = conn_consume(c, c->in_buf, c->in_len);
+        memmove(c->in_buf, c->in_buf + used, c->in_len - used);
+        c->in_len -= used;
+        if (c->state == CONN_CLOSING || (c->flags & CLIENT_THROTTLED))
+            return;
+        if (c->in_len == 0)
+            conn_in_release(c);
+        else
+            conn_in_reserve(c, c->in_len);
+    }
+    conn_read(c);
+}
 
+/* Free a pre-auth slot and optionally the socket with it */
+void preauth_release(io_thread_t *io, preauth_t *p, bool close_fd) {
+    if (close_fd) {
+        epoll_ctl(io->epfd, EPOLL_CTL_DEL, p->sockfd, NULL);
+        close(p->sockfd);
+    }
+    timer_cancel(&io->wheel, &p->timer);
+    p->kind = 0;
+    p->next_free = io->preauth_free;
+    io->preauth_free = p;
+    preauth_count--;
 }
 
-void Vote_data(int choice)
-{
-    int a = 0, b = 0, c = 0;
-    FILE* fp = fopen("vote.txt", "r"); 
-    if (fp == NULL)
-    {
-        fp = fopen("vote.txt", "w");
+/* Take over a newly accepted socket as a pre-auth entry */
+void io_adopt(io_thread_t *io, struct io_msg *im) {
+    struct epoll_event ev;
+    preauth_t *p = io->preauth_free;
+
+    if (p == NULL) {
+        close(im->fd);
+        preauth_count--;
+        preauth_rejected++;
+        return;
     }
-    if (!feof(fp))
-    {
-        fscanf(fp, "YES = %d\n", &a);
-        fscanf(fp, "NO = %d\n", &b);
-        fscanf(fp, "NONE = %d\n", &c);
+    io->preauth_free = p->next_free;
+    p->kind = KIND_PREAUTH;
+    p->got = 0;
+    p->sockfd = im->fd;
+    p->uid = im->uid;
+    p->address = im->address;
+    p->timer.kind = TIMER_PREAUTH;
+    timer_arm(&io->wheel, &p->timer, conf.handshake_timeout_ms);
+
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = p;
+    if (epoll_ctl(io->epfd, EPOLL_CTL_ADD, p->sockfd, &ev) < 0) {
+        perror("ERROR: epoll_ctl failed");
+        preauth_release(io, p, false);
+        close(im->fd);
     }
-    fp = fopen("vote.txt", "w");
-    if (choice == 1)
-    {
-        a++;
+}
+
+/* Turn an authenticated pre-auth entry into a full client */
+void preauth_promote(io_thread_t *io, preauth_t *p) {
+    struct epoll_event ev;
+    char username[32];
+    resume_t *resumed = NULL;
+    unsigned int cap;
+    client_t *c;
+    int rc;
+
+    if ((rc = client_auth(p->block, username, &resumed)) != 0) {
+        if (rc > 0)
+            send(p->sockfd, "RESUME RETRY\n", 13, MSG_NOSIGNAL);
+        else
+            preauth_failed++;
+        preauth_release(io, p, true);
+        return;
     }
-    if (choice == 2)
-    {
-        b++;
+    if (clnt_count >= (unsigned int)conf.max_clients) {
+        printf("Max clients reached. Rejected: ");
+        print_client_addr(p->address);
+        printf(":%d\n", p->address.sin_port);
+        if (resumed)
+            resume_detach(resumed);
+        preauth_release(io, p, true);
+        return;
     }
-    if (choice == 3)
-    {
-        c++;
+    if ((c = pool_alloc(sizeof(client_t), &cap)) == NULL) {
+        if (resumed)
+            resume_detach(resumed);
+        preauth_release(io, p, true);
+        return;
     }
-    fprintf(fp, "YES = %d\n", a);
-    fprintf(fp, "NO = %d\n", b);
-    fprintf(fp, "NONE = %d\n", c);
-        if ((a > b) && (a > c))
-        {
-            fprintf(fp, "YES won with votes of '%d'\n", a);
-        }
-        else if ((b > a) && (b > c))
-        {
-            fprintf(fp, "NO won with votes of '%d'\n", b);
-        }
-        else if ((c > b) && (c > a))
-        {
-            fprintf(fp, "NONE won with votes of '%d'\n", c);
-        }
-        else if ((a == b) && (b == c))
-        {
-            fprintf(fp, "Everything Equal with votes of '%d'\n", a);
-        }
-        else if (a == b)
-        {
-            fprintf(fp, "YES and NO Won Equal with votes of '%d' '%d'\n", a, b);
-        }
-        else if (a == c)
-        {
-            fprintf(fp, "YES and NONE Won Equal with votes of '%d' '%d'\n", a, c);
-        }
-        else if (b == c)
-        {
-            fprintf(fp, "NO and NONE Won Equal with votes of '%d' '%d'\n", b, c);
-        }
-        fclose(fp);
+
+    memset(c, 0, sizeof(client_t));
+    c->kind = KIND_CLIENT;
+    c->cap = cap;
+    c->address = p->address;
+    c->sockfd = p->sockfd;
+    c->uid = p->uid;
+    c->io = io;
+    c->relay_uid = -1;
+    c->state = CONN_CHAT;
+    strcpy(c->username, username);
+    pthread_mutex_init(&c->out_lock, NULL);
+    c->timer.kind = TIMER_CLIENT;
+    c->last_rx = io->wheel.now;
+    if (conf.heartbeat_ms > 0)
+        timer_arm(&io->wheel, &c->timer, conf.heartbeat_ms);
+    preauth_release(io, p, false);
+    conn_struct_bytes += cap;
+    clnt_count++;
+    preauth_promoted++;
+
+    /* Anything sent after the handshake is still in the socket and re-arms the entry */
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(io->epfd, EPOLL_CTL_MOD, c->sockfd, &ev) < 0) {
+        perror("ERROR: epoll_ctl failed");
+        c->state = CONN_CLOSING;
+        conn_free(c);
+        if (resumed)
+            resume_detach(resumed);
+        return;
     }
+    client_join(c, resumed);
+}
 
-void download_file(client_t* cli, char* IP, char* PORT) {
-    char buffer[BUFFER_SZ + 1] = {};
-    char* tmp;
-    int l = 0;
+/* Read the fixed-size username/password block */
+void preauth_read(io_thread_t *io, preauth_t *p) {
+    while (p->got < HANDSHAKE_SZ) {
+        ssize_t n = recv(p->sockfd, p->block + p->got, HANDSHAKE_SZ - p->got, 0);
 
-    FILE* fp = fopen("download.txt", "wb+");
-    int i = 0;
-    while (l = recv(cli->sockfd, buffer, BUFFER_SZ, 0)) {
-        if ((tmp = strstr(buffer, "*")) != NULL) {
-            send_message_to(buffer, IP, PORT);
-            break;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            printf("Didn't enter the Username.\n");
+            preauth_release(io, p, true);
+            return;
         }
-        send_message_to(buffer, IP, PORT);
+        p->got += n;
     }
+    thread_sample();
+    preauth_promote(io, p);
 }
 
-void update_log(char* message, char* filename) {
-    FILE *fp;
-    time_t current = time(NULL);
-    struct tm *now = localtime(&current);
-    
-    fp = fopen(filename, "a");
-    fprintf(fp, "[%04d/%02d/%02d] %02d:%02d:%02d %s"
-            ,1900 + now->tm_year, now->tm_mon + 1, now->tm_mday
-            ,now->tm_hour, now->tm_min, now->tm_sec, message);
-    fclose(fp);
+unsigned int wheel_ticks_now() {
+    return (unsigned int)(now_ms() / WHEEL_TICK_MS);
 }
 
-void str_overwrite_stdout() {
-    printf("\r%s", "> ");
-    fflush(stdout);
-}
+/* Throttle resume, heartbeat, idle eviction and write-stall checks for one client */
+void client_timer(io_thread_t *io, client_t *c) {
+    unsigned int now = io->wheel.now;
+    unsigned int next = WHEEL_MAX_TICKS * WHEEL_TICK_MS;
+    unsigned int idle, sent, pending;
 
-void str_trim_lf (char* arr, int length) {
-    int i;
-    for (i = 0; i < length; i++) { // trim \n
-        if (arr[i] == '\n') {
-            arr[i] = '\0';
-            break;
+    if (c->state == CONN_CLOSING)
+        return;
+
+    if ((c->flags & CLIENT_THROTTLED) && (int)(now - c->resume_at) >= 0) {
+        conn_resume(c);
+        if (c->state == CONN_CLOSING)
+            return;
+    }
+    if (c->flags & CLIENT_THROTTLED)
+        next = (c->resume_at - now) * WHEEL_TICK_MS;
+
+    idle = (now - c->last_rx) * WHEEL_TICK_MS;
+
+    if (conf.heartbeat_ms > 0) {
+        if (idle >= (unsigned int)conf.idle_timeout_ms) {
+            printf("Evicting idle client %s\n", c->username);
+            idle_evictions++;
+            conn_close(c);
+            return;
         }
+        if (idle >= (unsigned int)conf.heartbeat_ms && !c->ping_sent) {
+            msg_t *m = msg_new("PING\n", 5);
+            if (m) {
+                conn_send(c, m);
+                msg_release(m);
+            }
+            c->ping_sent = 1;
+            heartbeats_sent++;
+        }
+        if ((c->ping_sent ? conf.idle_timeout_ms : conf.heartbeat_ms) - idle < next)
+            next = (c->ping_sent ? conf.idle_timeout_ms : conf.heartbeat_ms) - idle;
     }
-}
 
-void print_client_addr(struct sockaddr_in serv_addr){
-    printf("%d.%d.%d.%d",
-        serv_addr.sin_addr.s_addr & 0xff,
-        (serv_addr.sin_addr.s_addr & 0xff00) >> 8,
-        (serv_addr.sin_addr.s_addr & 0xff0000) >> 16,
-        (serv_addr.sin_addr.s_addr & 0xff000000) >> 24);
+    pthread_mutex_lock(&c->out_lock);
+    pending = c->out_count;
+    sent = c->out_sent;
+    pthread_mutex_unlock(&c->out_lock);
+    if (pending && conf.write_stall_ms > 0) {
+        if (sent != c->write_mark) {
+            c->write_mark = sent;
+            c->write_since = now;
+        }
+        else if ((now - c->write_since) * WHEEL_TICK_MS >= (unsigned int)conf.write_stall_ms) {
+            printf("Evicting stalled client %s\n", c->username);
+            stall_evictions++;
+            conn_close(c);
+            return;
+        }
+        if (conf.write_stall_ms - (now - c->write_since) * WHEEL_TICK_MS < next)
+            next = conf.write_stall_ms - (now - c->write_since) * WHEEL_TICK_MS;
+    }
+    if (conf.heartbeat_ms > 0 || pending || (c->flags & CLIENT_THROTTLED))
+        timer_arm(&io->wheel, &c->timer, next);
 }
 
-/* Add clients to queue */
-void queue_add(client_t *clnt){
-	pthread_mutex_lock(&clnt_mutex);
+void io_timer_fire(void *ctx, wheel_timer_t *t) {
+    io_thread_t *io = ctx;
 
-	for(int i=0; i < MAX_CLIENTS; ++i){
-		if(!clients[i]){
-			clients[i] = clnt;
-			break;
-		}
-	}
-	pthread_mutex_unlock(&clnt_mutex);
+    if (t->kind == TIMER_PREAUTH) {
+        preauth_t *p = (preauth_t *)((char *)t - offsetof(preauth_t, timer));
+        preauth_timeouts++;
+        preauth_release(io, p, true);
+    }
+    else {
+        client_timer(io, (client_t *)((char *)t - offsetof(client_t, timer)));
+    }
 }
 
-/* Remove clients to queue */
-void queue_remove(int uid){
-	pthread_mutex_lock(&clnt_mutex);
+/* Start the write-stall clock for clients whose output backed up */
+void io_watch_writes(io_thread_t *io) {
+    client_t *c;
 
-	for(int i=0; i < MAX_CLIENTS; ++i){
-		if(clients[i]){
-			if(clients[i]->uid == uid){
-				clients[i] = NULL;
-				break;
-			}
-		}
-	}
+    pthread_mutex_lock(&io->mbox_lock);
+    c = io->write_list;
+    io->write_list = NULL;
+    while (c) {
+        client_t *next = c->next_write;
+        c->out_flags &= ~CLIENT_WRITE_LISTED;
+        if (c->state != CONN_CLOSING && conf.write_stall_ms > 0) {
+            c->write_mark = c->out_sent;
+            c->write_since = io->wheel.now;
+            timer_arm_before(&io->wheel, &c->timer, conf.write_stall_ms);
+        }
+        c = next;
+    }
+    pthread_mutex_unlock(&io->mbox_lock);
+}
 
-	pthread_mutex_unlock(&clnt_mutex);
+/* Hand a new socket to an I/O thread */
+void io_post(io_thread_t *io, int fd, int uid, struct sockaddr_in address) {
+    struct io_msg *im = malloc(sizeof(struct io_msg));
+    uint64_t one = 1;
+
+    if (im == NULL) {
+        close(fd);
+        preauth_count--;
+        preauth_rejected++;
+        return;
+    }
+    im->fd = fd;
+    im->uid = uid;
+    im->address = address;
+    pthread_mutex_lock(&io->mbox_lock);
+    im->next = io->mbox;
+    io->mbox = im;
+    pthread_mutex_unlock(&io->mbox_lock);
+    write(io->wakefd, &one, sizeof(one));
 }
 
-/* Send message to all clients except sender */
-void send_message(char *s, int uid){
-	pthread_mutex_lock(&clnt_mutex);
+/* Event loop of one I/O thread */
+void *io_main(void *arg) {
+    io_thread_t *io = arg;
+    struct epoll_event events[IO_EVENTS];
 
-	for(int i=0; i<MAX_CLIENTS; ++i){
-		if(clients[i]){
-			if(clients[i]->uid != uid){
-				if(write(clients[i]->sockfd, s, strlen(s)) < 0){
-					perror("ERROR: write to descriptor failed");
-					break;
-				}
-			}
-		}
-	}
+    thread_register(ROLE_IO);
+    io->scratch = node_local_alloc(SCRATCH_SZ);
+    io->preauth_slots = node_local_alloc(sizeof(preauth_t) * conf.max_preauth);
+    for (int i = conf.max_preauth - 1; i >= 0; i--) {
+        io->preauth_slots[i].next_free = io->preauth_free;
+        io->preauth_free = &io->preauth_slots[i];
+    }
+    wheel_init(&io->wheel, wheel_ticks_now());
+    if (conf.sketch_top > 0) {
+        io->sketches[0] = node_local_alloc(sizeof(struct sketch));
+        io->sketches[1] = node_local_alloc(sizeof(struct sketch));
+    }
 
-	pthread_mutex_unlock(&clnt_mutex);
-}
+    while (1) {
+        int timeout = io->again ? 0 : (io->wheel.count > 0 ? WHEEL_TICK_MS : -1);
+        int n = epoll_wait(io->epfd, events, IO_EVENTS, timeout);
+        client_t *again;
 
-void send_message_to(char* s, char* IP, char* PORT) {
-    pthread_mutex_lock(&clnt_mutex);
+        /* An empty wheel may have slept through many ticks; catch up before arming */
+        if (io->wheel.count == 0)
+            io->wheel.now = wheel_ticks_now();
 
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (clients[i]) {
-            if ((strcmp(inet_ntoa(clients[i]->address.sin_addr), IP) == 0)
-                && (clients[i]->address.sin_port == atoi(PORT))) {
-                if (write(clients[i]->sockfd, s, strlen(s)) < 0) {
-                    perror("ERROR: write to descriptor failed");
-                    break;
+        for (int i = 0; i < n; i++) {
+            client_t *c = events[i].data.ptr;
+            uint32_t ev = events[i].events;
+
+            if (c == NULL) {
+                struct io_msg *im;
+                uint64_t count;
+
+                read(io->wakefd, &count, sizeof(count));
+                pthread_mutex_lock(&io->mbox_lock);
+                im = io->mbox;
+                io->mbox = NULL;
+                pthread_mutex_unlock(&io->mbox_lock);
+                while (im) {
+                    struct io_msg *next = im->next;
+                    io_adopt(io, im);
+                    free(im);
+                    im = next;
                 }
+                io_watch_writes(io);
+                continue;
+            }
+            if (c->kind == KIND_PREAUTH) {
+                preauth_read(io, (preauth_t *)c);
+                continue;
+            }
+            if (c->state == CONN_CLOSING)
+                continue;
+            if (ev & EPOLLOUT)
+                conn_flush(c);
+            if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                conn_read(c);
+        }
+
+        /* Connections that still had input after their share of reads */
+        again = io->again;
+        io->again = NULL;
+        while (again) {
+            client_t *c = again;
+            again = c->next_ready;
+            c->flags &= ~CLIENT_AGAIN;
+            if (c->state == CONN_CLOSING) {
+                c->next_ready = io->closing;
+                io->closing = c;
+            }
+            else {
+                conn_read(c);
             }
         }
+
+        wheel_advance(&io->wheel, wheel_ticks_now(), io_timer_fire, io);
+
+        while (io->closing) {
+            client_t *c = io->closing;
+            io->closing = c->next_ready;
+            conn_free(c);
+        }
     }
+    return NULL;
+}
 
-    pthread_mutex_unlock(&clnt_mutex);
+void start_io_threads() {
+    io_threads = calloc(conf.io_threads, sizeof(io_thread_t));
+    sketch_since = wheel_ticks_now();
+    for (int i = 0; i < conf.io_threads; i++) {
+        io_thread_t *io = &io_threads[i];
+        struct epoll_event ev;
+
+        io->epfd = epoll_create1(EPOLL_CLOEXEC);
+        io->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        pthread_mutex_init(&io->mbox_lock, NULL);
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl(io->epfd, EPOLL_CTL_ADD, io->wakefd, &ev);
+        pthread_create(&io->tid, NULL, io_main, io);
+    }
+    for (int i = 0; i < conf.worker_threads; i++) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, worker_main, &background_jobs);
+        pthread_detach(tid);
+    }
+    for (int i = 0; i < conf.fanout_threads; i++) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, worker_main, &fanout_jobs);
+        pthread_detach(tid);
+    }
 }
 
-/* Handle all communication with the client */
-void *handle_client(void *arg){
-	char buff_out[BUFFER_SZ];
-    char buff_out_vote[BUFFER_SZ];
-	char username[32];
-    char passwd[32];
-	int leave_flag = 0;
-    char hashpass2[100];
-    char line[1000];
-    char* IP, *PORT, *filename, *question;
+/* Read user+system CPU time of a thread in milliseconds */
+unsigned long thread_cpu_ms(pid_t tid) {
+    char path[64], line[1024];
+    unsigned long utime = 0, stime = 0;
+    FILE *fp;
+    char *p;
 
-	clnt_count++;
-	client_t *cli = (client_t *)arg;
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+    if ((fp = fopen(path, "r")) == NULL)
+        return 0;
+    if (fgets(line, sizeof(line), fp) && (p = strrchr(line, ')')) != NULL)
+        sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+    fclose(fp);
+    return (utime + stime) * 1000 / sysconf(_SC_CLK_TCK);
+}
 
-	// username
-	if(recv(cli->sockfd, username, 32, 0) <= 0 || strlen(username) <  2 || strlen(username) >= 32-1){
-		printf("Didn't enter the Username.\n");
-		leave_flag = 1;
-	} 
-    else{
-        //password
-        if(recv(cli->sockfd, passwd, 32, 0) <= 0 || strlen(passwd) <  2 || strlen(passwd) >= 32-1){
-            printf("Didn't enter the Password.\n");
-		    leave_flag = 1;
-	    }
-        else{
-            strcpy(cli->passwd, passwd);
-
-            // converting the resultant hash(int) to hashpass2(char)
-            unsigned long hash1 = hash(passwd);
-            snprintf( hashpass2, DATA_SIZE, "%d", hash1 );
-            FILE * fPtr;
-
-            
-            /*
-            * Open file in r (read) mode.
-            * "user_auth.txt" is relative path to create file
-            */
-            fPtr = fopen("user_auth.txt", "r");
-
-            /* fopen() return NULL if last operation was unsuccessful */
-            if(fPtr == NULL){
-                /* File not created hence exit */
-                printf("Unable to read user_auth.txt file.\n");
-                exit(EXIT_FAILURE);
-            }
-
-            fgets(line, 1000, fPtr);
-
-            if(strcmp(line, hashpass2) == 10)
-            {
-                strcpy(cli->username, username);
-                    sprintf(buff_out, "%s:%d  \"%s\" has joined\n",
-                    inet_ntoa(cli->address.sin_addr), 
-                    cli->address.sin_port,
-                    cli->username);
-                update_log(buff_out, "login.log");
-                update_log(buff_out, "chatting.log");
-		        printf("%s", buff_out);
-		        send_message(buff_out, cli->uid);
-                fclose(fPtr);
-            }
-            else{
-                printf("Incorrect Password.\n");
-                sprintf(buff_out, "%s enter incorrect Password.\n", username);
-                update_log(buff_out, "login.log");
-		        leave_flag = 1;
-            }
-        }
-    }
-
-	bzero(buff_out, BUFFER_SZ);
+/* Write server stats as text */
+void print_stats(FILE *out) {
+    long conns = clnt_count;
 
-	while(1){
-		if (leave_flag) {
-			break;
-		}
+    fprintf(out, "clients %ld\n", conns);
+    fprintf(out, "conn_struct_bytes %ld\n", (long)conn_struct_bytes);
+    fprintf(out, "conn_buffer_bytes %ld\n", (long)conn_buffer_bytes);
+    fprintf(out, "bytes_per_conn %ld\n", conns ? (conn_struct_bytes + conn_buffer_bytes) / conns : 0);
+    fprintf(out, "preauth %ld\n", (long)preauth_count);
+    fprintf(out, "preauth_accepted %lu\n", preauth_accepted);
+    fprintf(out, "preauth_promoted %lu\n", preauth_promoted);
+    fprintf(out, "preauth_failed %lu\n", preauth_failed);
+    fprintf(out, "preauth_timeouts %lu\n", preauth_timeouts);
+    fprintf(out, "preauth_rejected %lu\n", preauth_rejected);
+    fprintf(out, "heartbeats_sent %lu\n", heartbeats_sent);
+    fprintf(out, "idle_evictions %lu\n", idle_evictions);
+    fprintf(out, "stall_evictions %lu\n", stall_evictions);
+    fprintf(out, "rooms %ld\n", (long)room_count);
+    fprintf(out, "online_users %ld\n", (long)online_users);
+    fprintf(out, "history_bytes %ld\n", (long)history_bytes_total);
+    fprintf(out, "acks_received %lu\n", acks_received);
+    fprintf(out, "resend_requests %lu\n", resend_requests);
+    fprintf(out, "log_records %lu\n", log_records);
+    fprintf(out, "log_dropped %lu\n", log_dropped);
+    fprintf(out, "log_audit_dropped %lu\n", log_audit_dropped);
+    fprintf(out, "log_enqueue_avg_ns %lu\n", log_records ? log_enqueue_ns / log_records : 0);
+    fprintf(out, "log_enqueue_max_ns %lu\n", log_enqueue_max_ns);
+    fprintf(out, "log_batches %lu\n", log_batches);
+    fprintf(out, "log_bytes %lu\n", log_bytes);
+    fprintf(out, "log_blocks %lu\n", log_blocks);
+    fprintf(out, "log_syncs %lu\n", log_syncs);
+    fprintf(out, "log_sync_avg_us %lu\n", log_syncs ? log_sync_us / log_syncs : 0);
+    fprintf(out, "log_sync_max_us %lu\n", log_sync_max_us);
+    fprintf(out, "log_acks_released %lu\n", log_acks_released);
+    fprintf(out, "history_queries %lu\n", history_queries);
+    fprintf(out, "history_segments %lu\n", history_segments);
+    fprintf(out, "history_blocks %lu\n", history_blocks);
+    fprintf(out, "history_avg_us %lu\n", history_queries ? history_query_us / history_queries : 0);
+    pthread_rwlock_rdlock(&search_lock);
+    fprintf(out, "search_messages %u\n", search_ndocs);
+    fprintf(out, "search_terms %u\n", search_nterms);
+    fprintf(out, "search_postings_bytes %lu\n", search_post_bytes);
+    pthread_rwlock_unlock(&search_lock);
+    fprintf(out, "search_queries %lu\n", search_queries);
+    fprintf(out, "search_avg_us %lu\n", search_queries ? search_query_us / search_queries : 0);
+    fprintf(out, "search_checkpoints %lu\n", search_checkpoints);
+    repl_print_stats(out);
+    fprintf(out, "log_streams %lu\n", log_stream_count);
+    fprintf(out, "log_open_fds %lu\n", log_open_fds);
+    fprintf(out, "log_fd_evictions %lu\n", log_fd_evictions);
+    fprintf(out, "log_idle_closes %lu\n", log_idle_closes);
+    fprintf(out, "log_segments_opened %lu\n", log_segments_opened);
+    fprintf(out, "log_segments_compressed %lu\n", log_segments_compressed);
+    fprintf(out, "log_compress_in_bytes %lu\n", log_compress_in);
+    fprintf(out, "log_compress_out_bytes %lu\n", log_compress_out);
+    fprintf(out, "fanout_parallel_posts %lu\n", fanout_parallel_posts);
+    fprintf(out, "fanout_helper_chunks %lu\n", fanout_helper_chunks);
+    fprintf(out, "mentions_found %lu\n", mentions_found);
+    fprintf(out, "mention_notices %lu\n", mention_notices);
+    pthread_rwlock_rdlock(&filter_lock);
+    fprintf(out, "filter_patterns %u\n", filter ? filter->npatterns : 0);
+    pthread_rwlock_unlock(&filter_lock);
+    fprintf(out, "filter_simd %d\n", filter_simd);
+    fprintf(out, "filter_lines %lu\n", filter_lines);
+    fprintf(out, "filter_prefilter_skips %lu\n", filter_skipped);
+    fprintf(out, "filter_blocked %lu\n", filter_blocked);
+    fprintf(out, "filter_masked %lu\n", filter_masked);
+    fprintf(out, "filter_flagged %lu\n", filter_flagged);
+    fprintf(out, "filter_avg_ns %lu\n", filter_lines ? filter_ns / filter_lines : 0);
+    fprintf(out, "filter_max_ns %lu\n", filter_max_ns);
+    fprintf(out, "presence_events %lu\n", presence_events);
+    fprintf(out, "presence_coalesced %lu\n", presence_coalesced);
+    fprintf(out, "presence_batches %lu\n", presence_batches);
+    fprintf(out, "resume_waiting %ld\n", (long)resume_waiting);
+    fprintf(out, "resume_resumed %lu\n", resume_resumed);
+    fprintf(out, "resume_expired %lu\n", resume_expired);
+    fprintf(out, "mailbox_stored %lu\n", mailbox_stored);
+    fprintf(out, "mailbox_delivered %lu\n", mailbox_delivered);
+    fprintf(out, "mailbox_rejected %lu\n", mailbox_rejected);
+    fprintf(out, "mailbox_segments_removed %lu\n", mailbox_segments_removed);
+    fprintf(out, "client_throttles %lu\n", client_throttles);
+    fprintf(out, "room_throttles %lu\n", room_throttles);
+    for (int i = 0; i < conf.io_threads; i++)
+        fprintf(out, "io%d_timers %ld\n", i, io_threads[i].wheel.count);
+    fprintf(out, "pool_in_use %ld\n", (long)pool_in_use);
+    fprintf(out, "pool_reserved %ld\n", (long)pool_reserved);
+    fprintf(out, "numa_nodes %d\n", numa_nodes);
+    fprintf(out, "%-8s %-8s %-6s %-5s %-5s %-10s %-10s %-10s %-10s\n",
+        "role", "tid", "pinned", "cpu", "node", "cpu_ms", "samples", "migrate", "xnode");
 
-		int receive = recv(cli->sockfd, buff_out, BUFFER_SZ, 0);
-		if (receive > 0){
-			if(strlen(buff_out) > 0){
-                update_log(buff_out, "chatting.log");
-                if (is_send_command(buff_out, &IP, &PORT, &filename)) {
-                    send_message_to(buff_out, IP, PORT);
-                    download_file(cli, IP, PORT);
-                }
-                else if (is_vote_command(buff_out, &question)){
-                    printf("Entered elseif \n");
-                    send_message(buff_out, cli->uid);
-                    vote(cli->uid);
-                    result_vote();
-                }
-                else {
-                    printf("Else Condition entered. NOT VOTE/SEND\n");
-                    send_message(buff_out, cli->uid);
-                    str_trim_lf(buff_out, strlen(buff_out));
-                    printf("%s -> %s\n", buff_out, cli->username);
-                }
-			}
-		} 
-        else if (receive == 0 || strcmp(buff_out, "exit") == 0){
-			sprintf(buff_out, "%s has left\n", cli->username);
-			printf("%s", buff_out);
-            update_log(buff_out, "chatting.log");
-            update_log(buff_out, "login.log");
-			send_message(buff_out, cli->uid);
-			leave_flag = 1;
-		} 
-        else {
-			printf("ERROR: -1\n");
-			leave_flag = 1;
-		}
+    pthread_mutex_lock(&thread_stats_mutex);
+    for (int i = 0; i < MAX_THREADS; i++) {
+        thread_stats_t *ts = &thread_stats[i];
+        if (!ts->in_use)
+            continue;
+        fprintf(out, "%-8s %-8d %-6d %-5d %-5d %-10lu %-10lu %-10lu %-10lu\n",
+            role_names[ts->role], ts->tid, ts->pinned_cpu, ts->cpu, cpu_node(ts->cpu),
+            thread_cpu_ms(ts->tid), ts->samples, ts->migrations, ts->node_migrations);
+    }
+    pthread_mutex_unlock(&thread_stats_mutex);
+}
 
-		bzero(buff_out, BUFFER_SZ);
-	}
+void start_presence() {
+    pthread_t tid;
 
-  /* Delete client from queue and yield thread */
-	close(cli->sockfd);
-    queue_remove(cli->uid);
-    free(cli);
-    clnt_count--;
-    pthread_detach(pthread_self());
+    if (conf.presence_ms < 10)
+        conf.presence_ms = 10;
+    pthread_create(&tid, NULL, presence_main, NULL);
+    pthread_detach(tid);
+}
+
+/* Local admin interface: one text command per line ("stats", "reload filter",
+   "top", "rate <user>|#<room>") */
+void *admin_thread(void *arg) {
+    int admin_sock = *(int *)arg;
+
+    thread_register(ROLE_ADMIN);
+    while (1) {
+        char cmd[64];
+        int fd = accept(admin_sock, NULL, NULL);
+        FILE *in;
+
+        if (fd < 0)
+            continue;
+        if ((in = fdopen(fd, "r+")) == NULL) {
+            close(fd);
+            continue;
+        }
+        while (fgets(cmd, sizeof(cmd), in)) {
+            str_trim_lf(cmd, strlen(cmd));
+            if (strcmp(cmd, "stats") == 0)
+                print_stats(in);
+            else if (strcmp(cmd, "reload filter") == 0)
+                filter_reload(true);
+            else if (strcmp(cmd, "top") == 0)
+                sketch_print_top(in);
+            else if (strncmp(cmd, "rate ", 5) == 0)
+                sketch_print_rate(in, cmd + 5);
+            else
+                fprintf(in, "unknown command: %s\n", cmd);
+            fprintf(in, ".\n");
+            fflush(in);
+        }
+        fclose(in);
+    }
+    return NULL;
+}
 
-	return NULL;
+/* Start the admin thread listening on 127.0.0.1:<admin_port> */
+void start_admin(int port) {
+    static int admin_sock;
+    struct sockaddr_in addr;
+    int option = 1;
+    pthread_t tid;
+
+    admin_sock = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    setsockopt(admin_sock, SOL_SOCKET, SO_REUSEADDR, (char*)&option, sizeof(option));
+    if (bind(admin_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(admin_sock, 4) < 0) {
+        perror("ERROR: admin socket");
+        exit(1);
+    }
+    pthread_create(&tid, NULL, &admin_thread, &admin_sock);
+    pthread_detach(tid);
 }
 
 int main(int argc, char **argv){
     char hashpass[100];
-	if(argc != 3){
-		printf("Usage: %s <port> <password>\n", argv[0]);
+    struct rlimit rl;
+	if(argc < 3){
+		printf("Usage: %s <port> <password> [option=value ...]\n", argv[0]);
 		exit(1);
 	}
 
+    for (int i = 3; i < argc; i++) {
+        if (parse_config_arg(argv[i]) < 0) {
+            printf("Invalid option: %s\n", argv[i]);
+            exit(1);
+        }
+    }
+    if (conf.io_threads < 1)
+        conf.io_threads = 1;
+    if (conf.max_clients < 1)
+        conf.max_clients = MAX_CLIENTS;
+    if (conf.max_preauth < 1)
+        conf.max_preauth = 1;
+    if (conf.fanout_chunk < 1)
+        conf.fanout_chunk = 1;
+    if (conf.history_msgs > HISTORY_MAX)
+        conf.history_msgs = HISTORY_MAX;
+    clients = calloc(conf.max_clients, sizeof(client_t *));
+
+    /* One descriptor per client */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    load_numa_topology();
+    pool_init();
+    for (int i = 0; i < MAILBOX_LOCKS; i++)
+        pthread_mutex_init(&mailbox_locks[i], NULL);
+    mkdir(MAILBOX_DIR, 0700);
+    start_logger();
+#if defined(__x86_64__) || defined(__i386__)
+    filter_simd = __builtin_cpu_supports("ssse3");
+#endif
+    filter_reload(true);
+    thread_register(ROLE_ACCEPT);
+
     //Creating a password file
     FILE * fPtr;
     fPtr = fopen("user_auth.txt", "w+");
@@ -457,9 +7496,9 @@ int main(int argc, char **argv){
 
 	int option = 1;
 	int serv_sock = 0, connfd = 0;
+    unsigned int next_io = 0;
     struct sockaddr_in serv_addr;
     struct sockaddr_in clnt_addr;
-    pthread_t tid;
 
     /* Socket settings */
     serv_sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -482,38 +7521,40 @@ int main(int argc, char **argv){
     }
 
     /* Listen */
-    if (listen(serv_sock, 10) < 0) {
+    if (listen(serv_sock, SOMAXCONN) < 0) {
         perror("ERROR: Socket listening failed");
         exit(1);
 	}
 
-	printf("<>?<>?<>?<>? Capstone Design 2 Chatroom Server ?<>?<>?<>?<>\n");
+    start_io_threads();
+    start_presence();
+    start_replication();
+    if (conf.admin_port > 0)
+        start_admin(conf.admin_port);
+
+    printf("<>?<>?<>?<>? Capstone Design 2 Chatroom Server ?<>?<>?<>?<>\n");
 
 	while(1){
 		socklen_t clilen = sizeof(clnt_addr);
-		connfd = accept(serv_sock, (struct sockaddr*)&clnt_addr, &clilen);
+		connfd = accept4(serv_sock, (struct sockaddr*)&clnt_addr, &clilen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (connfd < 0) {
+			if (errno == EMFILE || errno == ENFILE)
+				usleep(10000);
+			continue;
+		}
+		thread_sample();
 
-		/* Check if max clients is reached */
-		if((clnt_count + 1) == MAX_CLIENTS){
-			printf("Max clients reached. Rejected: ");
-			print_client_addr(clnt_addr);
-			printf(":%d\n", clnt_addr.sin_port);
+		/* Unauthenticated sockets only take a pre-auth slot */
+		if(preauth_count >= conf.max_preauth * conf.io_threads){
+			preauth_rejected++;
 			close(connfd);
 			continue;
 		}
 
-		/* Client settings */
-		client_t *cli = (client_t *)malloc(sizeof(client_t));
-		cli->address = clnt_addr;
-		cli->sockfd = connfd;
-		cli->uid = uid++;
-
-		/* Add client to the queue and fork thread */
-		queue_add(cli);
-		pthread_create(&tid, NULL, &handle_client, (void*)cli);
-
-		/* Reduce CPU usage */
-		sleep(1);
+		/* The I/O thread allocates the client on its own node after login */
+		preauth_count++;
+		preauth_accepted++;
+		io_post(&io_threads[next_io++ % conf.io_threads], connfd, uid++, clnt_addr);
 	}
 
 	return 0;
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdbool.h>
+#include <zlib.h>
+#include "chat_log.h"
+
+/*
+ * Streams binary chat log segments (logs/chatting.*.bin, gzipped or not) to
+ * stdout in the chatting.log text format. Blocks with a bad header or
+ * checksum are skipped and reported on stderr; the scan resynchronises on
+ * the next block magic.
+ *
+ *   ./log_export logs/chatting.*.bin*
+ */
+
+static struct chat_log_names users, rooms;
+
+const char *name_of(struct chat_log_names *t, unsigned long id) {
+    const char *name = chat_log_names_get(t, id);
+    return name ? name : "?";
+}
+
+/* Print one verified block; false if a record is malformed */
+bool export_block(const unsigned char *p, const unsigned char *end, unsigned long long when) {
+    char stamp[64];
+    long long stamp_sec = -1;
+
+    while (p < end) {
+        struct chat_log_record rec;
+
+        if ((p = chat_log_next_record(p, end, &rec)) == NULL)
+            return false;
+        when += rec.dt;
+        if (rec.type == CHAT_LOG_DEF_USER || rec.type == CHAT_LOG_DEF_ROOM) {
+            chat_log_names_define(rec.type == CHAT_LOG_DEF_USER ? &users : &rooms, rec.sender, rec.payload, rec.len);
+        }
+        else {
+            if ((long long)(when / 1000) != stamp_sec) {
+                struct tm tm;
+                time_t t = when / 1000;
+                localtime_r(&t, &tm);
+                snprintf(stamp, sizeof(stamp), "[%04d/%02d/%02d] %02d:%02d:%02d ",
+                    1900 + tm.tm_year, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+                stamp_sec = when / 1000;
+            }
+            printf("%s%c%s %.*s", stamp, rec.type == CHAT_LOG_DM ? '@' : '#',
+                rec.type == CHAT_LOG_DM ? name_of(&users, rec.room) : name_of(&rooms, rec.room),
+                (int)rec.len, rec.payload);
+        }
+    }
+    return true;
+}
+
+int export_file(const char *path) {
+    gzFile fp = gzopen(path, "rb");
+    unsigned char head[CHAT_LOG_HEADER], *payload = NULL;
+    size_t cap = 0;
+    long offset = 0;
+    int bad = 0, have = 0;
+    bool lost = false;
+
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    while (1) {
+        uint32_t size;
+
+        if (have < CHAT_LOG_HEADER) {
+            int n = gzread(fp, head + have, CHAT_LOG_HEADER - have);
+            if (n <= 0)
+                break;
+            have += n;
+            continue;
+        }
+        size = chat_log_get32(head + 4);
+
+        if (chat_log_get32(head) != CHAT_LOG_MAGIC || size > (64u << 20)) {
+            /* Not at a block boundary: drop one byte and look for the magic again */
+            if (!lost)
+                fprintf(stderr, "%s: bad block header at offset %ld\n", path, offset);
+            lost = true;
+            bad++;
+            offset++;
+            memmove(head, head + 1, --have);
+            continue;
+        }
+        have = 0;
+        lost = false;
+        if (size > cap) {
+            cap = size;
+            if ((payload = realloc(payload, cap)) == NULL) {
+                gzclose(fp);
+                return -1;
+            }
+        }
+        if (gzread(fp, payload, size) != (int)size) {
+            fprintf(stderr, "%s: truncated block at offset %ld\n", path, offset);
+            bad++;
+            break;
+        }
+        if (chat_log_crc32(payload, size) != chat_log_get32(head + 12)) {
+            fprintf(stderr, "%s: checksum mismatch in block at offset %ld, skipped\n", path, offset);
+            bad++;
+        }
+        else if (!export_block(payload, payload + size, chat_log_get64(head + 16))) {
+            fprintf(stderr, "%s: malformed record in block at offset %ld\n", path, offset);
+            bad++;
+        }
+        offset += CHAT_LOG_HEADER + size;
+    }
+    free(payload);
+    gzclose(fp);
+    return bad;
+}
+
+int main(int argc, char **argv) {
+    int status = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <logs/chatting.NNNNNN.bin[.gz]> [...]\n", argv[0]);
+        return 1;
+    }
+    for (int i = 1; i < argc; i++) {
+        size_t len = strlen(argv[i]);
+
+        /* Sparse indexes sit next to the segments and match the same globs */
+        if (len > 4 && strcmp(argv[i] + len - 4, ".idx") == 0)
+            continue;
+        if (export_file(argv[i]) != 0)
+            status = 1;
+    }
+    return status;
+}
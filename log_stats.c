@@ -0,0 +1,623 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "chat_log.h"
+
+/*
+ * Offline statistics over the server logs: messages per user, the hours of
+ * the day each user posts in, login sessions (join/leave pairs in
+ * login.log) and failed logins. Text logs (login.log, chatting.log, their
+ * segments) and binary segments (chatting.bin, rooms/<room>.bin) are
+ * memory-mapped and cut into chunks, text at line ends and binary at the
+ * restart points of the segment's .idx; gzipped segments are one chunk
+ * each. Worker threads take chunks in turn and count into tables of their
+ * own, which are merged at the end. Session events are kept per chunk and
+ * paired in file order after the merge, so list the segments in order
+ * (the shell sorts the zero-padded segment numbers).
+ *
+ *   ./log_stats [-t threads] logs/login.* logs/chatting.* logs/rooms/lobby.*
+ */
+
+#define CHUNK_BYTES (8UL << 20)
+#define NAME_MAX_LEN 32
+#define OPEN_SESSIONS 8
+
+typedef struct user_stat {
+    struct user_stat *next;
+    unsigned long messages;
+    unsigned long failed;
+    unsigned long hours[24];
+    unsigned long sessions;
+    long long session_sec, session_max;
+    long long open[OPEN_SESSIONS];      /* join times not yet paired (merge only) */
+    int nopen;
+    char name[NAME_MAX_LEN];
+} user_stat_t;
+
+typedef struct {
+    user_stat_t **buckets;
+    unsigned long nbuckets, count;
+} user_table_t;
+
+struct session_event {
+    long long when;             /* seconds */
+    bool join;
+    char name[NAME_MAX_LEN];
+};
+
+typedef struct {
+    const char *path;
+    unsigned char *map;
+    size_t size;
+    bool binary, gz;
+} log_input_t;
+
+typedef struct {
+    int input;
+    size_t start, end;
+    struct session_event *events;
+    unsigned int nevents, cap;
+    unsigned long bad;          /* damaged blocks */
+} chunk_t;
+
+static log_input_t *inputs;
+static int ninputs = 0;
+static chunk_t *chunks;
+static unsigned int nchunks = 0, chunks_cap = 0;
+static _Atomic unsigned int next_chunk = 0;
+static _Atomic unsigned long bytes_parsed = 0;
+static long tz_offset = 0;      /* local time minus UTC, seconds */
+
+unsigned long name_hash(const char *s, size_t len) {
+    unsigned long h = 5381;
+
+    while (len--)
+        h = h * 33 + (unsigned char)*s++;
+    return h;
+}
+
+user_stat_t *user_get(user_table_t *t, const char *name, size_t len) {
+    unsigned long h;
+    user_stat_t *u;
+
+    if (len >= NAME_MAX_LEN)
+        len = NAME_MAX_LEN - 1;
+    if (t->nbuckets == 0) {
+        t->nbuckets = 1024;
+        t->buckets = calloc(t->nbuckets, sizeof(user_stat_t *));
+    }
+    h = name_hash(name, len);
+    for (u = t->buckets[h & (t->nbuckets - 1)]; u; u = u->next) {
+        if (strncmp(u->name, name, len) == 0 && u->name[len] == '\0')
+            return u;
+    }
+    if (t->count >= t->nbuckets) {
+        unsigned long n = t->nbuckets * 2;
+        user_stat_t **b = calloc(n, sizeof(user_stat_t *));
+
+        for (unsigned long i = 0; i < t->nbuckets; i++) {
+            user_stat_t *e, *next;
+            for (e = t->buckets[i]; e; e = next) {
+                unsigned long nh = name_hash(e->name, strlen(e->name)) & (n - 1);
+                next = e->next;
+                e->next = b[nh];
+                b[nh] = e;
+            }
+        }
+        free(t->buckets);
+        t->buckets = b;
+        t->nbuckets = n;
+    }
+    u = calloc(1, sizeof(user_stat_t));
+    memcpy(u->name, name, len);
+    u->next = t->buckets[h & (t->nbuckets - 1)];
+    t->buckets[h & (t->nbuckets - 1)] = u;
+    t->count++;
+    return u;
+}
+
+void chunk_event(chunk_t *c, long long when, bool join, const char *name, size_t len) {
+    struct session_event *e;
+
+    if (c->nevents == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 64;
+        c->events = realloc(c->events, c->cap * sizeof(struct session_event));
+    }
+    e = &c->events[c->nevents++];
+    e->when = when;
+    e->join = join;
+    if (len >= NAME_MAX_LEN)
+        len = NAME_MAX_LEN - 1;
+    memcpy(e->name, name, len);
+    e->name[len] = '\0';
+}
+
+/* Days since 1970-01-01 of a civil date */
+long long days_from_civil(int y, int m, int d) {
+    int era, yoe, doy;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    return era * 146097LL + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+static inline int digits(const unsigned char *p, int n) {
+    int v = 0;
+
+    while (n--)
+        v = v * 10 + (*p++ - '0');
+    return v;
+}
+
+static inline bool ends_with(const unsigned char *p, const unsigned char *e, const char *s, size_t n) {
+    return (size_t)(e - p) >= n && memcmp(e - n, s, n) == 0;
+}
+
+/* One "[YYYY/MM/DD] HH:MM:SS <text>" line of chatting.log or login.log */
+void parse_line(user_table_t *t, chunk_t *c, const unsigned char *p, const unsigned char *e) {
+    const unsigned char *name, *q;
+    int hour;
+
+    while (e > p && (e[-1] == '\r' || e[-1] == ' '))
+        e--;
+    if (e - p < 23 || p[0] != '[' || p[11] != ']' || p[15] != ':')
+        return;
+    hour = digits(p + 13, 2);
+    if (hour > 23)
+        return;
+    p += 22;
+    if (*p == '#' || *p == '@') {
+        /* "#room user: text", "@to user: text"; "#room x has joined #room" is not a message */
+        if ((p = memchr(p, ' ', e - p)) == NULL)
+            return;
+        p++;
+    }
+    else if (ends_with(p, e, " enter incorrect Password.", 26)) {
+        user_get(t, (const char *)p, e - 26 - p)->failed++;
+        return;
+    }
+    else if (ends_with(p, e, " has joined", 11) || ends_with(p, e, " has left", 9)) {
+        /* login.log: "ip:port  \"user\" has joined", "user has left" */
+        const unsigned char *line = p - 22;
+        bool join = e[-1] == 'd';
+        long long when;
+
+        e -= join ? 11 : 9;
+        for (name = e; name > p && name[-1] != ' '; name--)
+            ;
+        if (e - name > 1 && *name == '"' && e[-1] == '"') {
+            name++;
+            e--;
+        }
+        when = (days_from_civil(digits(line + 1, 4), digits(line + 6, 2), digits(line + 9, 2)) * 24 + hour) * 3600 +
+            digits(line + 16, 2) * 60 + digits(line + 19, 2);
+        chunk_event(c, when, join, (const char *)name, e - name);
+        return;
+    }
+    /* "user: text" */
+    for (q = p; q < e && *q != ':' && *q != ' '; q++)
+        ;
+    if (q == e || *q != ':' || q == p)
+        return;
+    name = p;
+    {
+        user_stat_t *u = user_get(t, (const char *)name, q - name);
+        u->messages++;
+        u->hours[hour]++;
+    }
+}
+
+void parse_text(user_table_t *t, chunk_t *c, const unsigned char *p, const unsigned char *end) {
+    while (p < end) {
+        const unsigned char *nl = memchr(p, '\n', end - p);
+
+        if (nl == NULL)
+            nl = end;
+        parse_line(t, c, p, nl);
+        p = nl + 1;
+    }
+}
+
+/* Blocks from a restart point up to end; message records count for their
+   sender. zlib's crc32() is the same CRC-32 as chat_log_crc32(), only faster. */
+void parse_binary(user_table_t *t, chunk_t *c, const unsigned char *p, const unsigned char *end) {
+    struct chat_log_names names = { NULL, 0 };
+    /* Senders resolved once per id and chunk */
+    user_stat_t **users = NULL;
+    unsigned long users_cap = 0;
+    /* Hour of the day, recomputed only when a record leaves [hour_start, hour_start + 1h) */
+    long long hour_start = 0;
+    int hour = -1;
+
+    while (end - p >= CHAT_LOG_HEADER) {
+        uint32_t size = chat_log_get32(p + 4);
+        const unsigned char *r, *rend;
+        unsigned long long when;
+
+        if (chat_log_get32(p) != CHAT_LOG_MAGIC || size > (uint64_t)(end - p - CHAT_LOG_HEADER) ||
+            crc32(0, p + CHAT_LOG_HEADER, size) != chat_log_get32(p + 12)) {
+            const unsigned char *next = memmem(p + 1, end - p - 1, "CLB1", 4);
+            c->bad++;
+            if (next == NULL)
+                break;
+            p = next;
+            continue;
+        }
+        when = chat_log_get64(p + 16);
+        r = p + CHAT_LOG_HEADER;
+        rend = r + size;
+        p = rend;
+        while (r < rend) {
+            struct chat_log_record rec;
+            const char *name;
+            user_stat_t *u;
+
+            if ((r = chat_log_next_record(r, rend, &rec)) == NULL) {
+                c->bad++;
+                break;
+            }
+            when += rec.dt;
+            if (rec.type == CHAT_LOG_DEF_USER) {
+                chat_log_names_define(&names, rec.sender, rec.payload, rec.len);
+                if (rec.sender < users_cap)
+                    users[rec.sender] = NULL;
+                continue;
+            }
+            if ((rec.type != CHAT_LOG_MSG && rec.type != CHAT_LOG_DM) || (name = chat_log_names_get(&names, rec.sender)) == NULL)
+                continue;
+            if (rec.sender >= users_cap) {
+                unsigned long ncap = names.cap;
+                user_stat_t **n = realloc(users, ncap * sizeof(user_stat_t *));
+                if (n == NULL)
+                    continue;
+                memset(n + users_cap, 0, (ncap - users_cap) * sizeof(user_stat_t *));
+                users = n;
+                users_cap = ncap;
+            }
+            if ((u = users[rec.sender]) == NULL)
+                u = users[rec.sender] = user_get(t, name, strlen(name));
+            if (hour < 0 || (long long)when < hour_start || (long long)when - hour_start >= 3600000) {
+                long long local = (long long)when + tz_offset * 1000LL;
+                hour_start = local - local % 3600000 - tz_offset * 1000LL;
+                hour = local / 3600000 % 24;
+            }
+            u->messages++;
+            u->hours[hour]++;
+        }
+    }
+    chat_log_names_free(&names);
+    free(users);
+}
+
+/* Whole gzipped segment into memory */
+unsigned char *gunzip_file(const char *path, size_t *size) {
+    gzFile fp = gzopen(path, "rb");
+    unsigned char *buf = NULL;
+    size_t cap = 0, len = 0;
+    int n;
+
+    if (fp == NULL)
+        return NULL;
+    gzbuffer(fp, 256 << 10);
+    do {
+        if (len == cap) {
+            unsigned char *nb = realloc(buf, cap = cap ? cap * 2 : 4 << 20);
+            if (nb == NULL) {
+                free(buf);
+                gzclose(fp);
+                return NULL;
+            }
+            buf = nb;
+        }
+        n = gzread(fp, buf + len, cap - len);
+        if (n > 0)
+            len += n;
+    } while (n > 0);
+    gzclose(fp);
+    *size = len;
+    return buf;
+}
+
+void *worker_main(void *arg) {
+    user_table_t *t = arg;
+    unsigned int i;
+
+    while ((i = atomic_fetch_add(&next_chunk, 1)) < nchunks) {
+        chunk_t *c = &chunks[i];
+        log_input_t *in = &inputs[c->input];
+        const unsigned char *p = in->map;
+        unsigned char *buf = NULL;
+        size_t size = c->end - c->start;
+
+        if (in->gz) {
+            if ((buf = gunzip_file(in->path, &size)) == NULL) {
+                fprintf(stderr, "%s: cannot read\n", in->path);
+                continue;
+            }
+            p = buf;
+        }
+        else
+            p += c->start;
+        if (in->binary)
+            parse_binary(t, c, p, p + size);
+        else
+            parse_text(t, c, p, p + size);
+        atomic_fetch_add(&bytes_parsed, size);
+        free(buf);
+    }
+    return NULL;
+}
+
+void chunk_add(int input, size_t start, size_t end) {
+    if (nchunks == chunks_cap) {
+        chunks_cap = chunks_cap ? chunks_cap * 2 : 256;
+        chunks = realloc(chunks, chunks_cap * sizeof(chunk_t));
+    }
+    memset(&chunks[nchunks], 0, sizeof(chunk_t));
+    chunks[nchunks].input = input;
+    chunks[nchunks].start = start;
+    chunks[nchunks++].end = end;
+}
+
+/* Cut a mapped binary segment at the restart points of its .idx */
+void split_binary(int i) {
+    log_input_t *in = &inputs[i];
+    char idx[4096];
+    unsigned char *map;
+    size_t start = 0, n;
+    struct stat st;
+    int fd;
+
+    snprintf(idx, sizeof(idx), "%s.idx", in->path);
+    if ((fd = open(idx, O_RDONLY)) < 0) {
+        chunk_add(i, 0, in->size);
+        return;
+    }
+    if (fstat(fd, &st) < 0 || (n = st.st_size / CHAT_LOG_INDEX_ENTRY) == 0 ||
+        (map = mmap(NULL, n * CHAT_LOG_INDEX_ENTRY, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        chunk_add(i, 0, in->size);
+        return;
+    }
+    close(fd);
+    for (size_t k = 0; k < n; k++) {
+        size_t offset = chat_log_get64(map + k * CHAT_LOG_INDEX_ENTRY + 8);
+        if (offset > start && offset - start >= CHUNK_BYTES && offset < in->size) {
+            chunk_add(i, start, offset);
+            start = offset;
+        }
+    }
+    munmap(map, n * CHAT_LOG_INDEX_ENTRY);
+    chunk_add(i, start, in->size);
+}
+
+void split_text(int i) {
+    log_input_t *in = &inputs[i];
+    size_t start = 0;
+
+    while (in->size - start > CHUNK_BYTES) {
+        const unsigned char *nl = memchr(in->map + start + CHUNK_BYTES, '\n', in->size - start - CHUNK_BYTES);
+        if (nl == NULL)
+            break;
+        chunk_add(i, start, nl + 1 - in->map);
+        start = nl + 1 - in->map;
+    }
+    chunk_add(i, start, in->size);
+}
+
+bool input_open(const char *path, int i) {
+    log_input_t *in = &inputs[i];
+    size_t len = strlen(path), base = len;
+    struct stat st;
+    int fd;
+
+    memset(in, 0, sizeof(*in));
+    in->path = path;
+    if (len > 3 && strcmp(path + len - 3, ".gz") == 0) {
+        in->gz = true;
+        base -= 3;
+    }
+    in->binary = base > 4 && strncmp(path + base - 4, ".bin", 4) == 0;
+    if (in->gz) {
+        chunk_add(i, 0, 0);
+        return true;
+    }
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    in->size = st.st_size;
+    if (in->size > 0) {
+        in->map = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (in->map == MAP_FAILED) {
+            perror(path);
+            close(fd);
+            return false;
+        }
+        madvise(in->map, in->size, MADV_WILLNEED);
+    }
+    close(fd);
+    if (in->size == 0)
+        return true;
+    if (in->binary)
+        split_binary(i);
+    else
+        split_text(i);
+    return true;
+}
+
+/* Pair joins and leaves in log order; a leave closes the latest open join */
+void pair_sessions(user_table_t *t) {
+    for (unsigned int i = 0; i < nchunks; i++) {
+        for (unsigned int k = 0; k < chunks[i].nevents; k++) {
+            struct session_event *e = &chunks[i].events[k];
+            user_stat_t *u = user_get(t, e->name, strlen(e->name));
+
+            if (e->join) {
+                if (u->nopen == OPEN_SESSIONS) {
+                    memmove(u->open, u->open + 1, (OPEN_SESSIONS - 1) * sizeof(long long));
+                    u->nopen--;
+                }
+                u->open[u->nopen++] = e->when;
+            }
+            else if (u->nopen > 0) {
+                long long len = e->when - u->open[--u->nopen];
+                if (len < 0)
+                    len = 0;
+                u->sessions++;
+                u->session_sec += len;
+                if (len > u->session_max)
+                    u->session_max = len;
+            }
+        }
+        free(chunks[i].events);
+    }
+}
+
+void merge_table(user_table_t *into, user_table_t *from) {
+    for (unsigned long b = 0; b < from->nbuckets; b++) {
+        user_stat_t *u, *next;
+        for (u = from->buckets[b]; u; u = next) {
+            user_stat_t *m = user_get(into, u->name, strlen(u->name));
+            next = u->next;
+            m->messages += u->messages;
+            m->failed += u->failed;
+            for (int h = 0; h < 24; h++)
+                m->hours[h] += u->hours[h];
+            free(u);
+        }
+    }
+    free(from->buckets);
+}
+
+int user_cmp(const void *a, const void *b) {
+    const user_stat_t *x = *(user_stat_t * const *)a, *y = *(user_stat_t * const *)b;
+
+    if (x->messages != y->messages)
+        return x->messages < y->messages ? 1 : -1;
+    return strcmp(x->name, y->name);
+}
+
+/* Hours with messages as ranges: "9-11,14" */
+void format_hours(const unsigned long *hours, char *out, size_t size) {
+    size_t len = 0;
+
+    out[0] = '\0';
+    for (int h = 0; h < 24 && len < size; h++) {
+        int end = h;
+        if (hours[h] == 0)
+            continue;
+        while (end < 23 && hours[end + 1])
+            end++;
+        if (end == h)
+            len += snprintf(out + len, size - len, "%s%d", len ? "," : "", h);
+        else
+            len += snprintf(out + len, size - len, "%s%d-%d", len ? "," : "", h, end);
+        h = end;
+    }
+    if (len == 0)
+        snprintf(out, size, "-");
+}
+
+void report(user_table_t *t) {
+    user_stat_t **list = malloc((t->count + 1) * sizeof(user_stat_t *));
+    unsigned long n = 0, messages = 0, failed = 0, sessions = 0;
+
+    for (unsigned long b = 0; b < t->nbuckets; b++) {
+        for (user_stat_t *u = t->buckets[b]; u; u = u->next)
+            list[n++] = u;
+    }
+    qsort(list, n, sizeof(user_stat_t *), user_cmp);
+    printf("%-20s %10s %7s %8s %10s %10s  %s\n", "user", "messages", "failed", "sessions", "avg_min", "max_min", "active_hours");
+    for (unsigned long i = 0; i < n; i++) {
+        user_stat_t *u = list[i];
+        char hours[128];
+
+        format_hours(u->hours, hours, sizeof(hours));
+        printf("%-20s %10lu %7lu %8lu %10.1f %10.1f  %s%s\n", u->name, u->messages, u->failed, u->sessions,
+            u->sessions ? u->session_sec / 60.0 / u->sessions : 0.0, u->session_max / 60.0, hours,
+            u->nopen ? "  (logged in)" : "");
+        messages += u->messages;
+        failed += u->failed;
+        sessions += u->sessions;
+    }
+    printf("%lu users, %lu messages, %lu sessions, %lu failed logins\n", n, messages, sessions, failed);
+    free(list);
+}
+
+int main(int argc, char **argv) {
+    int threads = sysconf(_SC_NPROCESSORS_ONLN), first = 1, status = 0;
+    user_table_t *tables;
+    pthread_t *tids;
+    struct timespec t0, t1;
+    unsigned long bad = 0;
+    double sec;
+    time_t now = time(NULL);
+    struct tm tm;
+
+    if (argc > 2 && strcmp(argv[1], "-t") == 0) {
+        threads = atoi(argv[2]);
+        first = 3;
+    }
+    if (argc <= first || threads < 1) {
+        fprintf(stderr, "Usage: %s [-t threads] <logs/login.NNNNNN.log[.gz]> <logs/rooms/*.bin[.gz]> [...]\n", argv[0]);
+        return 1;
+    }
+    localtime_r(&now, &tm);
+    tz_offset = tm.tm_gmtoff;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    inputs = calloc(argc, sizeof(log_input_t));
+    for (int i = first; i < argc; i++) {
+        size_t len = strlen(argv[i]);
+
+        /* Sparse indexes sit next to the segments and match the same globs */
+        if (len > 4 && strcmp(argv[i] + len - 4, ".idx") == 0)
+            continue;
+        if (!input_open(argv[i], ninputs))
+            status = 1;
+        else
+            ninputs++;
+    }
+
+    tables = calloc(threads, sizeof(user_table_t));
+    tids = calloc(threads, sizeof(pthread_t));
+    for (int i = 1; i < threads; i++)
+        pthread_create(&tids[i], NULL, worker_main, &tables[i]);
+    worker_main(&tables[0]);
+    for (int i = 1; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        merge_table(&tables[0], &tables[i]);
+    }
+    for (unsigned int i = 0; i < nchunks; i++)
+        bad += chunks[i].bad;
+    pair_sessions(&tables[0]);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    report(&tables[0]);
+    sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fprintf(stderr, "%d files, %u chunks, %.1f MB in %.3f s (%.0f MB/s) on %d threads", ninputs, nchunks,
+        bytes_parsed / 1e6, sec, sec > 0 ? bytes_parsed / 1e6 / sec : 0.0, threads);
+    if (bad)
+        fprintf(stderr, ", %lu damaged blocks skipped", bad);
+    fprintf(stderr, "\n");
+    for (int i = 0; i < ninputs; i++) {
+        if (inputs[i].map && inputs[i].size)
+            munmap(inputs[i].map, inputs[i].size);
+    }
+    return status;
+}